@@ -0,0 +1,223 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_heap_caps.h"
+#include "cJSON.h"
+#include "arena.h"
+
+// Хуки cJSON ставятся только на время работы с деревом конфига: разбор в арену
+// и правки дерева между arenaGuard/arenaUnguard. Вне них стоят стандартные
+// malloc/free/realloc, и cJSON_Print расширяет буфер через realloc.
+// free по адресу внутри куска арены пропускается.
+// Захват привязан к таску, другие таски во время загрузки конфига идут в кучу.
+
+#define ARENA_CHUNK_SIZE    4096
+#define ARENA_MAX_CHUNKS    32
+#define ARENA_BIG_ALLOC     (ARENA_CHUNK_SIZE / 4)  // крупнее - сразу в кучу
+
+static const char *TAG = "ARENA";
+
+typedef struct {
+    uint8_t *base;
+    uint16_t used;
+    uint16_t gen;
+} arenaChunk_t;
+
+static arenaChunk_t chunks[ARENA_MAX_CHUNKS];
+static portMUX_TYPE arenaMux = portMUX_INITIALIZER_UNLOCKED;
+static TaskHandle_t captureTask = NULL;
+static uint16_t captureGen = 0;
+static int8_t captureChunk = -1;
+static uint16_t liveGen = 0;
+
+static uint8_t guardDepth = 0;
+
+static struct {
+    uint32_t allocs;
+    uint32_t fallbacks;         // не влезло в арену, ушло в кучу
+    uint32_t skippedFrees;
+    uint32_t released;          // освобождено поколений
+} stats;
+
+static int8_t chunkOf(const void *ptr) {
+    const uint8_t *p = ptr;
+    for (uint8_t i = 0; i < ARENA_MAX_CHUNKS; i++) {
+        if (chunks[i].base != NULL && p >= chunks[i].base && p < chunks[i].base + ARENA_CHUNK_SIZE)
+            return i;
+    }
+    return -1;
+}
+
+static int8_t chunkNew() {
+    uint8_t *base = malloc(ARENA_CHUNK_SIZE);
+    if (base == NULL)
+        return -1;
+    portENTER_CRITICAL(&arenaMux);
+    for (uint8_t i = 0; i < ARENA_MAX_CHUNKS; i++) {
+        if (chunks[i].base == NULL) {
+            chunks[i].base = base;
+            chunks[i].used = 0;
+            chunks[i].gen = captureGen;
+            portEXIT_CRITICAL(&arenaMux);
+            return i;
+        }
+    }
+    portEXIT_CRITICAL(&arenaMux);
+    free(base);
+    return -1;
+}
+
+static void *arenaAlloc(size_t size) {
+    size = (size + 3) & ~3;
+    if (size > ARENA_BIG_ALLOC)
+        return NULL;
+    if (captureChunk < 0 || chunks[captureChunk].used + size > ARENA_CHUNK_SIZE)
+        captureChunk = chunkNew();
+    if (captureChunk < 0)
+        return NULL;
+    void *p = chunks[captureChunk].base + chunks[captureChunk].used;
+    chunks[captureChunk].used += size;
+    stats.allocs++;
+    return p;
+}
+
+static void *hookMalloc(size_t size) {
+    if (captureTask != NULL && captureTask == xTaskGetCurrentTaskHandle()) {
+        void *p = arenaAlloc(size);
+        if (p != NULL)
+            return p;
+        stats.fallbacks++;
+    }
+    return malloc(size);
+}
+
+static void hookFree(void *ptr) {
+    if (ptr == NULL)
+        return;
+    portENTER_CRITICAL(&arenaMux);
+    int8_t chunk = chunkOf(ptr);
+    portEXIT_CRITICAL(&arenaMux);
+    if (chunk >= 0) {
+        stats.skippedFrees++;
+        return;
+    }
+    free(ptr);
+}
+
+void arenaGuard() {
+    // под sem_busy, вложенные вызовы допустимы
+    static cJSON_Hooks hooks = {
+        .malloc_fn = hookMalloc,
+        .free_fn = hookFree
+    };
+    if (guardDepth++ == 0)
+        cJSON_InitHooks(&hooks);
+}
+
+void arenaUnguard() {
+    if (guardDepth == 0)
+        return;
+    // NULL - стандартные malloc/free и снова realloc
+    if (--guardDepth == 0)
+        cJSON_InitHooks(NULL);
+}
+
+void arenaBegin() {
+    // новое поколение, под sem_busy
+    arenaGuard();
+    captureGen++;
+    if (captureGen == 0)
+        captureGen = 1;
+    captureChunk = -1;
+    captureTask = xTaskGetCurrentTaskHandle();
+}
+
+void arenaEnd() {
+    captureTask = NULL;
+    captureChunk = -1;
+    arenaUnguard();
+}
+
+cJSON *arenaParse(const char *text, uint16_t *gen) {
+    arenaBegin();
+    cJSON *json = cJSON_Parse(text);
+    *gen = captureGen;
+    arenaEnd();
+    return json;
+}
+
+cJSON *arenaDuplicate(cJSON *item, uint16_t *gen) {
+    arenaBegin();
+    cJSON *json = cJSON_Duplicate(item, true);
+    *gen = captureGen;
+    arenaEnd();
+    return json;
+}
+
+uint16_t arenaLive() {
+    return liveGen;
+}
+
+void arenaKeep(uint16_t keep) {
+    // оставить поколение текущего конфига, остальные освободить. Поколение знает
+    // только тот, кто разбирал дерево: узлы могут частично лежать в куче.
+    // 0 - конфиг в куче (загрузка при старте), освобождаются все.
+    uint8_t freed = 0;
+    for (uint8_t i = 0; i < ARENA_MAX_CHUNKS; i++) {
+        if (chunks[i].base == NULL || chunks[i].gen == keep)
+            continue;
+        portENTER_CRITICAL(&arenaMux);
+        uint8_t *base = chunks[i].base;
+        chunks[i].base = NULL;
+        portEXIT_CRITICAL(&arenaMux);
+        free(base);
+        freed++;
+    }
+    if (keep != liveGen && liveGen != 0)
+        stats.released++;
+    liveGen = keep;
+    ESP_LOGI(TAG, "Config generation %d, released %d chunks", keep, freed);
+}
+
+cJSON *arenaString(const char *value) {
+    // "on"/"off" не выделяются, узел ссылается на константу
+    if (!strcmp(value, "on"))
+        return cJSON_CreateStringReference("on");
+    if (!strcmp(value, "off"))
+        return cJSON_CreateStringReference("off");
+    return cJSON_CreateString(value);
+}
+
+void arenaAddInfo(cJSON *info) {
+    uint8_t count = 0;
+    uint32_t used = 0;
+    for (uint8_t i = 0; i < ARENA_MAX_CHUNKS; i++) {
+        if (chunks[i].base != NULL) {
+            count++;
+            used += chunks[i].used;
+        }
+    }
+    cJSON *jArena = cJSON_CreateObject();
+    cJSON_AddNumberToObject(jArena, "generation", liveGen);
+    cJSON_AddNumberToObject(jArena, "chunks", count);
+    cJSON_AddNumberToObject(jArena, "bytes", count * ARENA_CHUNK_SIZE);
+    cJSON_AddNumberToObject(jArena, "used", used);
+    cJSON_AddNumberToObject(jArena, "allocs", stats.allocs);
+    cJSON_AddNumberToObject(jArena, "fallbacks", stats.fallbacks);
+    cJSON_AddNumberToObject(jArena, "skippedFrees", stats.skippedFrees);
+    cJSON_AddNumberToObject(jArena, "released", stats.released);
+    cJSON_AddItemToObject(info, "arena", jArena);
+
+    // фрагментация: насколько самый большой свободный блок меньше всей свободной памяти
+    size_t freeSize = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+    size_t largest = heap_caps_get_largest_free_block(MALLOC_CAP_8BIT);
+    cJSON *jHeap = cJSON_CreateObject();
+    cJSON_AddNumberToObject(jHeap, "free", freeSize);
+    cJSON_AddNumberToObject(jHeap, "largest", largest);
+    cJSON_AddNumberToObject(jHeap, "minFree", heap_caps_get_minimum_free_size(MALLOC_CAP_8BIT));
+    cJSON_AddNumberToObject(jHeap, "fragmentation", freeSize > 0 ? 100 - largest * 100 / freeSize : 0);
+    cJSON_AddItemToObject(info, "heap", jHeap);
+}
@@ -0,0 +1,22 @@
+#pragma once
+#include <stdint.h>
+#include "cJSON.h"
+
+// Арена для дерева конфига. Пока открыт захват (arenaBegin/arenaEnd), все выделения
+// cJSON в этом таске идут в куски арены текущего поколения; освобождение таких узлов
+// ничего не делает, поколение освобождается целиком при замене конфига.
+// Узлы арены можно удалять только под arenaGuard: все замены, удаления и
+// ReplaceItem в дереве конфига идут между arenaGuard/arenaUnguard под sem_busy.
+// arenaParse/arenaDuplicate отдают поколение нового дерева, после замены конфига
+// оно передается в arenaKeep (0 - конфиг в куче), при отказе - arenaLive().
+
+void arenaGuard();
+void arenaUnguard();
+void arenaBegin();
+void arenaEnd();
+cJSON *arenaParse(const char *text, uint16_t *gen);
+cJSON *arenaDuplicate(cJSON *item, uint16_t *gen);
+void arenaKeep(uint16_t keep);
+uint16_t arenaLive();
+cJSON *arenaString(const char *value);
+void arenaAddInfo(cJSON *info);
@@ -0,0 +1,89 @@
+#include <stdio.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "cJSON.h"
+#include "config.h"
+#include "boot.h"
+
+// Запись конфига при загрузке (исправления, новый io) откладывается: запись во
+// флеш останавливает кэш обоих ядер. Выполняется из serviceTask через
+// BOOT_SAVE_DELAY_MS после конца initCore. Сетевые сервисы запускаются из
+// serviceTask, а не из обработчика событий сети.
+
+#define BOOT_SAVE_DELAY_MS  2000
+
+static const char *TAG = "BOOT";
+
+static const char *stageNames[BOOT_STAGES] = {
+    "config", "hardware", "ioModel", "localControl", "coreDone",
+    "networkUp", "services", "configSaved", "hello"
+};
+
+static int64_t stages[BOOT_STAGES];
+static bool savePending = false;
+static void (*servicesStart)(uint32_t) = NULL;
+static uint32_t servicesAddress = 0;
+static TaskHandle_t worker = NULL;
+
+void bootStage(uint8_t stage) {
+    // отмечается только первый раз
+    if (stage >= BOOT_STAGES || stages[stage] != 0)
+        return;
+    stages[stage] = esp_timer_get_time();
+    ESP_LOGI(TAG, "Stage %s at %u ms", stageNames[stage], (uint32_t)(stages[stage] / 1000));
+}
+
+bool bootDone() {
+    return stages[BOOT_CORE_DONE] != 0;
+}
+
+void bootSetWorker(TaskHandle_t task) {
+    worker = task;
+}
+
+void bootSaveConfig() {
+    if (bootDone()) {
+        saveConfig();
+        return;
+    }
+    savePending = true;
+}
+
+void bootDeferServices(void (*start)(uint32_t), uint32_t address) {
+    servicesAddress = address;
+    servicesStart = start;
+    if (worker != NULL)
+        xTaskNotifyGive(worker);
+}
+
+void bootRunDeferred(SemaphoreHandle_t sem) {
+    // из serviceTask
+    if (servicesStart != NULL) {
+        void (*start)(uint32_t) = servicesStart;
+        servicesStart = NULL;
+        start(servicesAddress);
+        bootStage(BOOT_SERVICES);
+    }
+    if (savePending && bootDone() &&
+        esp_timer_get_time() - stages[BOOT_CORE_DONE] >= BOOT_SAVE_DELAY_MS * 1000LL) {
+        if (xSemaphoreTake(sem, portMAX_DELAY) == pdTRUE) {
+            savePending = false;
+            saveConfig();
+            xSemaphoreGive(sem);
+            bootStage(BOOT_CONFIG_SAVED);
+        }
+    }
+}
+
+void bootAddInfo(cJSON *info) {
+    cJSON *jBoot = cJSON_CreateObject();
+    for (uint8_t i = 0; i < BOOT_STAGES; i++) {
+        if (stages[i] != 0)
+            cJSON_AddNumberToObject(jBoot, stageNames[i], stages[i] / 1000);
+    }
+    cJSON_AddItemToObject(info, "boot", jBoot);
+}
@@ -0,0 +1,30 @@
+#pragma once
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "cJSON.h"
+
+// Этапы загрузки с отметками времени от старта (esp_timer, без загрузчика).
+// Локальное управление поднимается первым, запись конфига и сетевые сервисы
+// откладываются и запускаются из serviceTask.
+
+enum bootStages {
+    BOOT_CONFIG = 0,            // конфиг прочитан
+    BOOT_HARDWARE,              // шина, тип платы, реле
+    BOOT_IO_MODEL,              // модель входов/выходов, выходы выставлены
+    BOOT_LOCAL_CONTROL,         // запущен inputsTask
+    BOOT_CORE_DONE,
+    BOOT_NETWORK_UP,            // первое подключение
+    BOOT_SERVICES,              // web, WS, MQTT, FTP запущены
+    BOOT_CONFIG_SAVED,          // отложенная запись конфига
+    BOOT_HELLO,                 // HELLO в облако
+    BOOT_STAGES
+};
+
+void bootStage(uint8_t stage);
+bool bootDone();
+void bootSetWorker(TaskHandle_t task);
+void bootSaveConfig();
+void bootDeferServices(void (*start)(uint32_t), uint32_t address);
+void bootRunDeferred(SemaphoreHandle_t sem);
+void bootAddInfo(cJSON *info);
@@ -0,0 +1,81 @@
+#include <stdio.h>
+#include <string.h>
+#include "esp_log.h"
+#include "cJSON.h"
+#include "config.h"
+#include "cfgref.h"
+
+// Узел ищется через родительский объект: getConfigValueObject гарантированно
+// отдает объекты, лист берется из него по имени. Путь без '/' - корневой ключ,
+// он ищется как есть, строка при неудаче - через getConfigValueString.
+// Отсутствующий путь тоже запоминается (node = NULL). Узел записывается в
+// ссылку раньше поколения: ссылка с текущим gen всегда указывает на новое дерево.
+
+#define CFG_REF_PATH_SIZE   64
+
+static const char *TAG = "CFGREF";
+
+// 0 у еще не разобранной ссылки, поэтому первое чтение всегда разбирает путь
+static uint32_t generation = 1;
+static uint32_t resolves = 0;
+
+void cfgRefInvalidate() {
+    generation++;
+}
+
+uint32_t cfgRefGeneration() {
+    return generation;
+}
+
+static cJSON *find(const char *path) {
+    char parent[CFG_REF_PATH_SIZE];
+    char *leaf = strrchr(path, '/');
+    if (leaf == NULL)
+        return getConfigValueObject((char*)path);
+    size_t len = leaf - path;
+    if (len >= sizeof(parent)) {
+        ESP_LOGE(TAG, "Path %s is too long", path);
+        return NULL;
+    }
+    memcpy(parent, path, len);
+    parent[len] = 0;
+    cJSON *jParent = getConfigValueObject(parent);
+    return cJSON_IsObject(jParent) ? cJSON_GetObjectItem(jParent, leaf + 1) : NULL;
+}
+
+static void resolve(cfgRef_t *ref) {
+    uint32_t gen = generation;
+    ref->node = find(ref->path);
+    ref->gen = gen;
+    resolves++;
+}
+
+cJSON *cfgRefObject(cfgRef_t *ref) {
+    if (ref->gen != generation)
+        resolve(ref);
+    return ref->node;
+}
+
+char *cfgRefString(cfgRef_t *ref) {
+    cJSON *node = cfgRefObject(ref);
+    if (cJSON_IsString(node))
+        return node->valuestring;
+    // корневая строка, если getConfigValueObject листья не отдает
+    return strchr(ref->path, '/') == NULL ? getConfigValueString(ref->path) : NULL;
+}
+
+int cfgRefInt(cfgRef_t *ref) {
+    cJSON *node = cfgRefObject(ref);
+    return cJSON_IsNumber(node) ? node->valueint : 0;
+}
+
+bool cfgRefBool(cfgRef_t *ref) {
+    return cJSON_IsTrue(cfgRefObject(ref));
+}
+
+void cfgRefAddInfo(cJSON *info) {
+    cJSON *jConfig = cJSON_CreateObject();
+    cJSON_AddNumberToObject(jConfig, "generation", generation);
+    cJSON_AddNumberToObject(jConfig, "resolves", resolves);
+    cJSON_AddItemToObject(info, "configRefs", jConfig);
+}
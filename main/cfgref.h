@@ -0,0 +1,29 @@
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+#include "cJSON.h"
+
+// Ссылка на значение конфига: путь разбирается при первом чтении, дальше узел
+// берется из ссылки, пока не сменилось поколение конфига. cfgRefInvalidate
+// вызывается до replaceConfig и setConfigValue*, пока старые узлы еще живы.
+// Ссылки и отданные ими узлы читаются только под sem_busy, как и сам конфиг;
+// без блокировки - только в initCore, пока конфиг некому сменить. Значения для
+// других задач копируются под sem_busy (identity, настройки PCA9685).
+//   static cfgRef_t enabled = CFG_REF("scheduler/enabled");
+//   if (!cfgRefBool(&enabled)) ...
+
+typedef struct {
+    char *path;
+    cJSON *node;
+    uint32_t gen;
+} cfgRef_t;
+
+#define CFG_REF(p)  {.path = (p), .node = NULL, .gen = 0}
+
+void cfgRefInvalidate();
+uint32_t cfgRefGeneration();
+cJSON *cfgRefObject(cfgRef_t *ref);
+char *cfgRefString(cfgRef_t *ref);
+int cfgRefInt(cfgRef_t *ref);
+bool cfgRefBool(cfgRef_t *ref);
+void cfgRefAddInfo(cJSON *info);
@@ -15,6 +15,23 @@
 #include "modbus.h"
 #include "mqtt.h"
 #include "ftp.h"
+#include "topics.h"
+#include "mqttpub.h"
+#include "wssender.h"
+#include "logship.h"
+#include "states.h"
+#include "wire.h"
+#include "iomodel.h"
+#include "arena.h"
+#include "health.h"
+#include "tasks.h"
+#include "i2cbus.h"
+#include "boot.h"
+#include "sensors.h"
+#include "history.h"
+#include "pulse.h"
+#include "identity.h"
+#include "cfgref.h"
 
 static const char *TAG = "CORE";
 static SemaphoreHandle_t sem_busy;
@@ -24,8 +41,8 @@ static cJSON *jMQTTTopics;
 static cJSON *mbSlaves;
 static bool mbSlave = false;
 static bool mqttConnected = false;
+static bool mqttEnabled = false;
 static bool wsConnected = false;
-static bool wsSendLogs = false;
 static uint8_t mbSlaveId = 0;
 static char* mbMode = "";
 static esp_reset_reason_t resetReason;
@@ -51,12 +68,25 @@ ControllerData controllersData[] = {
 uint32_t serviceButtonsTime[16] = {0}; // in ms
 uint32_t inputButtonsTime[32] = {0}; // in ms
 void processScheduler();
+void onConfigChanged();
+esp_err_t applyConfig(cJSON *config, uint16_t gen);
+void sendWearAlert(uint16_t mask);
 static bool reboot = false;
 
+// значения конфига, которые читаются не только при старте
+static cfgRef_t cfgModbusMode = CFG_REF("modbus/mode");
+static cfgRef_t cfgModbusSlaves = CFG_REF("modbus/slaves");
+static cfgRef_t cfgSchedulerEnabled = CFG_REF("scheduler/enabled");
+static cfgRef_t cfgMqttWire = CFG_REF("mqtt/wire");
+static uint8_t mqttWire = WIRE_JSON;     // mqtt/wire, копия для sendInfo вне sem_busy
+static cfgRef_t cfgMqttTopics = CFG_REF("mqtt/topics");
+static cfgRef_t cfgIO = CFG_REF("io");
+
 void determinateControllerType() {
     if (controllerType == UNKNOWN) {
-        char *cType = getConfigValueString("controllerType");
-        ESP_LOGI(TAG, "getConfigValueString %s", cType == NULL ? "NULL" : cType);
+        static cfgRef_t cfgControllerType = CFG_REF("controllerType");
+        char *cType = cfgRefString(&cfgControllerType);
+        ESP_LOGI(TAG, "controllerType %s", cType == NULL ? "NULL" : cType);
         if (cType != NULL) {
             if (!strcmp(cType, "small") || !strcmp(cType, "RCV1S")) {
                 controllerType = RCV1S;
@@ -67,6 +97,7 @@ void determinateControllerType() {
             controllerType = RCV1S; // by default
         }
         // write to config
+        cfgRefInvalidate();
         setConfigValueString("controllerType", controllersData[controllerType].name);
     }        
 }
@@ -94,7 +125,7 @@ esp_err_t createIOConfig() {
         snprintf(name, VARBUFFER, "Out %d", i);    
         cJSON_AddStringToObject(output, "name", name);
         cJSON_AddStringToObject(output, "type", "s");
-        cJSON_AddStringToObject(output, "state", "off");        
+        cJSON_AddItemToObject(output, "state", arenaString("off"));        
         cJSON_AddItemToArray(outputs, output);        
     }
     cJSON_AddItemToObject(IOConfig, "outputs", outputs);
@@ -198,21 +229,32 @@ const char* esp_reset_reason_to_string(esp_reset_reason_t reason) {
 
 void serviceTask(void *pvParameter) {
     ESP_LOGI(TAG, "Creating service task");
-    // uint32_t minMem = getConfigValueInt("watchdog", "wdtmemsize");
+    uint8_t healthTimer = 0;
     while(1) {   
-        // every 1 second     
-        // if ((minMem > 0) && (esp_get_free_heap_size() < minMem)) {
-        //     ESP_LOGE(TAG, "HEAP memory WDT triggered. Actual free memory is %d. Restarting...", esp_get_free_heap_size());
-        //     esp_restart();
-        // }
-        if (reboot) {
+        // every 1 second, раньше - по уведомлению о запуске сервисов
+        if (ulTaskNotifyTake(pdTRUE, 1000 / portTICK_RATE_MS) > 0) {
+            bootRunDeferred(sem_busy);
+            continue;
+        }
+        bootRunDeferred(sem_busy);
+        if (++healthTimer >= HEALTH_SAMPLE_SEC) {
+            // стеки и куча, при выходе за пороги - перезагрузка через reboot
+            healthTimer = 0;
+            healthCheck();
+        }
+        historyFlush();
+        uint16_t worn = relaysWearService(false);
+        if (worn)
+            sendWearAlert(worn);
+        if (reboot || healthRestartRequested()) {
             static uint8_t cntReboot = 0;
             if (cntReboot++ >= 3) {
                 ESP_LOGI(TAG, "Reboot now!");
+                relaysWearService(true);
+                pulseSave();
                 esp_restart();
             }
         }        
-        vTaskDelay(1000 / portTICK_RATE_MS);
     }
 }
 
@@ -220,8 +262,6 @@ cJSON* getDeviceInfoJson() {
     cJSON *status = cJSON_CreateObject();    
     char *uptime = getUpTime();
     char *curdate = getCurrentDateTime("%d.%m.%Y %H:%M:%S");
-    char *hostname = getConfigValueString("name");
-    char *description = getConfigValueString("description");
     char *version = getCurrentVersion();
     char *ethip = getETHIPStr();
     char *wifiip = getWIFIIPStr();
@@ -231,14 +271,33 @@ cJSON* getDeviceInfoJson() {
     cJSON_AddItemToObject(status, "uptime", cJSON_CreateString(uptime));
     cJSON_AddItemToObject(status, "uptimeRaw", cJSON_CreateNumber(getUpTimeRaw()));    
     cJSON_AddItemToObject(status, "curdate", cJSON_CreateString(curdate));
-    cJSON_AddItemToObject(status, "name", cJSON_CreateString(hostname));
-    cJSON_AddItemToObject(status, "description", cJSON_CreateString(description));          
+    cJSON_AddItemToObject(status, "name", cJSON_CreateString(identityName()));
+    cJSON_AddItemToObject(status, "description", cJSON_CreateString(identityDescription()));          
     cJSON_AddItemToObject(status, "version", cJSON_CreateString(version));
     cJSON_AddItemToObject(status, "wifiRSSI", cJSON_CreateNumber(getRSSI()));
     cJSON_AddItemToObject(status, "ethIP", cJSON_CreateString(ethip));
     cJSON_AddItemToObject(status, "wifiIP", cJSON_CreateString(wifiip));      
     cJSON_AddItemToObject(status, "model", cJSON_CreateString(controllersData[controllerType].name));      
     cJSON_AddItemToObject(status, "resetReason", cJSON_CreateString(esp_reset_reason_to_string(resetReason)));          
+    if (mqttEnabled)
+        mqttPubAddInfo(status);
+    wsSenderAddInfo(status);
+    logShipAddInfo(status);
+    statesAddInfo(status);
+    wireAddInfo(status);
+    iomodelAddInfo(status);
+    arenaAddInfo(status);
+    healthAddInfo(status);
+    relaysAddInfo(status);
+    relaysWearAddInfo(status);
+    topologyAddInfo(status);
+    i2cBusAddInfo(status);
+    sensorsAddInfo(status);
+    historyAddInfo(status);
+    pulseAddInfo(status);
+    tasksAddInfo(status);
+    cfgRefAddInfo(status);
+    bootAddInfo(status);
     free(uptime);
     free(curdate);  
     free(version);
@@ -257,26 +316,17 @@ void sendInfo() {
         return;
     }
     if (mqttConnected) {
-        char topic[50] = {0};
-        strcpy(topic, getConfigValueString("name"));
-        if (strlen(topic) == 0) {
-            strcpy(topic, "unknown");
-        }
-        strcat(topic, "/info\0");
-        char *data = cJSON_PrintUnformatted(payload);
-        MQTTPublish(topic, data);        
+        // mqtt/wire = cbor1 - компактный формат и для info
+        char *data = wirePrint(payload, mqttWire);
+        MQTTPublish((char*)identityTopic(IDENTITY_TOPIC_INFO), data);        
         free(data);
     }
     if (wsConnected) {
         cJSON *info = cJSON_CreateObject();
         cJSON_AddStringToObject(info, "type", "INFO");
         cJSON_AddItemToObject(info, "payload", payload);
-        char *infoBuf = cJSON_PrintUnformatted(info);
-        if (infoBuf != NULL) {      
-            WSSendMessageForce(infoBuf);
-            free(infoBuf);
-            cJSON_Delete(info);     
-        }   
+        wireSend(info, WS_PRIO_CONTROL, true);
+        cJSON_Delete(info);     
     }  
     //cJSON_Delete(payload);  
 }
@@ -314,57 +364,37 @@ void sendHello() {
     }
     //cJSON_AddItemToObject(payload, "info", getDeviceInfoJson());
     // add slaveId 
+    statesAddHello(payload);
+    wireAddHello(payload);
     cJSON_AddItemToObject(hello, "payload", payload);
     char *hello_str = cJSON_PrintUnformatted(hello);    
     cJSON_Delete(hello);
-    WSSendMessageForce(hello_str);
+    wsSend(hello_str, WS_PRIO_CONTROL, true);
+    bootStage(BOOT_HELLO);
     free(hello_str);
     free(token);
 }
 
-void updateValues() {
+static uint16_t outputsMask() {
+    // включенные выходы самого устройства
     uint16_t outputs = 0;
-    uint16_t inputsLeds = 0;
-    uint16_t outputsLeds = 0;
-
-    if (!cJSON_IsArray(cJSON_GetObjectItem(IOConfig, "outputs")) ||
-        !cJSON_IsArray(cJSON_GetObjectItem(IOConfig, "inputs"))) {
-        ESP_LOGE(TAG, "bad config");
-        return;
+    ioOutput_t *output;
+    for (uint16_t n = 0; (output = iomodelOutputAt(n)) != NULL; n++) {
+        if (output->slaveId == 0 && output->state == IO_STATE_ON)
+            setbit(outputs, output->id);
     }
+    return outputs;
+}
 
-    cJSON *childOutput = cJSON_GetObjectItem(IOConfig, "outputs")->child;
-    while (childOutput) {
-        uint8_t slaveId = 0;
-        if (cJSON_IsNumber(cJSON_GetObjectItem(childOutput, "slaveId")))
-            slaveId = cJSON_GetObjectItem(childOutput, "slaveId")->valueint;        
-        if (!cJSON_IsString(cJSON_GetObjectItem(childOutput, "state"))) {
-            cJSON_AddStringToObject(childOutput, "state", "off");
-        }
-        if (cJSON_IsNumber(cJSON_GetObjectItem(childOutput, "id")) &&
-            slaveId == 0) {
-            //ESP_LOGI(TAG, "id %d, state %s", cJSON_GetObjectItem(childOutput, "id")->valueint, )
-            if (!strcmp(cJSON_GetObjectItem(childOutput, "state")->valuestring, "on")) {
-                setbit(outputs, cJSON_GetObjectItem(childOutput, "id")->valueint);
-                setbit(outputsLeds, cJSON_GetObjectItem(childOutput, "id")->valueint);
-            }
-        }
-        childOutput = childOutput->next;
-    }
-    cJSON *childInput = cJSON_GetObjectItem(IOConfig, "inputs")->child;
-    while (childInput) {  
-        uint8_t slaveId = 0;
-        if (cJSON_IsNumber(cJSON_GetObjectItem(childInput, "slaveId")))
-            slaveId = cJSON_GetObjectItem(childInput, "slaveId")->valueint;        
-        if (!cJSON_IsString(cJSON_GetObjectItem(childInput, "state"))) {
-            cJSON_AddStringToObject(childInput, "state", "off");
-        }
-        if (cJSON_IsNumber(cJSON_GetObjectItem(childInput, "id")) &&
-            slaveId == 0) {
-            if (!strcmp(cJSON_GetObjectItem(childInput, "state")->valuestring, "on"))
-                setbit(inputsLeds, cJSON_GetObjectItem(childInput, "id")->valueint);
-        }
-        childInput = childInput->next;
+void updateValues() {
+    uint16_t outputs = outputsMask();
+    uint16_t inputsLeds = 0;
+    uint16_t outputsLeds = outputs;
+
+    ioInput_t *input;
+    for (uint16_t n = 0; (input = iomodelInputAt(n)) != NULL; n++) {
+        if (input->slaveId == 0 && input->state == IO_STATE_ON)
+            setbit(inputsLeds, input->id);
     }
     
     updateStateHW(outputs, inputsLeds, outputsLeds);   
@@ -379,15 +409,9 @@ void showError(uint8_t err) {
 
 void initInputs() {
     // по умолчанию все входы должны быть выключены, иначе отображается неправильно на индикации
-    cJSON *childInput = cJSON_GetObjectItem(IOConfig, "inputs")->child;
-    while (childInput) {  
-        if (cJSON_IsString(cJSON_GetObjectItem(childInput, "state"))) {
-            cJSON_ReplaceItemInObject(childInput, "state", cJSON_CreateString("off"));        
-        } else {
-            cJSON_AddItemToObject(childInput, "state", cJSON_CreateString("off"));        
-        }
-        childInput = childInput->next;
-    }
+    ioInput_t *input;
+    for (uint16_t n = 0; (input = iomodelInputAt(n)) != NULL; n++)
+        iomodelSetInput(input, IO_STATE_OFF);
 }
 
 void initOutputs() {
@@ -401,23 +425,19 @@ void initOutputs() {
         if (!cJSON_IsString(cJSON_GetObjectItem(childOutput, "default"))) {
             cJSON_AddItemToObject(childOutput, "default", cJSON_CreateString("off"));
         }
-
-        if (cJSON_IsString(cJSON_GetObjectItem(childOutput, "default"))) {
-            if (!strcmp(cJSON_GetObjectItem(childOutput, "default")->valuestring, "on")) {            
-                cJSON_ReplaceItemInObject(childOutput, "state", cJSON_CreateString("on"));
-            } else if (!strcmp(cJSON_GetObjectItem(childOutput, "default")->valuestring, "off")) {            
-                cJSON_ReplaceItemInObject(childOutput, "state", cJSON_CreateString("off"));
-            }
-        }
         childOutput = childOutput->next;
     }
-	// выключаем все выходы
-	updateStateHW(0x0, 0x0, 0x0);
+    ioOutput_t *output;
+    for (uint16_t n = 0; (output = iomodelOutputAt(n)) != NULL; n++)
+        iomodelSetOutput(output, output->defaultOn ? IO_STATE_ON : IO_STATE_OFF, output->timer);
+    // сразу выставляем состояния по умолчанию, не дожидаясь первого такта inputsTask
+    uint16_t outputs = outputsMask();
+    updateStateHW(outputs, 0x0, outputs);
 }
 
-void sendWSUpdateOutput(uint8_t pSlaveId, uint8_t pOutput, char* pState, uint16_t pTimer) {
+cJSON *getWSUpdateOutput(uint8_t pSlaveId, uint8_t pOutput, char* pState, uint16_t pTimer) {
     cJSON *payload = cJSON_CreateObject();
-    cJSON_AddStringToObject(payload, "mac", getMac());  
+    cJSON_AddStringToObject(payload, "mac", identityMac());  
     cJSON_AddItemToObject(payload, "output", cJSON_CreateNumber(pOutput));
     cJSON_AddStringToObject(payload, "state", pState);
     if (pSlaveId > 0) {
@@ -427,15 +447,18 @@ void sendWSUpdateOutput(uint8_t pSlaveId, uint8_t pOutput, char* pState, uint16_
     cJSON *json = cJSON_CreateObject();
     cJSON_AddStringToObject(json, "type", "UPDATE");
     cJSON_AddItemToObject(json, "payload", payload);
-    char* message = cJSON_PrintUnformatted(json);
-    WSSendMessage(message);
-    free(message);
+    return json;
+}
+
+void sendWSUpdateOutput(uint8_t pSlaveId, uint8_t pOutput, char* pState, uint16_t pTimer) {
+    cJSON *json = getWSUpdateOutput(pSlaveId, pOutput, pState, pTimer);
+    wireSend(json, WS_PRIO_STATE, false);
     cJSON_Delete(json);    
 }
 
 void sendWSUpdateInput(uint8_t pSlaveId, uint8_t pInput, char* pState) {
     cJSON *payload = cJSON_CreateObject();      
-    cJSON_AddStringToObject(payload, "mac", getMac());
+    cJSON_AddStringToObject(payload, "mac", identityMac());
     cJSON_AddItemToObject(payload, "input", cJSON_CreateNumber(pInput));
     cJSON_AddStringToObject(payload, "state", pState);
     if (pSlaveId > 0) {
@@ -444,147 +467,120 @@ void sendWSUpdateInput(uint8_t pSlaveId, uint8_t pInput, char* pState) {
     cJSON *json = cJSON_CreateObject();
     cJSON_AddStringToObject(json, "type", "UPDATE");
     cJSON_AddItemToObject(json, "payload", payload);
-    char* message = cJSON_PrintUnformatted(json);
-    WSSendMessage(message);
-    free(message);
+    wireSend(json, WS_PRIO_STATE, false);
     cJSON_Delete(json);
 }
 
+void mqttPublishOrQueue(char *topic, char *data, bool retain) {
+    // при отсутствии связи с брокером значение ждет в очереди до переподключения.
+    // retain - для состояний, у брокера остается последнее
+    if (mqttConnected) {
+        // значение из очереди после живого было бы устаревшим
+        mqttPubSuperseded(topic);
+        mqttPubPublish(topic, data, retain);
+    } else {
+        mqttPubQueue(topic, data, retain);
+    }
+}
+
+void sendWearAlert(uint16_t mask) {
+    // реле перешли порог износа, отправляется один раз (признак хранится в NVS)
+    cJSON *payload = cJSON_CreateObject();
+    cJSON_AddStringToObject(payload, "kind", "relayWear");
+    relaysWearJson(mask, cJSON_AddArrayToObject(payload, "relays"));
+    char *text = cJSON_PrintUnformatted(payload);
+    ESP_LOGW(TAG, "Relay wear alert: %s", text);
+    if (wsConnected) {
+        cJSON *json = cJSON_CreateObject();
+        cJSON_AddStringToObject(json, "type", "ALERT");
+        cJSON_AddItemToObject(json, "payload", payload);
+        wireSend(json, WS_PRIO_CONTROL, true);
+        cJSON_Delete(json);
+    } else {
+        cJSON_Delete(payload);
+    }
+    if (mqttEnabled) {
+        mqttPublishOrQueue((char*)identityTopic(IDENTITY_TOPIC_ALERTS), text, false);
+    }
+    free(text);
+}
+
 void publishOutput(uint8_t pSlaveId, uint8_t pOutput, char* pValue, uint8_t pTimer) {
-    sendWSUpdateOutput(pSlaveId, pOutput, pValue, pTimer);
+    // в режиме DELTA изменение уйдет ближайшим кадром, UPDATE только для старого протокола
+    if (!statesChanged(STATE_OUTPUT, pSlaveId, pOutput, pValue) || !statesDeltaMode())
+        sendWSUpdateOutput(pSlaveId, pOutput, pValue, pTimer);
+    if (!strcmp(pValue, "on") || !strcmp(pValue, "off"))
+        historyAddIO(false, pSlaveId, pOutput, !strcmp(pValue, "on"));
 
-    if (mqttConnected) {
+    if (mqttEnabled) {
         char topic[50] = {0};
         // hostname/outputs/slaveId/output
-        sprintf(topic, "%s/outputs/%d/%d", getConfigValueString("name"), pSlaveId, pOutput);
-        /*
-        char buf[5];
-        strcpy(topic, getConfigValueString("name"));
-        if (strlen(topic) == 0) {
-            strcpy(topic, getMac());
-        }
-        strcat(topic, "/outputs/");
-        itoa(pSlaveId, buf, 10);
-        strcat(topic, buf);
-        strcat(topic, "/");
-        itoa(pOutput, buf, 10);
-        strcat(topic, buf); 
-        strcat(topic, "\0");   
-        */
+        identityIOTopic(topic, sizeof(topic), false, pSlaveId, pOutput);
         // напрямую toUpper вызывает ошибку
         char actionUpper[10];
         strcpy(actionUpper, pValue);    
         strcat(actionUpper, "\0");           
-        MQTTPublish(topic, toUpper(actionUpper));        
+        mqttPublishOrQueue(topic, toUpper(actionUpper), true);        
     }
 }
 
 void publishInput(uint8_t pInput, char* pState, uint8_t pSlaveId) {
-    sendWSUpdateInput(pSlaveId, pInput, pState);
-    if (mqttConnected) {
+    if (!statesChanged(STATE_INPUT, pSlaveId, pInput, pState) || !statesDeltaMode())
+        sendWSUpdateInput(pSlaveId, pInput, pState);
+    if (!strcmp(pState, "on") || !strcmp(pState, "off"))
+        historyAddIO(true, pSlaveId, pInput, !strcmp(pState, "on"));
+    if (mqttEnabled) {
         char topic[50] = {0};
         // hostname/inputs/slaveId/output
-        sprintf(topic, "%s/inputs/%d/%d", getConfigValueString("name"), pSlaveId, pInput);
+        identityIOTopic(topic, sizeof(topic), true, pSlaveId, pInput);
         char actionUpper[15];
         strcpy(actionUpper, pState);    
         strcat(actionUpper, "\0");           
-        MQTTPublish(topic, toUpper(actionUpper));        
+        mqttPublishOrQueue(topic, toUpper(actionUpper), true);        
     }
 }
 
 char* getOutputState(uint8_t pOutput) {
-    if (!cJSON_IsArray(cJSON_GetObjectItem(IOConfig, "outputs"))) {        
-        return "off";
-    }    
-    cJSON *childOutput = cJSON_GetObjectItem(IOConfig, "outputs")->child;
-    while (childOutput) {  
-        if (cJSON_IsNumber(cJSON_GetObjectItem(childOutput, "slaveId")) &&
-            (cJSON_GetObjectItem(childOutput, "slaveId")->valueint > 0)) {            
-            childOutput = childOutput->next;
-            continue;
-        }
-        if (cJSON_IsNumber(cJSON_GetObjectItem(childOutput, "id")) &&
-            (cJSON_GetObjectItem(childOutput, "id")->valueint == pOutput)) {            
-            if (cJSON_IsString(cJSON_GetObjectItem(childOutput, "state")))
-                return cJSON_GetObjectItem(childOutput, "state")->valuestring;            
-        }
-        childOutput = childOutput->next;
-    }
-    return "off";
+    ioOutput_t *output = iomodelOutput(0, pOutput);
+    return (char*)iomodelStateName(output != NULL ? output->state : IO_STATE_OFF);
 }
 
 char* getInputState(uint8_t pInput) {
-    if (!cJSON_IsArray(cJSON_GetObjectItem(IOConfig, "inputs"))) {        
-        return "off";
-    }    
-    cJSON *childInput = cJSON_GetObjectItem(IOConfig, "inputs")->child;
-    while (childInput) {  
-        if (cJSON_IsNumber(cJSON_GetObjectItem(childInput, "id")) &&
-            (cJSON_GetObjectItem(childInput, "id")->valueint == pInput)) {            
-            if (cJSON_IsString(cJSON_GetObjectItem(childInput, "state")))
-                return cJSON_GetObjectItem(childInput, "state")->valuestring;            
-        }
-        childInput = childInput->next;
-    }
-    return "off";
+    ioInput_t *input = iomodelInput(IO_ANY_SLAVE, pInput);
+    return (char*)iomodelStateName(input != NULL ? input->state : IO_STATE_OFF);
 }
 
 void setOutput(uint8_t pOutput, char* pValue) {
     // установка значений для выхода        
     ESP_LOGI(TAG, "setOutput output %d, value %s", pOutput, pValue);
-    if (!cJSON_IsArray(cJSON_GetObjectItem(IOConfig, "outputs"))) {
-        ESP_LOGE(TAG, "IOConfig outputs isn't array");
-        return;
-    }        
     if (!strcmp(pValue, "toggle")) {
         pValue = !strcmp(getOutputState(pOutput), "on") ? "off" : "on";
     }
     // касательно длительности. Приоритет длительности из правала. Т.е. если на входе стоит длительность 5, а в правиле 10, то выход включится на 10 сек
     uint16_t timer = 0;
-    uint16_t oLimit = 0;
-    cJSON *childOutput = cJSON_GetObjectItem(IOConfig, "outputs")->child;
-    while (childOutput) {
-        // skip all slaves
-        if (cJSON_IsNumber(cJSON_GetObjectItem(childOutput, "slaveId")) &&
-            (cJSON_GetObjectItem(childOutput, "slaveId")->valueint > 0)) {
-            childOutput = childOutput->next;
-            continue;
+    ioOutput_t *output = iomodelOutput(0, pOutput);
+    if (output != NULL) {
+        uint8_t state = iomodelState(pValue);
+        // получить ограничение по времени для выхода
+        if (output->limit > 0) {
+            // если есть ограничение запускаем таймер
+            timer = output->limit;                
         }
-        if (cJSON_IsNumber(cJSON_GetObjectItem(childOutput, "id")) &&
-            (cJSON_GetObjectItem(childOutput, "id")->valueint == pOutput)) {
-            cJSON_ReplaceItemInObject(childOutput, "state", cJSON_CreateString(pValue));
-
-            // получить ограничение по времени для выхода
-            if (cJSON_IsNumber(cJSON_GetObjectItem(childOutput, "limit")))
-                oLimit = cJSON_GetObjectItem(childOutput, "limit")->valueint;
-            
-            if (oLimit > 0) {
-                // если есть ограничение запускаем таймер
-                timer = oLimit;                
-            }
 
-            // если это тепличный таймер то взять значение длительности устанавливаемого состояния (on/off)
-            if (cJSON_IsString(cJSON_GetObjectItem(childOutput, "type"))  &&
-                !strcmp(cJSON_GetObjectItem(childOutput, "type")->valuestring, "t")) {
-                if (cJSON_IsNumber(cJSON_GetObjectItem(childOutput, pValue))) {
-                    timer = cJSON_GetObjectItem(childOutput, pValue)->valueint;    
-                }                
-            }
+        // если это тепличный таймер то взять значение длительности устанавливаемого состояния (on/off)
+        if (output->type == IO_OUT_TIMER) {
+            uint16_t duration = state == IO_STATE_ON ? output->onTime : output->offTime;
+            if (duration > 0)
+                timer = duration;
+        }
 
-            // если это one-shot таймер, то выставить 3 (0.3 секунды) для таймера
-            if (cJSON_IsString(cJSON_GetObjectItem(childOutput, "type"))  &&
-                !strcmp(cJSON_GetObjectItem(childOutput, "type")->valuestring, "os")) {
-                timer = 3;
-            }
-            
-            // установить новое значение таймера для выхода
-            if (cJSON_IsNumber(cJSON_GetObjectItem(childOutput, "timer")))
-                cJSON_ReplaceItemInObject(childOutput, "timer", cJSON_CreateNumber(timer));
-            else
-                cJSON_AddItemToObject(childOutput, "timer", cJSON_CreateNumber(timer));
-            break;            
+        // если это one-shot таймер, то выставить 3 (0.3 секунды) для таймера
+        if (output->type == IO_OUT_ONESHOT) {
+            timer = 3;
         }
-        childOutput = childOutput->next;
+        
+        // установить новое значение и таймер для выхода
+        iomodelSetOutput(output, state, timer);
     }          
     publishOutput(0, pOutput, pValue, timer);    
 }
@@ -595,88 +591,148 @@ void setRemoteOutput(uint8_t pSlaveId, uint8_t pOutput, char* pValue) {
              pSlaveId, pOutput, pValue);
     MBSetRemoteOutput(pSlaveId, pOutput, pValue);
     //publishOutput(pSlaveId, pOutput, pValue);
+    // запись в слейв - тоже изменение для кадров DELTA, toggle по состоянию модели
+    ioOutput_t *output = iomodelOutput(pSlaveId, pOutput);
+    uint8_t state = iomodelState(pValue);
+    if (!strcmp(pValue, "toggle") && output != NULL)
+        state = output->state == IO_STATE_ON ? IO_STATE_OFF : IO_STATE_ON;
+    if (state == IO_STATE_UNKNOWN)
+        return;
+    if (output != NULL)
+        iomodelSetOutput(output, state, output->timer);
+    statesChanged(STATE_OUTPUT, pSlaveId, pOutput, iomodelStateName(state));
 }
 
 void setAllOff() {
     // выставить все выходы в состояние выкл, включая тепличные таймеры и слейвы модбаса
-    if (!cJSON_IsArray(cJSON_GetObjectItem(IOConfig, "outputs"))) {
-        ESP_LOGE(TAG, "IOConfig outputs isn't array");
-        return;
-    }
     char *action = "off";
     
-    uint16_t timer = 0;
-    cJSON *childOutput = cJSON_GetObjectItem(IOConfig, "outputs")->child;
-    while (childOutput) {  
-        uint8_t slaveId = 0;
-        if (cJSON_IsNumber(cJSON_GetObjectItem(childOutput, "slaveId")))
-            slaveId = cJSON_GetObjectItem(childOutput, "timer")->valueint;
-        if (slaveId > 0) {
+    ioOutput_t *output;
+    for (uint16_t n = 0; (output = iomodelOutputAt(n)) != NULL; n++) {
+        if (output->slaveId > 0) {
             // для слейвов
-            setRemoteOutput(slaveId, 
-                            cJSON_GetObjectItem(childOutput, "id")->valueint, 
-                            action);
+            setRemoteOutput(output->slaveId, output->id, action);
         } else {
             // для самого устройства        
-            cJSON_ReplaceItemInObject(childOutput, "state", cJSON_CreateString(action));
-            // установить новое значение таймера для выхода
-            if (cJSON_IsNumber(cJSON_GetObjectItem(childOutput, "timer")))
-                cJSON_ReplaceItemInObject(childOutput, "timer", cJSON_CreateNumber(timer));
-            else
-                cJSON_AddItemToObject(childOutput, "timer", cJSON_CreateNumber(timer));
+            iomodelSetOutput(output, IO_STATE_OFF, 0);
         }
-        childOutput = childOutput->next;
     }
     // TODO: MQTT publish one for all or for each
 }
 
+// цепочки действий выполняет постоянный пул задач, задание приходит через очередь
+typedef struct {
+    cJSON *chain;
+    uint8_t input;
+    uint8_t seq;                    // номер запуска по входу, см. actionSeq
+    uint16_t gen;                   // поколение конфига, в котором создано задание
+} actionJob_t;
+
+#define ACTION_QUEUE_SIZE   8
+#define ACTION_NO_INPUT     0xFF
+
+static StaticQueue_t actionQueueBuffer;
+static uint8_t actionQueueStorage[ACTION_QUEUE_SIZE * sizeof(actionJob_t)];
+static QueueHandle_t actionQueue = NULL;
+static volatile uint16_t actionGen = 0;
+// растет при каждой отмене по входу (под sem_busy), задания с прежним номером
+// из очереди не выполняются
+static uint8_t actionSeq[ACTION_NO_INPUT + 1];
+
+static struct {
+    TaskHandle_t handle;
+    volatile uint8_t input;         // какой вход обрабатывается
+    volatile bool cancel;
+} actionWorkers[TASK_ACTION_WORKERS];
+
+static void actionsCancel(uint8_t input) {
+    // прервать цепочку по входу (или все для ACTION_NO_INPUT), воркер проснется из wait
+    actionSeq[input]++;
+    for (uint8_t i = 0; i < TASK_ACTION_WORKERS; i++) {
+        if (actionWorkers[i].handle == NULL || actionWorkers[i].input == ACTION_NO_INPUT)
+            continue;
+        if (input == ACTION_NO_INPUT || actionWorkers[i].input == input) {
+            actionWorkers[i].cancel = true;
+            xTaskNotifyGive(actionWorkers[i].handle);
+        }
+    }
+}
+
+static void actionsCancelAll() {
+    // дерево конфига освобождается, ссылки в очереди и у воркеров больше не валидны
+    actionGen++;
+    if (actionQueue != NULL)
+        xQueueReset(actionQueue);
+    actionsCancel(ACTION_NO_INPUT);
+}
+
 void actionsTask(void *pvParameter) {    
     // таск для обработки событий    
     SemaphoreHandle_t sem = getSemaphore();
-    cJSON *actionChild = (cJSON*)pvParameter;
-    uint16_t duration = 0;
+    uint8_t worker = (uint32_t)pvParameter;
+    actionJob_t job;
     while (1) {
-        // сначала проверяется текущее значение duration. Если больше нуля, то просто ждем
-        if (duration) {
-            duration--;            
-            vTaskDelay(1000 / portTICK_RATE_MS);
-        } else {
-            if (xSemaphoreTake(sem, portMAX_DELAY) == pdTRUE) {
-                if (actionChild) {
-                    // предполагаю что массив будет правильно отсортирован на стороне фронта
-                    if (cJSON_IsString(cJSON_GetObjectItem(actionChild, "action")) &&
-                       (!strcmp(cJSON_GetObjectItem(actionChild, "action")->valuestring, "wait"))) {      
-                        // wait
-                        if (cJSON_IsNumber(cJSON_GetObjectItem(actionChild, "duration"))) {
-                            duration = cJSON_GetObjectItem(actionChild, "duration")->valueint;                        
-                        }
-                    } else if (cJSON_IsString(cJSON_GetObjectItem(actionChild, "action")) &&
-                       (!strcmp(cJSON_GetObjectItem(actionChild, "action")->valuestring, "allOff"))) {
-                        setAllOff();
-                    } else if (cJSON_IsNumber(cJSON_GetObjectItem(actionChild, "output")) &&
-                               cJSON_IsString(cJSON_GetObjectItem(actionChild, "action"))) {
-                        // action                        
-                        if (cJSON_IsNumber(cJSON_GetObjectItem(actionChild, "slaveId")) &&
-                            cJSON_GetObjectItem(actionChild, "slaveId")->valueint > 0) {
-                            setRemoteOutput(cJSON_GetObjectItem(actionChild, "slaveId")->valueint, 
-                                            cJSON_GetObjectItem(actionChild, "output")->valueint, 
-                                            cJSON_GetObjectItem(actionChild, "action")->valuestring);
-                        } else {                        
-                            setOutput(cJSON_GetObjectItem(actionChild, "output")->valueint, 
-                                      cJSON_GetObjectItem(actionChild, "action")->valuestring);
-                        }
-                    }
-                    actionChild = actionChild->next;
-                } else {
-                    // закончился массив, выходим и убиваем таск                    
-                    break;
+        if (xQueueReceive(actionQueue, &job, portMAX_DELAY) != pdTRUE)
+            continue;
+        ulTaskNotifyTake(pdTRUE, 0);
+        actionWorkers[worker].cancel = false;
+        actionWorkers[worker].input = job.input;
+        cJSON *actionChild = job.chain;
+        uint16_t duration = 0;
+        while (!actionWorkers[worker].cancel) {
+            // сначала проверяется текущее значение duration. Если больше нуля, то просто ждем
+            if (duration) {
+                // ожидание прерывается отменой цепочки
+                ulTaskNotifyTake(pdTRUE, duration * 1000 / portTICK_RATE_MS);
+                duration = 0;
+                continue;
+            }
+            if (xSemaphoreTake(sem, portMAX_DELAY) != pdTRUE)
+                continue;
+            // после отмены дерево могло быть заменено, цепочку не трогаем.
+            // Задание, отмененное пока стояло в очереди, отбрасывается здесь же
+            if (actionWorkers[worker].cancel || job.gen != actionGen ||
+                job.seq != actionSeq[job.input] || actionChild == NULL) {
+                xSemaphoreGive(sem);
+                break;
+            }
+            // предполагаю что массив будет правильно отсортирован на стороне фронта
+            if (cJSON_IsString(cJSON_GetObjectItem(actionChild, "action")) &&
+               (!strcmp(cJSON_GetObjectItem(actionChild, "action")->valuestring, "wait"))) {      
+                // wait
+                if (cJSON_IsNumber(cJSON_GetObjectItem(actionChild, "duration"))) {
+                    duration = cJSON_GetObjectItem(actionChild, "duration")->valueint;                        
+                }
+            } else if (cJSON_IsString(cJSON_GetObjectItem(actionChild, "action")) &&
+               (!strcmp(cJSON_GetObjectItem(actionChild, "action")->valuestring, "allOff"))) {
+                setAllOff();
+            } else if (cJSON_IsNumber(cJSON_GetObjectItem(actionChild, "output")) &&
+                       cJSON_IsString(cJSON_GetObjectItem(actionChild, "action"))) {
+                // action                        
+                if (cJSON_IsNumber(cJSON_GetObjectItem(actionChild, "slaveId")) &&
+                    cJSON_GetObjectItem(actionChild, "slaveId")->valueint > 0) {
+                    setRemoteOutput(cJSON_GetObjectItem(actionChild, "slaveId")->valueint, 
+                                    cJSON_GetObjectItem(actionChild, "output")->valueint, 
+                                    cJSON_GetObjectItem(actionChild, "action")->valuestring);
+                } else {                        
+                    setOutput(cJSON_GetObjectItem(actionChild, "output")->valueint, 
+                              cJSON_GetObjectItem(actionChild, "action")->valuestring);
                 }
-            } 
+            }
+            actionChild = actionChild->next;
             xSemaphoreGive(sem);
-        }        
-    } 
-    xSemaphoreGive(sem);   
-    vTaskDelete(NULL);
+        }
+        actionWorkers[worker].input = ACTION_NO_INPUT;
+    }
+}
+
+static void startActionWorkers() {
+    actionQueue = xQueueCreateStatic(ACTION_QUEUE_SIZE, sizeof(actionJob_t),
+                                     actionQueueStorage, &actionQueueBuffer);
+    for (uint8_t i = 0; i < TASK_ACTION_WORKERS; i++) {
+        actionWorkers[i].input = ACTION_NO_INPUT;
+        actionWorkers[i].handle = taskStart(TASK_ACTION, &actionsTask, (void*)(uint32_t)i);
+    }
 }
 
 bool checkACL(cJSON *acls) {    
@@ -691,6 +747,18 @@ bool checkACL(cJSON *acls) {
             cJSON_IsNumber(cJSON_GetObjectItem(childACL, "id")) &&
             cJSON_IsString(cJSON_GetObjectItem(childACL, "type"))) {
             // acl is valid
+            if (!strcmp(cJSON_GetObjectItem(childACL, "io")->valuestring, "sensor")) {
+                // условие по датчику: state above/below, value - порог
+                cJSON *jValue = cJSON_GetObjectItem(childACL, "value");
+                bool match = cJSON_IsNumber(jValue) &&
+                             sensorsCondition(cJSON_GetObjectItem(childACL, "id")->valueint,
+                                              cJSON_GetObjectItem(childACL, "state")->valuestring,
+                                              jValue->valuedouble);
+                if (!strcmp(cJSON_GetObjectItem(childACL, "type")->valuestring, "deny") == match)
+                    return true;
+                childACL = childACL->next;
+                continue;
+            }
             // если правило allow, то проверить вход/выход на соответствие, если не сойдется то НЕЛЬЗЯ    
             // если правило deny, то проверить вход/выход на соответствие, если сойдется то НЕЛЬЗЯ
             if ((!strcmp(cJSON_GetObjectItem(childACL, "type")->valuestring, "deny") &&
@@ -773,15 +841,17 @@ void processInputEvents(uint8_t pSlaveId, uint8_t pInput, char* pEvent, uint8_t
                                     setOutput(cJSON_GetObjectItem(child, "output")->valueint, action);
                                 }
                             } else {
-                                // цепочка действий, запускаем таск...
-                                char taskName[14];
-                                sprintf(taskName, "actiontask_%d", pInput);
-                                TaskHandle_t xHandle = xTaskGetHandle(taskName);
-                                if (xHandle != NULL) {
-                                    // если по данному входу уже работает таск то удалить его
-                                    vTaskDelete(xHandle);
-                                }                                
-                                xTaskCreate(&actionsTask, taskName, 4096, (void *)cJSON_GetObjectItem(childEvent, "actions")->child, 5, NULL);
+                                // цепочка действий, отдаем в пул
+                                // если по данному входу уже выполняется цепочка, то прервать ее
+                                actionsCancel(pInput);
+                                actionJob_t job = {
+                                    .chain = cJSON_GetObjectItem(childEvent, "actions")->child,
+                                    .input = pInput,
+                                    .seq = actionSeq[pInput],
+                                    .gen = actionGen
+                                };
+                                if (actionQueue == NULL || xQueueSend(actionQueue, &job, 0) != pdTRUE)
+                                    ESP_LOGE(TAG, "Action queue is full, input %d", pInput);
                             }
                         }
                         break;
@@ -846,181 +916,126 @@ void processInput(uint8_t pInput, uint8_t pEvent) {
     char *event = "off";
     uint8_t i = 255;
 
-    // find input and event    
-    if (!cJSON_IsArray(cJSON_GetObjectItem(IOConfig, "inputs"))) {
-        ESP_LOGE(TAG, "IOConfig inputs isn't array");
+    // неизвестный вход отсекаем по модели, не обходя дерево
+    ioInput_t *input = iomodelInput(IO_ANY_SLAVE, pInput);
+    if (input == NULL) {
+        ESP_LOGW(TAG, "processInput. Input %d not configured", pInput);
         return;
-    }    
-    cJSON *childInput = cJSON_GetObjectItem(IOConfig, "inputs")->child;
-    while (childInput) {       
-        if (cJSON_IsNumber(cJSON_GetObjectItem(childInput, "id")) && 
-            cJSON_GetObjectItem(childInput, "id")->valueint == pInput) { 
-            // update value
-            char *state = "off";
-            if (pEvent == 1) {
-                state = "on";
-            }
-            if (cJSON_IsString(cJSON_GetObjectItem(childInput, "state")))
-                cJSON_ReplaceItemInObject(childInput, "state", cJSON_CreateString(state));
-            
-            if (!strcmp(cJSON_GetObjectItem(childInput, "type")->valuestring, "INVSW")) {
-                // переключатель
-                if ((cJSON_IsNumber(cJSON_GetObjectItem(childInput, "ci"))) &&
-                    (cJSON_GetObjectItem(childInput, "ci")->valueint > 0)) {
-					// переключатель со счетчиком. для Саши делали. 
-                    i = cJSON_GetObjectItem(childInput, "i")->valueint;
-                    uint8_t ci = cJSON_GetObjectItem(childInput, "ci")->valueint;
-                    ESP_LOGI(TAG, "i=%d  ci=%d", i, ci);
-                    if (i+1 < ci) {
-                        cJSON_ReplaceItemInObject(childInput, "i", cJSON_CreateNumber(i+1));
-                    } else {
-                        cJSON_ReplaceItemInObject(childInput, "i", cJSON_CreateNumber(0));
-                    }
-                }
-                event = "toggle";                
-            } else if (!strcmp(cJSON_GetObjectItem(childInput, "type")->valuestring, "SW")) {
-                // выключатель
-                //ESP_LOGI(TAG, "found input %d as switch", pInput);
-                if (pEvent == 1)
-                    event = "on";
-                else
-                    event = "off";
-            } else {
-                // кнопка
-                if (pEvent == 1) {
-                    // button is pressed, save timer
-                    inputButtonsTime[pInput] = esp_timer_get_time() / 1000 & 0xFFFFFFFF;					
-                    return;
-                } else {
-                    // button is released, get time
-					if ((esp_timer_get_time() / 1000 & 0xFFFFFFFF) - inputButtonsTime[pInput] < 1000) {
-						// click
-						event = "toggle";
-					} else {
-						// long press
-						event = "longpress";
-					}					
-                    ESP_LOGI(TAG, "Button %d event %s", pInput, event);                    
-                }                
-            }
-            processInputEvents(0, pInput, event, i);
-            // для слейва нужно записать событие для последующей передачи на мастер
-            // если это сам мастер, то ничего страшного если он в свои регистры запишет, их все равно никто не прочитает
-            MBAddInputEvent(pInput, event);
-            return;            
+    }
+
+    // update value
+    // импульсы считает pulseTask, события приходят через pulseNextEvent
+    if (input->type == IO_IN_PULSE)
+        return;
+
+    if (input->state != IO_STATE_UNKNOWN)
+        iomodelSetInput(input, pEvent == 1 ? IO_STATE_ON : IO_STATE_OFF);
+
+    if (input->type == IO_IN_INVSW) {
+        // переключатель
+        if (input->ci > 0) {
+            // переключатель со счетчиком. для Саши делали. 
+            i = input->i;
+            ESP_LOGI(TAG, "i=%d  ci=%d", i, input->ci);
+            iomodelSetInputCounter(input, i+1 < input->ci ? i+1 : 0);
         }
-        childInput = childInput->next;
+        event = "toggle";                
+    } else if (input->type == IO_IN_SW) {
+        // выключатель
+        //ESP_LOGI(TAG, "found input %d as switch", pInput);
+        if (pEvent == 1)
+            event = "on";
+        else
+            event = "off";
+    } else {
+        // кнопка
+        if (pEvent == 1) {
+            // button is pressed, save timer
+            inputButtonsTime[pInput] = esp_timer_get_time() / 1000 & 0xFFFFFFFF;					
+            return;
+        } else {
+            // button is released, get time
+            if ((esp_timer_get_time() / 1000 & 0xFFFFFFFF) - inputButtonsTime[pInput] < 1000) {
+                // click
+                event = "toggle";
+            } else {
+                // long press
+                event = "longpress";
+            }					
+            ESP_LOGI(TAG, "Button %d event %s", pInput, event);                    
+        }                
     }
+    processInputEvents(0, pInput, event, i);
+    // для слейва нужно записать событие для последующей передачи на мастер
+    // если это сам мастер, то ничего страшного если он в свои регистры запишет, их все равно никто не прочитает
+    MBAddInputEvent(pInput, event);
 }
 
 void outputsTimer() {
     // check all active outputs for timeout
     // run every 1 second
-    if (!cJSON_IsArray(cJSON_GetObjectItem(IOConfig, "outputs"))) {        
-        return;
-    }    
-    cJSON *childOutput = cJSON_GetObjectItem(IOConfig, "outputs")->child;
-    while (childOutput) {  
-        if (cJSON_IsString(cJSON_GetObjectItem(childOutput, "type")) &&
-            !strcmp(cJSON_GetObjectItem(childOutput, "type")->valuestring, "t")) {
+    ioOutput_t *output;
+    for (uint16_t n = 0; (output = iomodelOutputAt(n)) != NULL; n++) {
+        if (output->type == IO_OUT_TIMER) {
             // это триггер, тепличный таймер
-            uint16_t timer = 0;
-            if (cJSON_IsNumber(cJSON_GetObjectItem(childOutput, "timer"))) {
-                timer = cJSON_GetObjectItem(childOutput, "timer")->valueint;
-                if (timer > 0)
-                    timer--; 
-                if (timer == 0) {
-                    if (!strcmp(cJSON_GetObjectItem(childOutput, "state")->valuestring, "on")) {
-                        cJSON_ReplaceItemInObject(childOutput, "state", cJSON_CreateString("off"));
-                        timer = cJSON_GetObjectItem(childOutput, "off")->valueint;
-                    } else {
-                        cJSON_ReplaceItemInObject(childOutput, "state", cJSON_CreateString("on"));
-                        timer = cJSON_GetObjectItem(childOutput, "on")->valueint;
-                    }                    
-                    // publish(cJSON_GetObjectItem(childOutput, "id")->valueint,
-                    //         cJSON_GetObjectItem(childOutput, "state")->valuestring, 0);                           
-                }
-                cJSON_ReplaceItemInObject(childOutput, "timer", cJSON_CreateNumber(timer));
-                publishOutput(0, cJSON_GetObjectItem(childOutput, "id")->valueint, 
-                              cJSON_GetObjectItem(childOutput, "state")->valuestring, timer); 
+            uint16_t timer = output->timer;
+            if (timer > 0)
+                timer--; 
+            if (timer == 0) {
+                if (output->state == IO_STATE_ON) {
+                    output->state = IO_STATE_OFF;
+                    timer = output->offTime;
+                } else {
+                    output->state = IO_STATE_ON;
+                    timer = output->onTime;
+                }                    
+            }
+            iomodelSetOutput(output, output->state, timer);
+            publishOutput(0, output->id, (char*)iomodelStateName(output->state), timer); 
+        } else if (output->state == IO_STATE_ON && output->timer) {
+            // это обычные выходы, которые сейчас активны и есть текущий таймер
+            uint16_t timer = output->timer - 1;
+            if (timer == 0) {
+                // switch off output
+                iomodelSetOutput(output, IO_STATE_OFF, timer);
+                ESP_LOGI(TAG, "outputTimer set output %d to off", output->id);
             } else {
-                cJSON_AddItemToObject(childOutput, "timer", cJSON_CreateNumber(1));
-            }            
-        } else if (cJSON_IsString(cJSON_GetObjectItem(childOutput, "state")) &&
-            !strcmp(cJSON_GetObjectItem(childOutput, "state")->valuestring, "on")) {
-            // это обычные выходы, которые сейчас активны
-            if (cJSON_IsNumber(cJSON_GetObjectItem(childOutput, "timer"))) {                
-                uint16_t timer = 0;
-                if (cJSON_IsNumber(cJSON_GetObjectItem(childOutput, "timer")))
-                    timer = cJSON_GetObjectItem(childOutput, "timer")->valueint;
-                if (timer) {
-                    // есть текущий таймер
-                    timer--;
-                    cJSON_ReplaceItemInObject(childOutput, "timer", cJSON_CreateNumber(timer));
-                    if (timer == 0) {
-                        // switch off output
-                        cJSON_ReplaceItemInObject(childOutput, "state", cJSON_CreateString("off"));
-                        ESP_LOGI(TAG, "outputTimer set output %d to off", cJSON_GetObjectItem(childOutput, "id")->valueint);
-                        //publish(cJSON_GetObjectItem(childOutput, "id")->valueint, "OFF", 0);
-                    }
-                    publishOutput(0, cJSON_GetObjectItem(childOutput, "id")->valueint, 
-                              cJSON_GetObjectItem(childOutput, "state")->valuestring, timer);                     
-                }
+                iomodelSetOutputTimer(output, timer);
             }
+            publishOutput(0, output->id, (char*)iomodelStateName(output->state), timer);                     
         } 
-        
-        childOutput = childOutput->next;
     }
 }
 
 void outputsTimerShot() {
     // test for shooter
     // every 100 ms
-    if (!cJSON_IsArray(cJSON_GetObjectItem(IOConfig, "outputs"))) {        
+    if (iomodelOutputsCount(IO_OUT_SHOOTER) + iomodelOutputsCount(IO_OUT_ONESHOT) == 0)
         return;
-    }    
-    cJSON *childOutput = cJSON_GetObjectItem(IOConfig, "outputs")->child;
-    while (childOutput) {  
-        if (cJSON_IsString(cJSON_GetObjectItem(childOutput, "type")) &&
-            !strcmp(cJSON_GetObjectItem(childOutput, "type")->valuestring, "shooter")) {
-            uint16_t timer = 0;
-            if (cJSON_IsNumber(cJSON_GetObjectItem(childOutput, "timer"))) {
-                timer = cJSON_GetObjectItem(childOutput, "timer")->valueint;
-                if (timer > 0) {                    
-                    timer--;                
-                }
-                if (timer == 0) {
-                    if (!strcmp(cJSON_GetObjectItem(childOutput, "state")->valuestring, "on")) {
-                        cJSON_ReplaceItemInObject(childOutput, "state", cJSON_CreateString("off"));
-                        timer = cJSON_GetObjectItem(childOutput, "off")->valueint;
-                    } else {
-                        cJSON_ReplaceItemInObject(childOutput, "state", cJSON_CreateString("on"));
-                        timer = cJSON_GetObjectItem(childOutput, "on")->valueint;
-                    }                                        
-                }
-                //sendWSUpdateOutputTimer(0, cJSON_GetObjectItem(childOutput, "id")->valueint, timer);
-                cJSON_ReplaceItemInObject(childOutput, "timer", cJSON_CreateNumber(timer));
-            } else {
-                cJSON_AddItemToObject(childOutput, "timer", cJSON_CreateNumber(1));
-            }            
-        } else if (cJSON_IsString(cJSON_GetObjectItem(childOutput, "type")) &&
-            !strcmp(cJSON_GetObjectItem(childOutput, "type")->valuestring, "os")) {
+    ioOutput_t *output;
+    for (uint16_t n = 0; (output = iomodelOutputAt(n)) != NULL; n++) {
+        if (output->type == IO_OUT_SHOOTER) {
+            uint16_t timer = output->timer;
+            if (timer > 0)
+                timer--;                
+            if (timer == 0) {
+                if (output->state == IO_STATE_ON) {
+                    output->state = IO_STATE_OFF;
+                    timer = output->offTime;
+                } else {
+                    output->state = IO_STATE_ON;
+                    timer = output->onTime;
+                }                                        
+            }
+            //sendWSUpdateOutputTimer(0, output->id, timer);
+            iomodelSetOutput(output, output->state, timer);
+        } else if (output->type == IO_OUT_ONESHOT) {
             // one shot for 0.5 sec
-            uint16_t timer = 0;
-            if (cJSON_IsNumber(cJSON_GetObjectItem(childOutput, "timer"))) {
-                timer = cJSON_GetObjectItem(childOutput, "timer")->valueint;
-                if (timer > 0)
-                    timer--;                
-                if (timer == 0) {
-                    cJSON_ReplaceItemInObject(childOutput, "state", cJSON_CreateString("off"));                    
-                }
-                cJSON_ReplaceItemInObject(childOutput, "timer", cJSON_CreateNumber(timer));
-                //sendWSUpdateOutputTimer(0, cJSON_GetObjectItem(childOutput, "id")->valueint, timer);
-            } else {
-                cJSON_AddItemToObject(childOutput, "timer", cJSON_CreateNumber(1));
-            }            
+            uint16_t timer = output->timer;
+            if (timer > 0)
+                timer--;                
+            iomodelSetOutput(output, timer == 0 ? IO_STATE_OFF : output->state, timer);
         }
-        childOutput = childOutput->next;
     }
 }
 
@@ -1033,6 +1048,7 @@ void inputsTask(void *pvParameter) {
     uint8_t inputsOld[BINPUTS] = {0xFF, 0xFF, 0xFF, 0xFF};
 	uint8_t diff[BINPUTS];
 	uint8_t inputsCnt = 2; // for RCV1S, RCV2S
+    TickType_t lastWake = xTaskGetTickCount();
 	if ((controllerType == RCV1B) || (controllerType == RCV2B))
 		inputsCnt = 4;
   //   else if (controllerType == RCV1S)
@@ -1057,6 +1073,11 @@ void inputsTask(void *pvParameter) {
                     inputsOld[i] = inputsNew[i];                    
                 }
             }
+            // пороги счетных входов
+            uint8_t pulseId;
+            const char *pulseEvent;
+            while (pulseNextEvent(&pulseId, &pulseEvent))
+                processInputEvents(0, pulseId, (char*)pulseEvent, 255);
 			
             outputsTimerShot();
             if (++cnt_timer >= 10) {
@@ -1064,26 +1085,41 @@ void inputsTask(void *pvParameter) {
                 outputsTimer();
                 if (++sch_timer >= 60) {
                     sch_timer = 0;
+                    // планировщик правит done в дереве конфига
+                    arenaGuard();
                     processScheduler();
+                    arenaUnguard();
                     sendInfo();
+                    statesRefresh(IOConfig);
+                    if (mqttConnected)
+                        mqttPubSnapshot(IOConfig);
                 }
             }
             // выставление значений на платах      
             updateValues();
+            // отложенная публикация состояний после подключения к MQTT
+            if (mqttConnected)
+                mqttPubTick(IOConfig);
 
 			xSemaphoreGive(sem);
+            // накопленные за тик изменения одним кадром DELTA
+            statesFlush();
         } else {
             ESP_LOGI(TAG, "inputsTask task semaphore is busy");
         }
 
-        vTaskDelay(100 / portTICK_RATE_MS);
+        // период без накопления времени обработки
+        vTaskDelayUntil(&lastWake, 100 / portTICK_RATE_MS);
+        taskTick(TASK_INPUTS, 100);
     }
 }
 
 void resetDefaultConfigs() {
     ESP_LOGW(TAG, "Resetting device config");    
     if (createIOConfig() == ESP_OK) {
+        cfgRefInvalidate();
         setConfigValueObject("io", IOConfig);     
+        iomodelLoadJson(IOConfig);
         saveConfig();
     }
 }
@@ -1121,7 +1157,8 @@ bool checkServiceButtons() {
 
 void startInputTask() {
 	ESP_LOGI(TAG, "Starting input task");
-    xTaskCreate(&inputsTask, "inputsTask", 4096, NULL, 5, NULL);    
+    startActionWorkers();
+    taskStart(TASK_INPUTS, &inputsTask, NULL);    
 }
 
 esp_err_t getDeviceInfo(char **response) {
@@ -1249,7 +1286,8 @@ char* getDeviceIOStates() {
 void initScheduler() {
     ESP_LOGI(TAG, "Initiating scheduler");
     // сбрасываем у всех задач признак выполнения
-    jScheduler = getConfigValueObject("scheduler"); 
+    static cfgRef_t cfgScheduler = CFG_REF("scheduler");
+    jScheduler = cfgRefObject(&cfgScheduler); 
     if (!cJSON_IsObject(jScheduler)) {
         jScheduler = cJSON_CreateObject();
         cJSON_AddArrayToObject(jScheduler, "tasks");
@@ -1278,7 +1316,7 @@ void processScheduler() {
     // time(&rawtime);
     // info = localtime(&rawtime);
     //struct tm *info;
-    if (!getConfigValueBool("scheduler/enabled")) {
+    if (!cfgRefBool(&cfgSchedulerEnabled)) {
         return;
     }
     struct tm *info = getTime();
@@ -1340,6 +1378,13 @@ void processScheduler() {
                 ESP_LOGD(TAG, "task %s dow today, processing task...", cJSON_GetObjectItem(childTask, "name")->valuestring);
             }
             if (currentTime - cJSON_GetObjectItem(childTask, "time")->valueint <= grace) {
+                if (cJSON_IsArray(cJSON_GetObjectItem(childTask, "acls")) &&
+                    checkACL(cJSON_GetObjectItem(childTask, "acls"))) {
+                    // условие не выполнено, в пределах grace проверится снова
+                    ESP_LOGD(TAG, "Scheduler task %s denied by ACL", cJSON_GetObjectItem(childTask, "name")->valuestring);
+                    childTask = childTask->next;
+                    continue;
+                }
                 // выполнить задачу
                 // получить действия
                 ESP_LOGD(TAG, "Scheduler. Task %s. Processing actions...",
@@ -1415,6 +1460,38 @@ esp_err_t getTest(char **response) {
     return ESP_OK;    
 }
 
+esp_err_t wireBench(char **response) {
+    // размер и время кодирования типовых сообщений в JSON и cbor1
+    cJSON *results = cJSON_CreateArray();
+    cJSON *json = getWSUpdateOutput(0, 1, "on", 10);
+    wireBenchItem(results, "UPDATE", json);
+    cJSON_Delete(json);
+    char *text = NULL;
+    if (xSemaphoreTake(sem_busy, portMAX_DELAY) == pdTRUE) {
+        text = getDeviceIOStates();
+        xSemaphoreGive(sem_busy);
+    }
+    json = text != NULL ? cJSON_Parse(text) : NULL;
+    wireBenchItem(results, "IOSTATES", json);
+    cJSON_Delete(json);
+    free(text);
+    json = cJSON_CreateObject();
+    cJSON_AddStringToObject(json, "type", "INFO");
+    cJSON_AddItemToObject(json, "payload", getDeviceInfoJson());
+    wireBenchItem(results, "INFO", json);
+    cJSON_Delete(json);
+    text = getConfigMsg();
+    json = text != NULL ? cJSON_Parse(text) : NULL;
+    wireBenchItem(results, "DEVICECONFIG", json);
+    cJSON_Delete(json);
+    free(text);
+    json = cJSON_CreateObject();
+    cJSON_AddItemToObject(json, "results", results);
+    *response = cJSON_PrintUnformatted(json);
+    cJSON_Delete(json);
+    return ESP_OK;
+}
+
 esp_err_t uiRouter(httpd_req_t *req) {    
     //ESP_LOGI(TAG, "%d %s", req->method, req->uri);
     char *uri = getClearURI(req->uri);
@@ -1430,10 +1507,17 @@ esp_err_t uiRouter(httpd_req_t *req) {
             if (err == ESP_OK) {
                 SemaphoreHandle_t sem = getSemaphore();
                 if (xSemaphoreTake(sem, portMAX_DELAY) == pdTRUE) {
-                    err = setConfig(&response, content); 
-                    // IO config    
-                    IOConfig = getConfigValueObject("io");           
+                    // текст разбирается один раз, сразу в арену
+                    uint16_t gen;
+                    cJSON *config = arenaParse(content, &gen);
+                    err = applyConfig(config, gen);
                     xSemaphoreGive(sem);
+                    if (err == ESP_OK)
+                        setTextJson(&response, "Config saved");
+                    else if (err == ESP_ERR_INVALID_ARG)
+                        setErrorTextJson(&response, "Wrong config!");
+                    else
+                        setErrorTextJson(&response, "Can't save config");
                 }
             }
         }        
@@ -1484,6 +1568,15 @@ esp_err_t uiRouter(httpd_req_t *req) {
         if (req->method == HTTP_GET) {            
             err = getTest(&response);
         }
+    } else if (!strcmp(uri, "/service/wirebench")) {
+        if (req->method == HTTP_GET) {
+            err = wireBench(&response);
+        }
+    } else if (!strcmp(uri, "/ui/history")) {
+        if (req->method == HTTP_GET) {
+            // ответ уходит частями прямо из historyStream
+            err = historyStream(req);
+        }
     }
     //free(response);
     if (err == ESP_OK) {
@@ -1621,12 +1714,13 @@ bool buttonExists(int pId) {
 }
 
 char *getMbMode() {
-    if (getConfigValueString("modbus/mode") == NULL)
+    char *mode = cfgRefString(&cfgModbusMode);
+    if (mode == NULL)
         return "none";
-    if (!strcmp(getConfigValueString("modbus/mode"), "master")) {            
+    if (!strcmp(mode, "master")) {            
         return "master";
     }
-    else if (!strcmp(getConfigValueString("modbus/mode"), "slave")) {
+    else if (!strcmp(mode, "slave")) {
         return "slave";
     }    
     return "none";
@@ -1649,7 +1743,7 @@ void correctIOConfig(bool forceSave) {
              mbMode, controllersData[controllerType].outputs,
              controllersData[controllerType].inputs);
 
-    mbSlaves = getConfigValueObject("modbus/slaves");
+    mbSlaves = cfgRefObject(&cfgModbusSlaves);
     // удаление лишних выходов
     cJSON *outputs = cJSON_GetObjectItem(IOConfig, "outputs");    
     int size = cJSON_GetArraySize(outputs);
@@ -1710,7 +1804,7 @@ void correctIOConfig(bool forceSave) {
             sprintf(name, "Out %d", i);                
             cJSON_AddStringToObject(newOutput, "name", name);
             cJSON_AddStringToObject(newOutput, "type", "s");
-            cJSON_AddStringToObject(newOutput, "state", "off");
+            cJSON_AddItemToObject(newOutput, "state", arenaString("off"));
             cJSON_AddItemToArray(outputs, newOutput);
             ESP_LOGW(TAG, "Adding new output with id %d", i);
             changed = true;
@@ -1725,7 +1819,7 @@ void correctIOConfig(bool forceSave) {
             sprintf(name, "In %d", i);                
             cJSON_AddStringToObject(newInput, "name", name);
             cJSON_AddStringToObject(newInput, "type", "SW");
-            cJSON_AddStringToObject(newInput, "state", "off");
+            cJSON_AddItemToObject(newInput, "state", arenaString("off"));
             cJSON_AddItemToArray(inputs, newInput);
             ESP_LOGW(TAG, "Adding new input with id %d", i);
             changed = true;
@@ -1773,7 +1867,7 @@ void correctIOConfig(bool forceSave) {
                     sprintf(name, "Sl %d Out %d", slaveId, i);                
                     cJSON_AddStringToObject(newOutput, "name", name);
                     cJSON_AddNumberToObject(newOutput, "slaveId", slaveId);
-                    cJSON_AddStringToObject(newOutput, "state", "off");
+                    cJSON_AddItemToObject(newOutput, "state", arenaString("off"));
                     cJSON_AddItemToArray(outputs, newOutput);
                     ESP_LOGW(TAG, "Adding new output with id %d slaveId %d", i, slaveId);
                     changed = true;
@@ -1786,7 +1880,7 @@ void correctIOConfig(bool forceSave) {
                     sprintf(name, "Sl %d In %d", slaveId, i);                
                     cJSON_AddStringToObject(newInput, "name", name);
                     cJSON_AddNumberToObject(newInput, "slaveId", slaveId);
-                    cJSON_AddStringToObject(newInput, "state", "off");
+                    cJSON_AddItemToObject(newInput, "state", arenaString("off"));
                     cJSON_AddItemToArray(inputs, newInput);
                     ESP_LOGW(TAG, "Adding new input with id %d slaveId %d", i, slaveId);
                     changed = true;
@@ -1799,7 +1893,7 @@ void correctIOConfig(bool forceSave) {
     ESP_LOGI(TAG, "correctIOConfig done");
     if (changed) {
         ESP_LOGI(TAG, "Config changed. Saving");
-        saveConfig();
+        bootSaveConfig();
     }
 }
 
@@ -1833,6 +1927,31 @@ void setWSTime(char *datetime) {
     ESP_LOGI(TAG, "Time set to: %s", datetime);
 }
 
+void sendStatesSnapshot() {
+    // снимок с epoch/seq, перед ним сверка с IOConfig
+    if (xSemaphoreTake(sem_busy, portMAX_DELAY) == pdTRUE) {
+        statesRefresh(IOConfig);
+        xSemaphoreGive(sem_busy);
+    }
+    statesSnapshot();
+}
+
+void sendSensors() {
+    // история показаний датчиков
+    cJSON *json = cJSON_CreateObject();
+    cJSON_AddStringToObject(json, "type", "SENSORS");
+    cJSON_AddItemToObject(json, "payload", sensorsHistoryJson());
+    wireSend(json, WS_PRIO_CONTROL, true);
+    cJSON_Delete(json);
+}
+
+void syncStates(cJSON *payload) {
+    cJSON *jEpoch = cJSON_GetObjectItem(payload, "epoch");
+    cJSON *jSeq = cJSON_GetObjectItem(payload, "seq");
+    statesSync(cJSON_IsNumber(jEpoch) ? (uint32_t)jEpoch->valuedouble : 0,
+               cJSON_IsNumber(jSeq) ? (uint32_t)jSeq->valuedouble : 0);
+}
+
 void wsMsg(char *message) {
 	ESP_LOGI(TAG, "wsMsg received. Size %d, Text %s", strlen(message), message);
     char *response;
@@ -1841,7 +1960,7 @@ void wsMsg(char *message) {
     cJSON *payload = NULL;
     if(!cJSON_IsObject(json)) {
         ESP_LOGE(TAG, "WS Message isn't json");
-        WSSendMessageForce("{\"type\":\"ERROR\", \"payload\": {\"message\": \"WS Message isn't json\"}}"); // TODO : Serialize it
+        wsSend("{\"type\":\"ERROR\", \"payload\": {\"message\": \"WS Message isn't json\"}}", WS_PRIO_CONTROL, true); // TODO : Serialize it
         return; 
     }
     //ESP_LOGI(TAG, "%s", message);
@@ -1853,10 +1972,22 @@ void wsMsg(char *message) {
         type = cJSON_GetObjectItem(json, "type")->valuestring;
         if (!strcmp(type, "AUTHORIZED")) {
             WSSetAuthorized();
+            // формат выбирает сервер из предложенных в HELLO
+            if (payload != NULL && cJSON_IsString(cJSON_GetObjectItem(payload, "wire")))
+                wireSelect(cJSON_GetObjectItem(payload, "wire")->valuestring);
             sendInfo();
-            response = getDeviceIOStates();
-            WSSendMessage(response);  
-            free(response);
+            if (payload != NULL && cJSON_IsNumber(cJSON_GetObjectItem(payload, "seq"))) {
+                // сервер помнит состояние, досылаем только разницу
+                syncStates(payload);
+            } else {
+                sendStatesSnapshot();
+            }
+        } else if (!strcmp(type, "SYNC") && payload != NULL) {
+            syncStates(payload);
+        } else if (!strcmp(type, "GETSTATES")) {
+            sendStatesSnapshot();
+        } else if (!strcmp(type, "GETSENSORS")) {
+            sendSensors();
         } else if (!strcmp(type, "TIME") && cJSON_IsString(cJSON_GetObjectItem(json, "payload"))) {
             // set time
             setWSTime(cJSON_GetObjectItem(json, "payload")->valuestring);
@@ -1867,31 +1998,36 @@ void wsMsg(char *message) {
             sendInfo();            
         } else if (!strcmp(type, "GETDEVICECONFIG")) {
             response = getConfigMsg();//getIOConfigMsg();
-            WSSendMessageForce(response);
+            cJSON *jConfig = wireGetFormat() == WIRE_CBOR ? cJSON_Parse(response) : NULL;
+            if (jConfig != NULL)
+                wireSend(jConfig, WS_PRIO_CONTROL, true);
+            else
+                wsSend(response, WS_PRIO_CONTROL, true);
+            cJSON_Delete(jConfig);
             free(response);        
         } else if (!strcmp(type, "SETDEVICECONFIG") && payload != NULL) {                         
             ESP_LOGW(TAG, "Updating device config");
             if (cJSON_IsObject(payload)) {
                 SemaphoreHandle_t sem = getSemaphore();
                 if (xSemaphoreTake(sem, portMAX_DELAY) == pdTRUE) {
-                    //cJSON_Delete(IOConfig);
-                    cJSON_DetachItemFromObject(json, "payload");
-                    replaceConfig(payload);       
-                    if (getConfigValueString("model") != NULL)
-                        setConfigValueString("controllerType", getConfigValueString("model"));
-                    // IO config    
-                    IOConfig = getConfigValueObject("io");    
-                    correctIOConfig(true);
+                    // новый конфиг живет в своей арене, сообщение освобождается как обычно
+                    uint16_t gen;
+                    cJSON *config = arenaDuplicate(payload, &gen);
+                    if (config == NULL) {
+                        config = cJSON_DetachItemFromObject(json, "payload");
+                        gen = 0;
+                    }
+                    applyConfig(config, gen);
                     xSemaphoreGive(sem);                    
                 }
         //         ESP_LOGI(TAG, "IOConfig is object %d", cJSON_IsObject(IOConfig));
-                WSSendMessageForce("{\"type\":\"DEVICECONFIGRESPONSE\", \"payload\": {\"message\": \"OK\"}}");
+                wsSend("{\"type\":\"DEVICECONFIGRESPONSE\", \"payload\": {\"message\": \"OK\"}}", WS_PRIO_CONTROL, true);
             } else {        
-                WSSendMessageForce("{\"type\":\"DEVICECONFIGRESPONSE\", \"payload\": {\"message\": \"Ne OK\"}}");
+                wsSend("{\"type\":\"DEVICECONFIGRESPONSE\", \"payload\": {\"message\": \"Ne OK\"}}", WS_PRIO_CONTROL, true);
             }
         } else if (!strcmp(type, "ACTION") && payload != NULL) {
             if (cJSON_IsString(cJSON_GetObjectItem(payload, "mac")) &&
-                strcmp(toUpper(cJSON_GetObjectItem(payload, "mac")->valuestring), getMac())) {
+                strcmp(toUpper(cJSON_GetObjectItem(payload, "mac")->valuestring), identityMac())) {
                 ESP_LOGE(TAG, "Wrong mac %s", cJSON_GetObjectItem(payload, "mac")->valuestring);                
             } else if (cJSON_IsNumber(cJSON_GetObjectItem(payload, "input"))) { 
                 uint8_t slaveId = 0;
@@ -1929,8 +2065,13 @@ void wsMsg(char *message) {
                 startOTA(cJSON_GetObjectItem(payload, "url")->valuestring);
             }
         } else if (!strcmp(type, "SENDLOGS") && payload != NULL) {
-            wsSendLogs = cJSON_IsTrue(cJSON_GetObjectItem(payload, "send"));                 
-            ESP_LOGI(TAG, "Sending logs to websocket %s", wsSendLogs ? "enabled" : "disabled");
+            // level - максимальный уровень (1 error .. 5 verbose), rate - строк в секунду
+            bool send = cJSON_IsTrue(cJSON_GetObjectItem(payload, "send"));
+            cJSON *jLevel = cJSON_GetObjectItem(payload, "level");
+            cJSON *jRate = cJSON_GetObjectItem(payload, "rate");
+            logShipSetEnabled(send, cJSON_IsNumber(jLevel) ? jLevel->valueint : 0,
+                              cJSON_IsNumber(jRate) ? jRate->valueint : 0);
+            ESP_LOGI(TAG, "Sending logs to websocket %s", send ? "enabled" : "disabled");
         } else if (!strcmp(type, "REBOOT")) {            
             ESP_LOGW(TAG, "Reboot request");
             reboot = true;
@@ -1943,15 +2084,26 @@ void wsMsg(char *message) {
 void wsEvent(uint8_t event) {
     if (event == WEBSOCKET_EVENT_CONNECTED) {
         wsConnected = true;
+        wsSenderSetConnected(true);
         //sendInfo();
         //sendHello();
     } else if (event == WEBSOCKET_EVENT_DISCONNECTED) {
         wsConnected = false;
+        wsSenderSetConnected(false);
+        // новое соединение начинается со старого протокола до SYNC
+        statesSetDeltaMode(false);
+        wireSetFormat(WIRE_JSON);
     }
 }
 
 void initWS() {
-    if (getConfigValueBool("network/cloud/enabled")) {
+    static cfgRef_t cfgCloudEnabled = CFG_REF("network/cloud/enabled");
+    static cfgRef_t cfgCloudAddress = CFG_REF("network/cloud/address");
+    static cfgRef_t cfgCloudLog = CFG_REF("network/cloud/log");
+    // из serviceTask, конфиг в это время может заменить httpd
+    if (xSemaphoreTake(sem_busy, portMAX_DELAY) != pdTRUE)
+        return;
+    if (cfgRefBool(&cfgCloudEnabled)) {
         char *jwt = NULL;                        
         loadTextFile("/certs/jwt.pem", &jwt);
         if (jwt == NULL) {
@@ -1960,8 +2112,12 @@ void initWS() {
             jwt = (char*)malloc(len+1);
             strncpy(jwt, jwt_start, len);
         }
-    	WSinit(getConfigValueString("network/cloud/address"), &wsMsg, &wsEvent, jwt, getConfigValueBool("network/cloud/log"));            
+        // отправка идет через отдельный таск, до подключения
+        wsSenderInit();
+        logShipInit();
+    	WSinit(cfgRefString(&cfgCloudAddress), &wsMsg, &wsEvent, jwt, cfgRefBool(&cfgCloudLog));            
     }
+    xSemaphoreGive(sem_busy);
 }
 
 //void modBusEvent(uint8_t slaveId, uint16_t input, char *event) {
@@ -1973,7 +2129,8 @@ void modBusEvent(mb_event_t data) {
     // TODO : process events 
     if (!strcmp(data.type, "input")) {
         ESP_LOGI(TAG, "Input %d changed to %s on slave %d", data.input, data.state, data.slaveId);  
-        sendWSUpdateInput(data.slaveId, data.input, data.state);
+        if (!statesChanged(STATE_INPUT, data.slaveId, data.input, data.state) || !statesDeltaMode())
+            sendWSUpdateInput(data.slaveId, data.input, data.state);
     } else if (!strcmp(data.type, "output")) {
         ESP_LOGI(TAG, "Output %d changed to %s on slave %d", data.output, data.state, data.slaveId);  
         //sendWSUpdateOutput(data.slaveId, data.output, data.state, 0);
@@ -1990,13 +2147,15 @@ void modBusAction(uint8_t output, char *action) {
 }
 
 void initModBus() {
-    if (getConfigValueBool("modbus/enabled")) {
-        if (!strcmp(getConfigValueString("modbus/mode"), "master")) {
-            mbSlaves = getConfigValueObject("modbus/slaves");
+    static cfgRef_t cfgModbusEnabled = CFG_REF("modbus/enabled");
+    static cfgRef_t cfgModbusSlaveId = CFG_REF("modbus/slaveId");
+    if (cfgRefBool(&cfgModbusEnabled)) {
+        if (!strcmp(SS(cfgRefString(&cfgModbusMode)), "master")) {
+            mbSlaves = cfgRefObject(&cfgModbusSlaves);
             MBInitMaster(IOConfig, &modBusEvent, mbSlaves, controllerType > 2);
             //mbMode = "master";
-        } else if (!strcmp(getConfigValueString("modbus/mode"), "slave")) {
-            mbSlaveId = getConfigValueInt("modbus/slaveId");
+        } else if (!strcmp(SS(cfgRefString(&cfgModbusMode)), "slave")) {
+            mbSlaveId = cfgRefInt(&cfgModbusSlaveId);
             MBInitSlave(mbSlaveId, &modBusAction, controllerType > 2);
             mbSlave = true;
             //mbMode = "slave";            
@@ -2004,128 +2163,58 @@ void initModBus() {
     }   
 }
 
+static void mqttSubscribeTopic(char *topic) {
+    MQTTSubscribe(topic);
+}
+
 void mqttEvent(uint8_t event) {
     if (event == MQTT_EVENT_CONNECTED) {
         mqttConnected = true;
         // subscribe to others
-        if (cJSON_IsArray(jMQTTTopics)) {
-            cJSON *childTopic = jMQTTTopics->child;
-            while (childTopic) { 
-                if (cJSON_IsString(cJSON_GetObjectItem(childTopic, "topic"))) {
-                    MQTTSubscribe(cJSON_GetObjectItem(childTopic, "topic")->valuestring); 
-                }
-                childTopic = childTopic->next;
-            }    
-        }
-    } else if (event == MQTT_EVENT_DISCONNECTED)
+        topicsSubscribeAll(&mqttSubscribeTopic);
+        // состояния всех входов/выходов отправятся из inputsTask
+        mqttPubConnected();
+    } else if (event == MQTT_EVENT_DISCONNECTED) {
         mqttConnected = false;
+        mqttPubDisconnected();
+    }
+}
+
+static void mqttTopicAction(const topicAction_t *action) {
+    // действие из скомпилированного списка внешних топиков
+    if (action->type == TOPIC_OUT) {
+        if (action->slaveId) {
+            setRemoteOutput(action->slaveId, action->id, action->action);
+        } else {
+            setOutput(action->id, action->action);
+        }
+    } else if (action->type == TOPIC_IN) {
+        processInputEvents(action->slaveId, action->id, action->action, 255);
+    }
 }
 
 void mqttData(char* topic, char* data) {
     ESP_LOGW(TAG, "parseTopic %s %s", topic, data);
-    char str[100];
-    strcpy(str, getConfigValueString("name"));
-    strcat(str, "/in/\0");
-    if (!strstr(topic, str)) {
+    const char *rest = NULL;
+    if (!topicsIsOwn(topic, &rest)) {
         // это не топики своего устройства. Проверить внешний список
-        if (cJSON_IsArray(jMQTTTopics)) {
-            cJSON *childTopic = jMQTTTopics->child;
-            while (childTopic) { 
-                if (cJSON_IsString(cJSON_GetObjectItem(childTopic, "topic")) &&
-                    !strcmp(topic, cJSON_GetObjectItem(childTopic, "topic")->valuestring)) {
-                    if (cJSON_IsArray(cJSON_GetObjectItem(childTopic, "events"))) {
-                        cJSON *childEvent = cJSON_GetObjectItem(childTopic, "events")->child;
-                        while (childEvent) { 
-                            if (cJSON_IsString(cJSON_GetObjectItem(childEvent, "event")) &&
-                                !strcasecmp(data, cJSON_GetObjectItem(childEvent, "event")->valuestring)) {
-                                if (cJSON_IsString(cJSON_GetObjectItem(childEvent, "action")) &&
-                                    cJSON_IsString(cJSON_GetObjectItem(childEvent, "type"))) {
-                                    if (!strcmp("out", cJSON_GetObjectItem(childEvent, "type")->valuestring) &&
-                                        cJSON_IsNumber(cJSON_GetObjectItem(childEvent, "output"))) {
-                                        uint8_t output = cJSON_GetObjectItem(childEvent, "output")->valueint;
-                                        char *action = cJSON_GetObjectItem(childEvent, "action")->valuestring;
-                                        uint8_t slaveId = 0;
-                                        if (cJSON_IsNumber(cJSON_GetObjectItem(childEvent, "slaveId"))) {
-                                            slaveId = cJSON_GetObjectItem(childEvent, "slaveId")->valueint;
-                                        }                                    
-                                        if (slaveId) {
-                                            setRemoteOutput(slaveId, output, action);            
-                                        } else {
-                                            setOutput(output, action);
-                                        }    
-                                    } else if (!strcmp("in", cJSON_GetObjectItem(childEvent, "type")->valuestring) &&
-                                        cJSON_IsNumber(cJSON_GetObjectItem(childEvent, "input"))) {
-                                        uint8_t input = cJSON_GetObjectItem(childEvent, "input")->valueint;
-                                        char *action = cJSON_GetObjectItem(childEvent, "action")->valuestring;
-                                        uint8_t slaveId = 0;
-                                        if (cJSON_IsNumber(cJSON_GetObjectItem(childEvent, "slaveId"))) {
-                                            slaveId = cJSON_GetObjectItem(childEvent, "slaveId")->valueint;
-                                        }            
-                                        processInputEvents(slaveId, input, action, 255);                                                        
-                                    }
-                                }                                
-                            }
-                            childEvent = childEvent->next;
-                        }
-                    }
-                    break;
-                }
-                childTopic = childTopic->next;
-            }    
-        }
-        /*
-        if (cJSON_IsArray(jMQTTTopics)) {
-            cJSON *childTopic = jMQTTTopics->child;
-            while (childTopic) { 
-                if (cJSON_IsString(cJSON_GetObjectItem(childTopic, "topic")) &&
-                    !strcmp(topic, cJSON_GetObjectItem(childTopic, "topic")->valuestring)) {
-                    if (cJSON_IsArray(cJSON_GetObjectItem(childTopic, "data"))) {
-                        cJSON *childData = cJSON_GetObjectItem(childTopic, "data")->child;
-                        while (childData) { 
-                            if (cJSON_IsString(cJSON_GetObjectItem(childData, "value")) &&
-                                !strcmp(data, cJSON_GetObjectItem(childData, "value")->valuestring)) {
-                                if (cJSON_IsString(cJSON_GetObjectItem(childData, "action")) &&
-                                    cJSON_IsNumber(cJSON_GetObjectItem(childData, "output"))) {
-                                    uint8_t output = cJSON_GetObjectItem(childData, "output")->valueint;
-                                    char *action = cJSON_GetObjectItem(childData, "action")->valuestring;
-                                    uint8_t slaveId = 0;
-                                    if (cJSON_IsNumber(cJSON_GetObjectItem(childData, "slaveId"))) {
-                                        slaveId = cJSON_GetObjectItem(childData, "slaveId")->valueint;
-                                    }                                    
-                                    if (slaveId) {
-                                        setRemoteOutput(slaveId, output, action);            
-                                    } else {
-                                        setOutput(output, action);
-                                    }    
-                                }
-                            }
-                            childData = childData->next;
-                        }
-                    }
-                    break;
-                }
-                childTopic = childTopic->next;
-            }    
-        }
-        */
-        return;
         /*
         [{
             "topic": "Device1/outputs/0/0",
-            "data": [{
-                    "value": "ON",
+            "events": [{
+                    "event": "ON",
+                    "type": "out",
                     "action": "on",
                     "output": 3,
                     "slaveId": 1
-                },
-                {
-                    "value": "OFF",
-                    "action": "off",
-                    "output": 3,
-                    "slaveId": 1
-                }]    
+                }]
         }]
         */
+        if (xSemaphoreTake(sem_busy, portMAX_DELAY) == pdTRUE) {
+            topicsDispatch(topic, data, &mqttTopicAction);
+            xSemaphoreGive(sem_busy);
+        }
+        return;
     }   
 
     // Далее обработка событий самого устройства
@@ -2142,11 +2231,13 @@ void mqttData(char* topic, char* data) {
     uint8_t slaveId = 0;
     uint8_t output = 0xFF;
     char *action = NULL;
+    cJSON *jData = NULL;
 
-    if (strstr(topic, "/json")) {
-        cJSON *jData = cJSON_Parse(data);
+    if (!strcmp(rest, "json")) {
+        jData = cJSON_Parse(data);
         if (!cJSON_IsObject(jData)) {
             ESP_LOGE(TAG, "data is not a json");
+            cJSON_Delete(jData);
             return;
         }
         if (cJSON_IsNumber(cJSON_GetObjectItem(jData, "slaveId")))
@@ -2157,23 +2248,19 @@ void mqttData(char* topic, char* data) {
             action = cJSON_GetObjectItem(jData, "action")->valuestring;
         if ((output == 0xFF) || (action == NULL)) {
             ESP_LOGE(TAG, "Wrong json data!");
+            cJSON_Delete(jData);
             return;
         }                
     } else {
-        char *token = strtok(topic, "/"); // host
-        if (token == NULL)
-            return;
-        token = strtok(NULL, "/"); // in
-        if (token == NULL)
-            return;
-        token = strtok(NULL, "/"); // slaveId
-        if (token == NULL)
+        // <name>/in/<slaveId>/<output>, топик не изменяется
+        char *end = NULL;
+        slaveId = strtoul(rest, &end, 10);
+        if (end == rest || *end != '/')
             return;
-        slaveId = atoi(token);    
-        token = strtok(NULL, "/"); // output
-        if (token == NULL)
+        rest = end + 1;
+        output = strtoul(rest, &end, 10);
+        if (end == rest)
             return;
-        output = atoi(token); 
         action = toLower(data);                
     }
 
@@ -2189,34 +2276,112 @@ void mqttData(char* topic, char* data) {
         }
         xSemaphoreGive(sem_busy);
     }
+    cJSON_Delete(jData);
 }
 
 int custom_vprintf(const char *fmt, va_list args) {
-    if (wsSendLogs) {
-        char log_buffer[256];    
-        vsnprintf(log_buffer, sizeof(log_buffer), fmt, args);
-        cJSON *json = cJSON_CreateObject();        
-        cJSON_AddStringToObject(json, "type", "LOG");
-        cJSON_AddStringToObject(json, "payload", log_buffer);
-        char *jsonStr = cJSON_PrintUnformatted(json);
-        WSSendMessage(jsonStr);
-        free(jsonStr);
-        cJSON_Delete(json);
-    }    
+    // строка уходит в буфер отправки, args нужны еще для вывода в консоль
+    va_list copy;
+    va_copy(copy, args);
+    logShipWrite(fmt, copy);
+    va_end(copy);
     return vprintf(fmt, args);
 }
 
+void compileMQTTTopics() {
+    // подписки на внешние топики собираются в дерево при загрузке и смене конфига
+    jMQTTTopics = cfgRefObject(&cfgMqttTopics);
+    topicsCompile(jMQTTTopics, identityName());
+    char *wire = cfgRefString(&cfgMqttWire);
+    mqttWire = wire != NULL && !strcmp(wire, "cbor1") ? WIRE_CBOR : WIRE_JSON;
+}
+
+static bool ioConfigValid(cJSON *io) {
+    return cJSON_IsObject(io) &&
+           cJSON_IsArray(cJSON_GetObjectItem(io, "outputs")) &&
+           cJSON_IsArray(cJSON_GetObjectItem(io, "inputs"));
+}
+
+esp_err_t applyConfig(cJSON *config, uint16_t gen) {
+    // общий путь POST /service/config и SETDEVICECONFIG, под sem_busy.
+    // gen - поколение арены, в котором разобран config
+    if (!cJSON_IsObject(config)) {
+        arenaGuard();
+        cJSON_Delete(config);
+        arenaUnguard();
+        // текущий конфиг остается, освобождается только разобранное
+        arenaKeep(arenaLive());
+        return ESP_ERR_INVALID_ARG;
+    }
+    arenaGuard();
+    // ссылки сбрасываются, пока старое дерево еще живо
+    cfgRefInvalidate();
+    replaceConfig(config);
+    static cfgRef_t cfgModel = CFG_REF("model");
+    char *model = cfgRefString(&cfgModel);
+    if (model != NULL) {
+        cfgRefInvalidate();
+        setConfigValueString("controllerType", model);
+    }
+    IOConfig = cfgRefObject(&cfgIO);
+    if (!ioConfigValid(IOConfig)) {
+        ESP_LOGW(TAG, "Config without valid io");
+        createIOConfig();
+        cfgRefInvalidate();
+        setConfigValueObject("io", IOConfig);
+    }
+    correctIOConfig(false);
+    arenaKeep(gen);
+    onConfigChanged();
+    arenaUnguard();
+    return saveConfig();
+}
+
+static void pulseReload() {
+    // счетные входы при загрузке и после смены конфига
+    pulseInit(IOConfig, (controllerType == RCV1B || controllerType == RCV2B) ? 4 : 2, &correctInput);
+    pulseStart();
+}
+
+void onConfigChanged() {
+    // вызывается под sem_busy после замены конфига
+    actionsCancelAll();
+    identityRefresh();
+    compileMQTTTopics();
+    iomodelLoadJson(IOConfig);
+    statesRebuild(IOConfig);
+    hardwareReadConfig();
+    pulseReload();
+    mqttPubConfigChanged();
+    mqttPubSetIdentity(identityName(), identityMac(), controllersData[controllerType].name);
+    if (mqttConnected)
+        mqttPubConnected();
+}
+
 void initMQTT() {
-    if (getConfigValueBool("mqtt/enabled")) {
-        jMQTTTopics = getConfigValueObject("mqtt/topics");
+    static cfgRef_t cfgMqttEnabled = CFG_REF("mqtt/enabled");
+    if (xSemaphoreTake(sem_busy, portMAX_DELAY) != pdTRUE)
+        return;
+    if (cfgRefBool(&cfgMqttEnabled)) {
+        mqttEnabled = true;
+        mqttPubInit(true);
+        compileMQTTTopics();
+        mqttPubSetIdentity(identityName(), identityMac(), controllersData[controllerType].name);
         MQTTInit(&mqttData, &mqttEvent, jMQTTTopics);
     }
+    xSemaphoreGive(sem_busy);
 }
 
 void initFTP(uint32_t address) {
-    if (getConfigValueBool("network/ftp/enabled")) { 
-        FTPinit(getConfigValueString("network/ftp/user"), getConfigValueString("network/ftp/pass"), address);
+    static cfgRef_t cfgFtpEnabled = CFG_REF("network/ftp/enabled");
+    static cfgRef_t cfgFtpUser = CFG_REF("network/ftp/user");
+    static cfgRef_t cfgFtpPass = CFG_REF("network/ftp/pass");
+    if (xSemaphoreTake(sem_busy, portMAX_DELAY) != pdTRUE)
+        return;
+    if (cfgRefBool(&cfgFtpEnabled)) { 
+        FTPinit(cfgRefString(&cfgFtpUser), cfgRefString(&cfgFtpPass), address);
     }
+    xSemaphoreGive(sem_busy);
 }
 
 void sntpEvent() {
@@ -2234,11 +2399,11 @@ esp_err_t initCore(SemaphoreHandle_t sem) {
 	//createSemaphore();
     setRGBFace("yellow");
     resetReason = esp_reset_reason();
-    char *hostname = getConfigValueString("name");
-    char *description = getConfigValueString("description");    
-    ESP_LOGI(TAG, "Hostname %s, description %s", SS(hostname), SS(description));
-
     sem_busy = sem;
+    identityRefresh();
+    ESP_LOGI(TAG, "Hostname %s, description %s", identityName(), identityDescription());
+    healthInit();
+    tasksInit();
     initHardware(sem);    
 	determinateControllerType();
 	ESP_LOGI(TAG, "Controllertype is %s", controllersData[controllerType].name);
@@ -2246,30 +2411,42 @@ esp_err_t initCore(SemaphoreHandle_t sem) {
         ESP_LOGE(TAG, "Unknown controller type!");        
         //return;
     }
-    IOConfig = getConfigValueObject("io");
-	if (IOConfig == NULL || 
-        (cJSON_IsObject(IOConfig) && !cJSON_IsArray(cJSON_GetObjectItem(IOConfig, "outputs"))) ||
-        (cJSON_IsObject(IOConfig) && !cJSON_IsArray(cJSON_GetObjectItem(IOConfig, "inputs"))) ) {
+    bootStage(BOOT_HARDWARE);
+    IOConfig = cfgRefObject(&cfgIO);
+	if (!ioConfigValid(IOConfig)) {
         createIOConfig();
+        cfgRefInvalidate();
         bool res = setConfigValueObject("io", IOConfig);
         ESP_LOGI(TAG, "IOConfig set result %d", res);
-        saveConfig();
+        bootSaveConfig();
     }    
     initModBus();
     correctIOConfig(false);
+    iomodelLoadJson(IOConfig);
     initInputs();
 	initOutputs();    
-    xTaskCreate(&serviceTask, "serviceTask", 4096, NULL, 5, NULL);    
+    statesInit();
+    statesRebuild(IOConfig);
+    bootStage(BOOT_IO_MODEL);
+    bootSetWorker(taskStart(TASK_SERVICE, &serviceTask, NULL));
     if (checkServiceButtons()) {
         setRGBFace("yellow");
         ESP_LOGI(TAG, "Service button pressed while boot. Sevice mode...");
+        bootStage(BOOT_CORE_DONE);      // иначе отложенная запись конфига не выполнится
         return ESP_ERR_NOT_FINISHED;
         // чтобы сеть не стартовала и запустилась AP
     } 
     startInputTask();
+    bootStage(BOOT_LOCAL_CONTROL);
     initScheduler();	    
+    sensorsInit(getOWBridge());
+    sensorsStart();
+    pulseReload();
+    historyInit();
+    tasksSetBootHeap();
     esp_log_set_vprintf(&custom_vprintf);
     setRGBFace("green"); // TODO : сделать зеленый когда все поднялось. И продумать цвета    
+    bootStage(BOOT_CORE_DONE);
     return ESP_OK;
 }
 
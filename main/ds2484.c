@@ -0,0 +1,300 @@
+#include <stdio.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "cJSON.h"
+#include "config.h"
+#include "ds2484.h"
+
+// Команды DS2484. После команды 1-Wire указатель чтения стоит на статусе,
+// поэтому готовность проверяется простым чтением байта.
+// Питание датчиков внешнее: паразитное питание требует сильной подтяжки (SPU)
+// на время преобразования, здесь не поддерживается.
+
+#define DS2484_CMD_DEVICE_RESET 0xF0
+#define DS2484_CMD_SET_POINTER  0xE1
+#define DS2484_CMD_WRITE_CONFIG 0xD2
+#define DS2484_CMD_OW_RESET     0xB4
+#define DS2484_CMD_OW_WRITE     0xA5
+#define DS2484_CMD_OW_READ      0x96
+#define DS2484_CMD_OW_TRIPLET   0x78
+
+#define DS2484_PTR_DATA         0xE1
+#define DS2484_CONFIG_APU       0x01    // активная подтяжка
+#define DS2484_STATUS_RST       0x10
+
+// сброс 1-Wire около 1.3 мс, байт 0.6 мс на стандартной скорости
+#define DS2484_WAIT_US          3000
+
+#define DS2484_SIM_MAX          8
+#define DS2484_SIM_ALL          ((1 << DS2484_SIM_MAX) - 1)
+
+static const char *TAG = "DS2484";
+
+// имитация: DS18B20 с внешним питанием, ROM 28 xx 5A 00 00 00 00 crc
+enum simStates {
+    SIM_IDLE = 0,               // до следующего сброса
+    SIM_ROM,                    // ждет ROM команду
+    SIM_MATCH,
+    SIM_SEARCH,
+    SIM_FUNCTION,               // ждет команду устройству
+    SIM_READ
+};
+
+static struct {
+    uint8_t count;
+    uint16_t crcErrorEvery;     // испортить каждое N-е чтение памяти
+    uint8_t roms[DS2484_SIM_MAX][8];
+    int16_t raw[DS2484_SIM_MAX];
+    uint8_t state;              // simStates
+    uint8_t active;             // маска выбранных устройств
+    uint8_t pos;                // номер бита поиска или байта
+    uint8_t scratchpad[9];
+    uint32_t conversions;
+    uint32_t reads;
+} sim;
+
+uint8_t owCrc8(const uint8_t *data, uint8_t len) {
+    // Dallas/Maxim, x^8 + x^5 + x^4 + 1
+    uint8_t crc = 0;
+    for (uint8_t i = 0; i < len; i++) {
+        uint8_t byte = data[i];
+        for (uint8_t b = 0; b < 8; b++) {
+            uint8_t mix = (crc ^ byte) & 0x01;
+            crc >>= 1;
+            if (mix)
+                crc ^= 0x8C;
+            byte >>= 1;
+        }
+    }
+    return crc;
+}
+
+static bool simRomBit(uint8_t device, uint8_t bit) {
+    return (sim.roms[device][bit / 8] >> (bit % 8)) & 0x01;
+}
+
+static void simConvert() {
+    // около 20 градусов, у каждого датчика свое смещение и медленная пила
+    sim.conversions++;
+    for (uint8_t i = 0; i < sim.count; i++) {
+        if (sim.active & (1 << i))
+            sim.raw[i] = 20 * 16 + i * 24 + (int16_t)((sim.conversions + i * 3) % 16) - 8;
+    }
+}
+
+static void simScratchpad() {
+    // несколько выбранных отвечают одновременно - на линии И
+    memset(sim.scratchpad, 0xFF, sizeof(sim.scratchpad));
+    for (uint8_t i = 0; i < sim.count; i++) {
+        if (!(sim.active & (1 << i)))
+            continue;
+        uint8_t data[9] = {sim.raw[i] & 0xFF, (uint16_t)sim.raw[i] >> 8, 0x4B, 0x46, 0x7F, 0xFF, 0x0C, 0x10, 0};
+        data[8] = owCrc8(data, 8);
+        for (uint8_t b = 0; b < sizeof(data); b++)
+            sim.scratchpad[b] &= data[b];
+    }
+    if (sim.crcErrorEvery && ++sim.reads % sim.crcErrorEvery == 0)
+        sim.scratchpad[0] ^= 0x01;
+}
+
+static void simWrite(uint8_t byte) {
+    switch (sim.state) {
+        case SIM_ROM:
+            if (byte == 0xF0) {
+                sim.state = SIM_SEARCH;
+                sim.pos = 0;
+            } else if (byte == 0x55) {
+                sim.state = SIM_MATCH;
+                sim.pos = 0;
+            } else if (byte == 0xCC) {
+                sim.state = SIM_FUNCTION;
+            } else {
+                sim.state = SIM_IDLE;
+            }
+            break;
+        case SIM_MATCH:
+            for (uint8_t i = 0; i < sim.count; i++) {
+                if (sim.roms[i][sim.pos] != byte)
+                    sim.active &= ~(1 << i);
+            }
+            if (++sim.pos >= 8)
+                sim.state = SIM_FUNCTION;
+            break;
+        case SIM_FUNCTION:
+            if (byte == 0x44) {
+                simConvert();
+                sim.state = SIM_IDLE;
+            } else if (byte == 0xBE) {
+                simScratchpad();
+                sim.state = SIM_READ;
+                sim.pos = 0;
+            } else {
+                sim.state = SIM_IDLE;
+            }
+            break;
+        default:
+            sim.state = SIM_IDLE;
+    }
+}
+
+static uint8_t simTriplet(uint8_t dir) {
+    if (sim.state != SIM_SEARCH)
+        return DS2484_STATUS_SBR | DS2484_STATUS_TSB | DS2484_STATUS_DIR;
+    bool any0 = false, any1 = false;
+    for (uint8_t i = 0; i < sim.count; i++) {
+        if (!(sim.active & (1 << i)))
+            continue;
+        if (simRomBit(i, sim.pos))
+            any1 = true;
+        else
+            any0 = true;
+    }
+    // бит и его дополнение, 0 на линии побеждает
+    bool sbr = !any0;
+    bool tsb = !any1;
+    bool taken = sbr != tsb ? sbr : (sbr ? true : dir != 0);
+    for (uint8_t i = 0; i < sim.count; i++) {
+        if (simRomBit(i, sim.pos) != taken)
+            sim.active &= ~(1 << i);
+    }
+    if (++sim.pos >= 64)
+        sim.state = SIM_FUNCTION;
+    return (sbr ? DS2484_STATUS_SBR : 0) | (tsb ? DS2484_STATUS_TSB : 0) | (taken ? DS2484_STATUS_DIR : 0);
+}
+
+static esp_err_t simExecute(owCmd_t *cmd) {
+    cmd->status = 0;
+    switch (cmd->cmd) {
+        case OW_RESET:
+            sim.state = SIM_ROM;
+            sim.active = DS2484_SIM_ALL;
+            cmd->status = sim.count > 0 ? DS2484_STATUS_PPD : 0;
+            break;
+        case OW_WRITE:
+            simWrite(cmd->arg);
+            break;
+        case OW_READ:
+            cmd->data = 0xFF;
+            if (sim.state == SIM_READ && sim.pos < sizeof(sim.scratchpad))
+                cmd->data = sim.scratchpad[sim.pos++];
+            break;
+        case OW_TRIPLET:
+            cmd->status = simTriplet(cmd->arg);
+            break;
+        default:
+            return ESP_ERR_INVALID_ARG;
+    }
+    return ESP_OK;
+}
+
+void ds2484SimInit() {
+    // config sensors/simulate {"count": N, "crcErrorEvery": M}
+    cJSON *jSim = getConfigValueObject("sensors/simulate");
+    if (!cJSON_IsObject(jSim) || !cJSON_IsNumber(cJSON_GetObjectItem(jSim, "count")))
+        return;
+    int count = cJSON_GetObjectItem(jSim, "count")->valueint;
+    sim.count = count < 0 ? 0 : (count > DS2484_SIM_MAX ? DS2484_SIM_MAX : count);
+    if (cJSON_IsNumber(cJSON_GetObjectItem(jSim, "crcErrorEvery")))
+        sim.crcErrorEvery = cJSON_GetObjectItem(jSim, "crcErrorEvery")->valueint;
+    for (uint8_t i = 0; i < sim.count; i++) {
+        uint8_t *rom = sim.roms[i];
+        memset(rom, 0, 8);
+        rom[0] = 0x28;
+        rom[1] = 0x11 * (i + 1);
+        rom[2] = 0x5A;
+        rom[7] = owCrc8(rom, 7);
+        sim.raw[i] = 0x0550;    // 85 градусов до первого преобразования
+    }
+    ESP_LOGW(TAG, "Simulated bridge with %d DS18B20, CRC error every %d", sim.count, sim.crcErrorEvery);
+}
+
+bool ds2484Simulated() {
+    return sim.count > 0;
+}
+
+esp_err_t ds2484InitDesc(i2c_dev_t *dev, i2c_port_t port, gpio_num_t sda, gpio_num_t scl) {
+    memset(dev, 0, sizeof(i2c_dev_t));
+    dev->port = port;
+    dev->addr = DS2484_ADDR;
+    dev->cfg.sda_io_num = sda;
+    dev->cfg.scl_io_num = scl;
+    dev->cfg.master.clk_speed = 100000;
+    return i2c_dev_create_mutex(dev);
+}
+
+esp_err_t ds2484Reset(i2c_dev_t *dev) {
+    // сброс моста и активная подтяжка; годится и для повторной инициализации шиной
+    if (ds2484Simulated())
+        return ESP_OK;
+    uint8_t tx[2] = {DS2484_CMD_DEVICE_RESET};
+    uint8_t status = 0;
+    I2C_DEV_TAKE_MUTEX(dev);
+    I2C_DEV_CHECK(dev, i2c_dev_write(dev, NULL, 0, tx, 1));
+    I2C_DEV_CHECK(dev, i2c_dev_read(dev, NULL, 0, &status, 1));
+    tx[0] = DS2484_CMD_WRITE_CONFIG;
+    tx[1] = ((~DS2484_CONFIG_APU & 0x0F) << 4) | DS2484_CONFIG_APU;
+    I2C_DEV_CHECK(dev, i2c_dev_write(dev, NULL, 0, tx, 2));
+    I2C_DEV_GIVE_MUTEX(dev);
+    if (!(status & DS2484_STATUS_RST)) {
+        ESP_LOGE(TAG, "No reset flag, status 0x%x", status);
+        return ESP_ERR_INVALID_RESPONSE;
+    }
+    return ESP_OK;
+}
+
+static esp_err_t waitReady(i2c_dev_t *dev, uint8_t *status) {
+    // задача шины с высоким приоритетом, поэтому без ets_delay_us: пока идет
+    // чтение статуса, она спит в драйвере I2C, между чтениями уступает ядро
+    int64_t deadline = esp_timer_get_time() + DS2484_WAIT_US;
+    do {
+        esp_err_t err = i2c_dev_read(dev, NULL, 0, status, 1);
+        if (err != ESP_OK)
+            return err;
+        if (!(*status & DS2484_STATUS_1WB))
+            return ESP_OK;
+        taskYIELD();
+    } while (esp_timer_get_time() < deadline);
+    return ESP_ERR_TIMEOUT;
+}
+
+esp_err_t ds2484Execute(i2c_dev_t *dev, owCmd_t *cmd) {
+    if (ds2484Simulated())
+        return simExecute(cmd);
+    uint8_t tx[2];
+    uint8_t len = 1;
+    switch (cmd->cmd) {
+        case OW_RESET:
+            tx[0] = DS2484_CMD_OW_RESET;
+            break;
+        case OW_WRITE:
+            tx[0] = DS2484_CMD_OW_WRITE;
+            tx[1] = cmd->arg;
+            len = 2;
+            break;
+        case OW_READ:
+            tx[0] = DS2484_CMD_OW_READ;
+            break;
+        case OW_TRIPLET:
+            tx[0] = DS2484_CMD_OW_TRIPLET;
+            tx[1] = cmd->arg ? 0x80 : 0x00;
+            len = 2;
+            break;
+        default:
+            return ESP_ERR_INVALID_ARG;
+    }
+    I2C_DEV_TAKE_MUTEX(dev);
+    I2C_DEV_CHECK(dev, i2c_dev_write(dev, NULL, 0, tx, len));
+    I2C_DEV_CHECK(dev, waitReady(dev, &cmd->status));
+    if (cmd->cmd == OW_READ) {
+        tx[0] = DS2484_CMD_SET_POINTER;
+        tx[1] = DS2484_PTR_DATA;
+        I2C_DEV_CHECK(dev, i2c_dev_write(dev, NULL, 0, tx, 2));
+        I2C_DEV_CHECK(dev, i2c_dev_read(dev, NULL, 0, &cmd->data, 1));
+    }
+    // короткое на линии 1-Wire (DS2484_STATUS_SD) - не ошибка шины I2C, смотрит вызывающий
+    I2C_DEV_GIVE_MUTEX(dev);
+    return ESP_OK;
+}
@@ -0,0 +1,40 @@
+#pragma once
+#include "i2cdev.h"
+#include "driver/gpio.h"
+
+// Мост I2C - 1-Wire DS2484 (0x18). Одна команда 1-Wire - одна транзакция шины:
+// команда, ожидание готовности по статусу, для чтения байта - регистр данных.
+// Вызывается только из задачи шины (i2cbus.c, I2C_OP_OW).
+// Вместо микросхемы может работать имитация с несколькими DS18B20
+// (config sensors/simulate), чтобы проверять опрос без датчиков.
+
+#define DS2484_ADDR             0x18
+
+// статус
+#define DS2484_STATUS_1WB       0x01    // 1-Wire занята
+#define DS2484_STATUS_PPD       0x02    // есть присутствие
+#define DS2484_STATUS_SD        0x04    // короткое замыкание
+#define DS2484_STATUS_SBR       0x20    // прочитанный бит
+#define DS2484_STATUS_TSB       0x40    // второй бит триплета
+#define DS2484_STATUS_DIR       0x80    // выбранное направление
+
+enum owCommands {
+    OW_RESET = 0,               // status - присутствие
+    OW_WRITE,                   // arg - байт
+    OW_READ,                    // data - прочитанный байт
+    OW_TRIPLET                  // arg - направление 0/1, ответ в status
+};
+
+typedef struct {
+    uint8_t cmd;                // owCommands
+    uint8_t arg;
+    uint8_t status;
+    uint8_t data;
+} owCmd_t;
+
+esp_err_t ds2484InitDesc(i2c_dev_t *dev, i2c_port_t port, gpio_num_t sda, gpio_num_t scl);
+esp_err_t ds2484Reset(i2c_dev_t *dev);
+esp_err_t ds2484Execute(i2c_dev_t *dev, owCmd_t *cmd);
+uint8_t owCrc8(const uint8_t *data, uint8_t len);
+void ds2484SimInit();
+bool ds2484Simulated();
@@ -4,6 +4,7 @@
 #include "i2cdev.h"
 #include "pca9685.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "pcf8574.h"
 #include "pcf8563.h"
 //#include "core.h"
@@ -11,6 +12,10 @@
 #include "utils.h"
 #include "hardware.h"
 #include "config.h"
+#include "tasks.h"
+#include "i2cbus.h"
+#include "nvs.h"
+#include "cfgref.h"
 
 #define SDA 32
 #define SCL 33
@@ -24,24 +29,124 @@
 #define IO_REN   16
 #define I2CPORT  0
 #define MAXFREQ  1526
+#define I2C_SPEED       400000  // PCA9685, PCF8563; PCF8574 не быстрее 100 кГц
+#define I2C_SLOW_SPEED  100000
+#define PCF8574_FIRST   0x20
+#define PCF8574_LAST    0x27
+#define TOPOLOGY_MAGIC  0x544F5031  // "TOP1"
+#define TOPOLOGY_MAX    20
+#define RELAYS   16
+#define RELAY_DEV           3       // PCA9685 реле
+#define RELAY_FULL          4096
+#define RELAY_HOLD_PWM      2000    // удержание по умолчанию
+#define RELAY_PULL_IN_MS    100     // время втягивания по умолчанию
+#define RELAY_SLOT_MS       10      // интервал между пачками включений
+#define RELAY_MAX_PULL_INS  4       // одновременно втягиваются не больше
+#define RELAY_TRACE_SIZE    32
+#define WEAR_MAGIC          0x31455752      // "RWE1"
+#define WEAR_FLUSH_CYCLES   50      // несохраненных включений до записи
+#define WEAR_FLUSH_SEC      3600    // запись накопленного времени включения
+#define WEAR_ALERT_CYCLES   100000  // типичный ресурс контактов под нагрузкой
+#define WEAR_VALID_EPOCH    1700000000
 
 static const char *TAG = "HARDWARE";
 
 static uint16_t relayValues = 0; // значения для реле
-static uint16_t relayPrepareBits = 0; // флаг снижения скважности
-static uint16_t relayBits = 0; // флаг снижения скважности
 static bool i2c = false;
-static SemaphoreHandle_t xMutex;
 static bool clockPresent = false;
-static uint16_t relPWM = 2000;
+static i2c_dev_t owBridge;
+static bool owBridgePresent = false;
+static uint16_t relPWM = RELAY_HOLD_PWM;
+static uint16_t pcaFreq = MAXFREQ;      // hw/freq, копия для reinit на i2cBusTask
 //i2c_dev_t dev_out1, dev_out2;
 
 typedef struct {
     i2c_dev_t device;
     uint8_t address;
+    uint8_t port;           // последнее успешное чтение PCF8574
 } device_t;
 static device_t devices[9];
 
+// экономайзер реле: после включения полная скважность на время втягивания,
+// затем удержание. Снижение по одноразовому таймеру.
+// Включения разносятся по слотам: за слот не больше свободных мест втягивания,
+// остальные ждут. relayValues (логическое состояние) меняется сразу целиком,
+// в PCA9685 пишет только relayTask.
+typedef struct {
+    esp_timer_handle_t timer;
+    uint16_t pullIn;            // мс
+    uint16_t hold;              // скважность удержания
+} relayProfile_t;
+
+enum relayEvents {
+    RELAY_EV_ON = 0,            // запрошено включение
+    RELAY_EV_ENERGIZE,          // подана полная скважность
+    RELAY_EV_HOLD,              // снижено до удержания
+    RELAY_EV_OFF
+};
+
+typedef struct {
+    uint32_t us;
+    uint8_t relay;
+    uint8_t event;
+} relayTrace_t;
+
+static relayProfile_t relays[RELAYS];
+static uint16_t relayDuty[RELAYS];
+static uint16_t relayDirty = 0;     // записать текущую скважность
+static uint16_t relayPending = 0;   // ждут слота на включение
+static uint16_t relayPulling = 0;   // втягиваются
+static portMUX_TYPE relayMux = portMUX_INITIALIZER_UNLOCKED;
+static SemaphoreHandle_t relayWriteMutex = NULL;  // снимок скважности и запись в очередь шины
+static TaskHandle_t relayTaskHandle = NULL;
+static esp_timer_handle_t relaySlotTimer = NULL;
+static uint16_t relaySlotMs = RELAY_SLOT_MS;
+static uint8_t relayMaxPullIns = RELAY_MAX_PULL_INS;
+static int64_t relayNextSlot = 0;
+static int64_t relayFirstUs = 0;    // от старта до первой записи реле в шину
+static int64_t relayRequested = 0;  // время запроса текущей пачки включений
+static uint32_t relaySpreadMaxUs = 0;
+static relayTrace_t relayTrace[RELAY_TRACE_SIZE];
+static uint8_t relayTraceHead = 0;
+
+// износ реле: счетчики в памяти под relayMux, в NVS ("hw"/"wear") одним блобом
+// пачками - по числу включений или раз в час, при перезагрузке принудительно
+typedef struct {
+    uint32_t cycles;            // включений всего
+    uint64_t onUs;              // завершенные включения
+    int64_t onSince;            // 0 - выключено
+    int64_t lastUs;             // последнее переключение, esp_timer
+} relayWear_t;
+
+typedef struct {
+    uint32_t cycles;
+    uint32_t onSec;
+    uint32_t lastSwitch;        // unix, 0 - часы не были выставлены
+} relayWearSaved_t;
+
+typedef struct {
+    uint32_t magic;
+    uint16_t count;
+    uint16_t alerted;           // предупреждение по реле уже отправлено
+    relayWearSaved_t relays[RELAYS];
+} relayWearBlob_t;
+
+static relayWear_t wear[RELAYS];
+static relayWearBlob_t wearSaved;
+static int64_t wearSavedAt = 0;
+static struct {
+    uint32_t flushCycles;
+    uint32_t flushSec;
+    uint32_t alertCycles;
+    uint32_t alertOnHours;      // 0 - выключено
+} wearLimits;
+static struct {
+    uint32_t saves;
+    uint32_t lastSaveUs;
+    uint32_t maxSaveUs;
+    uint32_t errors;
+} wearStats;
+
 void sendTo595(uint8_t *values, uint8_t count) {
     // Функция просто отправит данные в 595 
     uint8_t value;
@@ -95,8 +200,7 @@ void setGPIOIn(uint8_t gpio) {
 }
 
 void initHardware(SemaphoreHandle_t sem) {
-    //xMutex = sem;
-    xMutex = xSemaphoreCreateMutex();
+    hardwareReadConfig();
     setGPIOOut(IO_EN);
     setGPIOOut(IO_REN);
     gpio_set_level(IO_EN, 1);    
@@ -116,19 +220,72 @@ void initHardware(SemaphoreHandle_t sem) {
     }
 }
 
+void hardwareReadConfig() {
+    // при загрузке и в onConfigChanged под sem_busy, reinit конфиг не читает
+    // профили реле: hw/pullIn (мс), hw/pwm и hw/relays: [{"id": 0, "pullIn": 200, "pwm": 1500}]
+    static cfgRef_t cfgFreq = CFG_REF("hw/freq");
+    static cfgRef_t cfgPwm = CFG_REF("hw/pwm");
+    static cfgRef_t cfgPullIn = CFG_REF("hw/pullIn");
+    static cfgRef_t cfgRelays = CFG_REF("hw/relays");
+    static cfgRef_t cfgSlotMs = CFG_REF("hw/slotMs");
+    static cfgRef_t cfgMaxPullIns = CFG_REF("hw/maxPullIns");
+    uint16_t nFreq = cfgRefInt(&cfgFreq);    
+    pcaFreq = nFreq > 0 ? nFreq : MAXFREQ; //  TODO : && nFreq < MAXFREQ
+    uint16_t nRelPWM = cfgRefInt(&cfgPwm);    
+    relPWM = nRelPWM > 0 ? nRelPWM : RELAY_HOLD_PWM;
+    int pullIn = cfgRefInt(&cfgPullIn);
+    if (pullIn <= 0)
+        pullIn = RELAY_PULL_IN_MS;
+    uint16_t pullIns[RELAYS];
+    uint16_t holds[RELAYS];
+    for (uint8_t i = 0; i < RELAYS; i++) {
+        pullIns[i] = pullIn;
+        holds[i] = relPWM;
+    }
+    cJSON *jRelays = cfgRefObject(&cfgRelays);
+    cJSON *child = cJSON_IsArray(jRelays) ? jRelays->child : NULL;
+    while (child) {
+        cJSON *id = cJSON_GetObjectItem(child, "id");
+        if (cJSON_IsNumber(id) && id->valueint >= 0 && id->valueint < RELAYS) {
+            if (cJSON_IsNumber(cJSON_GetObjectItem(child, "pullIn")))
+                pullIns[id->valueint] = cJSON_GetObjectItem(child, "pullIn")->valueint;
+            if (cJSON_IsNumber(cJSON_GetObjectItem(child, "pwm")))
+                holds[id->valueint] = cJSON_GetObjectItem(child, "pwm")->valueint;
+        }
+        child = child->next;
+    }
+    int slotMs = cfgRefInt(&cfgSlotMs);
+    int maxPullIns = cfgRefInt(&cfgMaxPullIns);
+    // relayTask и таймеры читают профили под relayMux
+    // удерживаемые реле сразу получают новый hold, втягиваемые - по таймеру
+    bool dirty = false;
+    portENTER_CRITICAL(&relayMux);
+    for (uint8_t i = 0; i < RELAYS; i++) {
+        relays[i].pullIn = pullIns[i];
+        relays[i].hold = holds[i] > RELAY_FULL ? RELAY_FULL : holds[i];
+        if (testbit(relayValues, i) && !testbit(relayPulling | relayPending, i)
+            && relayDuty[i] != relays[i].hold) {
+            relayDuty[i] = relays[i].hold;
+            setbit(relayDirty, i);
+            dirty = true;
+        }
+    }
+    relaySlotMs = slotMs > 0 ? slotMs : RELAY_SLOT_MS;
+    relayMaxPullIns = maxPullIns > 0 ? (maxPullIns > RELAYS ? RELAYS : maxPullIns) : RELAY_MAX_PULL_INS;
+    portEXIT_CRITICAL(&relayMux);
+    if (dirty && relayTaskHandle != NULL)
+        xTaskNotifyGive(relayTaskHandle);
+}
+
 esp_err_t initPCA9685hw(i2c_dev_t dev, bool setValues) {
     esp_err_t err = ESP_FAIL;
-    uint16_t freq = MAXFREQ;
-    uint16_t nFreq = getConfigValueInt("hw/freq");    
-    if (nFreq > 0) //  TODO : && nFreq < MAXFREQ
-        freq = nFreq;
-    uint16_t nRelPWM = getConfigValueInt("hw/pwm");    
-    if (nRelPWM > 0)
-        relPWM = nRelPWM;
+    uint16_t freq = pcaFreq;
     //if (xSemaphoreTake(xMutex, portMAX_DELAY) == pdTRUE) {        
         err = pca9685_init(&dev);
+        if (err == ESP_OK)
+            err = pca9685_restart(&dev);
         if (err == ESP_OK) {
-            ESP_ERROR_CHECK(pca9685_restart(&dev));
+            // вызывается и при восстановлении связи, поэтому без ESP_ERROR_CHECK
             pca9685_set_pwm_frequency(&dev, freq);
             // set all to off
             if (setValues) {
@@ -152,21 +309,141 @@ void setI2COut(uint8_t adr, uint8_t num, uint16_t value) {
 //return;    
     if (value > 4096)
         value = 4096;
-    if (xSemaphoreTake(xMutex, portMAX_DELAY) == pdTRUE) {        
-        pca9685_set_pwm_value(&devices[adr].device, num, value);
-        xSemaphoreGive(xMutex); 
-    }   
+    // запись уходит в очередь шины, соседние каналы склеиваются
+    i2cBusWritePwm(&devices[adr].device, num, 1, &value);
+}
+
+static esp_err_t setI2COuts(uint8_t adr, uint8_t first, uint8_t count, const uint16_t *values) {
+    // несколько подряд идущих каналов одной транзакцией
+    if (!i2c) return ESP_OK;
+    return i2cBusWritePwm(&devices[adr].device, first, count, values);
+}
+
+static esp_err_t relayWrite(uint16_t mask) {
+    // пишется диапазон от первого до последнего измененного канала
+    if (mask == 0)
+        return ESP_OK;
+    uint8_t first = __builtin_ctz(mask);
+    uint8_t last = 31 - __builtin_clz(mask);
+    uint16_t values[RELAYS];
+    // снимок и запись под одним мьютексом: записи уходят в шину в том же порядке,
+    // в каком сняты, старая скважность не ляжет поверх более новой
+    if (xSemaphoreTake(relayWriteMutex, portMAX_DELAY) != pdTRUE)
+        return ESP_ERR_TIMEOUT;
+    portENTER_CRITICAL(&relayMux);
+    memcpy(values, &relayDuty[first], (last - first + 1) * sizeof(uint16_t));
+    portEXIT_CRITICAL(&relayMux);
+    esp_err_t err = setI2COuts(RELAY_DEV, first, last - first + 1, values);
+    xSemaphoreGive(relayWriteMutex);
+    return err;
+}
+
+static void relayTraceAdd(uint8_t relay, uint8_t event, int64_t now) {
+    // под relayMux
+    relayTrace[relayTraceHead].us = now;
+    relayTrace[relayTraceHead].relay = relay;
+    relayTrace[relayTraceHead].event = event;
+    relayTraceHead = (relayTraceHead + 1) % RELAY_TRACE_SIZE;
+}
+
+static void relayNotify(void *arg) {
+    if (relayTaskHandle != NULL)
+        xTaskNotifyGive(relayTaskHandle);
+}
+
+static void relayHoldTimer(void *arg) {
+    // контекст esp_timer, I2C здесь не трогаем
+    uint8_t i = (uint32_t)arg;
+    portENTER_CRITICAL(&relayMux);
+    clrbit(relayPulling, i);
+    if (testbit(relayValues, i) && relays[i].hold < RELAY_FULL) {
+        relayDuty[i] = relays[i].hold;
+        setbit(relayDirty, i);
+        relayTraceAdd(i, RELAY_EV_HOLD, esp_timer_get_time());
+    }
+    portEXIT_CRITICAL(&relayMux);
+    // освободилось место втягивания
+    relayNotify(NULL);
+}
+
+static uint32_t wearParam(cJSON *jWear, const char *name, uint32_t def) {
+    cJSON *jValue = cJSON_GetObjectItem(jWear, name);
+    return cJSON_IsNumber(jValue) && jValue->valueint >= 0 ? jValue->valueint : def;
+}
+
+static void wearLoad() {
+    // hw/wear {"flushCycles", "flushSec", "alertCycles", "alertOnHours"}
+    static cfgRef_t cfgWear = CFG_REF("hw/wear");
+    cJSON *jWear = cfgRefObject(&cfgWear);
+    wearLimits.flushCycles = wearParam(jWear, "flushCycles", WEAR_FLUSH_CYCLES);
+    wearLimits.flushSec = wearParam(jWear, "flushSec", WEAR_FLUSH_SEC);
+    wearLimits.alertCycles = wearParam(jWear, "alertCycles", WEAR_ALERT_CYCLES);
+    wearLimits.alertOnHours = wearParam(jWear, "alertOnHours", 0);
+    nvs_handle_t nvs;
+    size_t len = sizeof(wearSaved);
+    esp_err_t err = ESP_FAIL;
+    if (nvs_open("hw", NVS_READONLY, &nvs) == ESP_OK) {
+        err = nvs_get_blob(nvs, "wear", &wearSaved, &len);
+        nvs_close(nvs);
+    }
+    if (err != ESP_OK || len != sizeof(wearSaved) || wearSaved.magic != WEAR_MAGIC ||
+        wearSaved.count != RELAYS) {
+        memset(&wearSaved, 0, sizeof(wearSaved));
+        wearSaved.magic = WEAR_MAGIC;
+        wearSaved.count = RELAYS;
+    }
+    for (uint8_t i = 0; i < RELAYS; i++) {
+        wear[i].cycles = wearSaved.relays[i].cycles;
+        wear[i].onUs = (uint64_t)wearSaved.relays[i].onSec * 1000000;
+    }
+    wearSavedAt = esp_timer_get_time();
+}
+
+static void initRelays() {
+    // профили уже прочитаны в hardwareReadConfig
+    wearLoad();
+    relayWriteMutex = xSemaphoreCreateMutex();
+    esp_timer_create_args_t slotArgs = {
+        .callback = &relayNotify,
+        .name = "relaySlot"
+    };
+    esp_timer_create(&slotArgs, &relaySlotTimer);
+    for (uint8_t i = 0; i < RELAYS; i++) {
+        esp_timer_create_args_t args = {
+            .callback = &relayHoldTimer,
+            .arg = (void*)(uint32_t)i,
+            .name = "relayHold"
+        };
+        esp_timer_create(&args, &relays[i].timer);
+    }
+}
+
+static void readPorts(const uint8_t *adrs, uint8_t *values, uint8_t count) {
+    // чтение нескольких PCF8574 одной пачкой через задачу шины
+    // если пачка не выполнилась (таймаут, нет слота), в trans остается последнее
+    // хорошее значение, а не 0 - иначе на входах появятся ложные фронты
+    i2cTrans_t trans[I2C_BATCH_SIZE] = {0};
+    for (uint8_t i = 0; i < count; i++) {
+        trans[i].op = I2C_OP_PORT_READ;
+        trans[i].dev = &devices[adrs[i]].device;
+        trans[i].port = devices[adrs[i]].port;
+        trans[i].result = ESP_FAIL;
+    }
+    esp_err_t err = i2cBusSubmit(trans, count, 0);
+    if (err != ESP_OK)
+        ESP_LOGD(TAG, "Ports read: %s", esp_err_to_name(err));
+    for (uint8_t i = 0; i < count; i++) {
+        if (trans[i].result == ESP_OK)
+            devices[adrs[i]].port = trans[i].port;
+        values[i] = devices[adrs[i]].port;
+    }
 }
 
 uint8_t readFrom8574(uint8_t adr) {
     if (!i2c) return 0;
-//return 0;    
-    uint8_t inputs;
     //adr 1,2,5,6
-    if (xSemaphoreTake(xMutex, portMAX_DELAY) == pdTRUE) {        
-        pcf8574_port_read(&devices[adr].device, &inputs);
-        xSemaphoreGive(xMutex); 
-    }       
+    uint8_t inputs;
+    readPorts(&adr, &inputs, 1);
     return inputs;
 }
 
@@ -207,27 +484,61 @@ void setRGBFace(char* color) {
     
 }
 
-// нужен таск для выставления и проверки значений PWM для реле.
-// т.е. прилетает просто сигнал о необходимости включить реле, а таск уже сам должен выставить снижение тока
-// если прилетает значение вкл для реле и при этом реле уже вкл, то не надо второй раз давать импульс,
-// только если ранее реле было выключено
-void relayTask(void *pvParameter) {    
-    // SemaphoreHandle_t sem = getSemaphore();
-    //cJSON *actionChild = (cJSON*)pvParameter;
-    
-    while (1) {
-        if (1) {//(xSemaphoreTake(sem, portMAX_DELAY) == pdTRUE) {
-            for (uint8_t i=0;i<16;i++) {
-                if (testbit(relayValues, i) && !testbit(relayPrepareBits, i)) {                
-                    setbit(relayPrepareBits, i);
-                } else if (testbit(relayValues, i) && !testbit(relayBits, i)) {
-                    setI2COut(3, i, relPWM); // снижаем скважность
-                    setbit(relayBits, i);
-                }
+static void relayService() {
+    // выключения и снижения пишутся сразу, включения - по слотам
+    int64_t now = esp_timer_get_time();
+    uint16_t start = 0;
+    portENTER_CRITICAL(&relayMux);
+    uint16_t write = relayDirty;
+    relayDirty = 0;
+    if (relayPending && now >= relayNextSlot) {
+        int8_t free = relayMaxPullIns - __builtin_popcount(relayPulling);
+        for (uint8_t i = 0; i < RELAYS && free > 0; i++) {
+            if (testbit(relayPending, i)) {
+                setbit(start, i);
+                relayDuty[i] = RELAY_FULL;
+                relayTraceAdd(i, RELAY_EV_ENERGIZE, now);
+                free--;
             }
-            // xSemaphoreGive(sem);
         }
-        vTaskDelay(100 / portTICK_RATE_MS);        
+        relayPending &= ~start;
+        relayPulling |= start;
+        if (start && relayPending == 0 && now - relayRequested > relaySpreadMaxUs)
+            relaySpreadMaxUs = now - relayRequested;
+    }
+    uint16_t pending = relayPending;
+    bool full = __builtin_popcount(relayPulling) >= relayMaxPullIns;
+    portEXIT_CRITICAL(&relayMux);
+
+    esp_err_t err = relayWrite(write | start);
+    if (err != ESP_OK) {
+        // не записанное уйдет со следующим обслуживанием
+        portENTER_CRITICAL(&relayMux);
+        relayDirty |= write | start;
+        portEXIT_CRITICAL(&relayMux);
+    }
+    // реальная запись, а не запрос в setRelayValues
+    if ((write | start) && err == ESP_OK && relayFirstUs == 0)
+        relayFirstUs = esp_timer_get_time();
+    // время втягивания отсчитывается от записи полной скважности
+    for (uint8_t i = 0; i < RELAYS; i++) {
+        if (testbit(start, i))
+            esp_timer_start_once(relays[i].timer, relays[i].pullIn * 1000ULL);
+    }
+    if (start)
+        relayNextSlot = now + relaySlotMs * 1000;
+    // при занятых местах разбудит таймер втягивания
+    if (pending && !full) {
+        esp_timer_stop(relaySlotTimer);
+        esp_timer_start_once(relaySlotTimer, relayNextSlot > now ? relayNextSlot - now : 0);
+    }
+}
+
+// таск записи скважности реле. Спит, пока нет переключений и таймеров
+void relayTask(void *pvParameter) {    
+    while (1) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        relayService();
     }    
     vTaskDelete(NULL);
 }
@@ -250,7 +561,7 @@ void i2cScan(uint8_t found[], uint8_t *size) {
         dev.addr = addr;
         res = i2c_dev_probe(&dev, I2C_DEV_WRITE);
 
-        if (res == 0) {
+        if (res == 0 && *size < TOPOLOGY_MAX) {
             found[(*size)++] = addr;
             printf(" %.2x", addr);
         }
@@ -283,13 +594,111 @@ bool isInArray(uint8_t *array, uint8_t arraySize, uint8_t element) {
     return false;
 }
 
+// найденные при сканировании адреса хранятся в NVS. При загрузке опрашиваются
+// только адреса, влияющие на тип платы, и адреса из кэша; при расхождении - полное сканирование
+typedef struct {
+    uint32_t magic;
+    uint8_t count;
+    uint8_t addrs[TOPOLOGY_MAX];
+    uint32_t fingerprint;
+} topology_t;
+
+static const uint8_t topologyKnown[] = {0x18, 0x20, 0x21, 0x22, 0x23, 0x27, 0x40, 0x41, 0x42, 0x51};
+
+static struct {
+    bool cached;
+    uint8_t count;
+    uint32_t fingerprint;
+    uint32_t detectUs;
+} topologyStats;
+
+static uint32_t topologyFingerprint(const uint8_t *addrs, uint8_t count) {
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    for (uint8_t i = 0; i < count; i++)
+        hash = (hash ^ addrs[i]) * 16777619u;
+    return hash;
+}
+
+static bool probeAddress(uint8_t addr) {
+    i2c_dev_t dev = { 0 };
+    dev.cfg.sda_io_num = SDA;
+    dev.cfg.scl_io_num = SCL;
+    dev.cfg.master.clk_speed = 100000;
+    dev.addr = addr;
+    return i2c_dev_probe(&dev, I2C_DEV_WRITE) == ESP_OK;
+}
+
+static bool topologyConfirm(uint8_t *found, uint8_t *size) {
+    topology_t t;
+    size_t len = sizeof(t);
+    nvs_handle_t nvs;
+    if (nvs_open("hw", NVS_READONLY, &nvs) != ESP_OK)
+        return false;
+    esp_err_t err = nvs_get_blob(nvs, "topology", &t, &len);
+    nvs_close(nvs);
+    if (err != ESP_OK || len != sizeof(t) || t.magic != TOPOLOGY_MAGIC || t.count > TOPOLOGY_MAX ||
+        t.fingerprint != topologyFingerprint(t.addrs, t.count))
+        return false;
+    for (uint8_t i = 0; i < sizeof(topologyKnown); i++) {
+        if (probeAddress(topologyKnown[i]) != isInArray(t.addrs, t.count, topologyKnown[i])) {
+            ESP_LOGW(TAG, "Topology changed at 0x%x", topologyKnown[i]);
+            return false;
+        }
+    }
+    for (uint8_t i = 0; i < t.count; i++) {
+        if (!isInArray((uint8_t*)topologyKnown, sizeof(topologyKnown), t.addrs[i]) && !probeAddress(t.addrs[i])) {
+            ESP_LOGW(TAG, "Topology changed at 0x%x", t.addrs[i]);
+            return false;
+        }
+    }
+    memcpy(found, t.addrs, t.count);
+    *size = t.count;
+    return true;
+}
+
+static void topologySave(const uint8_t *found, uint8_t size) {
+    topology_t t = {.magic = TOPOLOGY_MAGIC, .count = size};
+    memcpy(t.addrs, found, size);
+    t.fingerprint = topologyFingerprint(t.addrs, t.count);
+    nvs_handle_t nvs;
+    if (nvs_open("hw", NVS_READWRITE, &nvs) != ESP_OK)
+        return;
+    if (nvs_set_blob(nvs, "topology", &t, sizeof(t)) == ESP_OK)
+        nvs_commit(nvs);
+    nvs_close(nvs);
+    ESP_LOGI(TAG, "Topology saved, fingerprint 0x%08x", t.fingerprint);
+}
+
+static uint32_t i2cSpeed = I2C_SPEED;
+
+static esp_err_t reinitPCA9685(i2c_dev_t *dev) {
+    // значения каналов восстановит шина
+    return initPCA9685hw(*dev, false);
+}
+
+static esp_err_t reinitPCF8574(i2c_dev_t *dev) {
+    // все выводы на вход (квазидвунаправленные, высокий уровень)
+    return pcf8574_port_write(dev, 0xFF);
+}
+
+static void setI2CTiming(i2c_dev_t *dev) {
+    // одна скорость на порт: при разной clk_speed i2cdev перенастраивает драйвер
+    // при каждой смене устройства. timeout_ticks остается 0 - CONFIG_I2CDEV_TIMEOUT,
+    // ожидание пачки ограничивает таймаут i2cBusSubmit
+    dev->cfg.master.clk_speed = i2cSpeed;
+}
+
 esp_err_t initPCA9685(uint8_t devNum, uint8_t *foundDevices, uint8_t devicesCount) {
     esp_err_t err = ESP_ERR_NOT_FOUND;
     if (isInArray(foundDevices, devicesCount, devices[devNum].address)) {
         pca9685_init_desc(&devices[devNum].device, devices[devNum].address, I2CPORT, SDA, SCL);
+        setI2CTiming(&devices[devNum].device);
         err = initPCA9685hw(devices[devNum].device, true);
-        if (err == ESP_OK)
+        if (err == ESP_OK) {
+            i2cBusAddDevice(&devices[devNum].device, &reinitPCA9685);
             ESP_LOGI(TAG, "PCA9685 with address 0x%x inited OK", devices[devNum].address);
+        }
         else
             ESP_LOGE(TAG, "Can't init PCA9685 address 0x%x", devices[devNum].address);
     }
@@ -301,9 +710,29 @@ esp_err_t initI2Cdevices(enum controllerTypes *ctrlType) {
     *ctrlType = UNKNOWN; 
 
     i2cdev_init();
-    uint8_t foundDevices[20];
+    i2cBusInit();
+    // сканирование на 100 кГц: на шине могут быть PCF8574
+    static cfgRef_t cfgI2CSpeed = CFG_REF("hw/i2cSpeed");
+    int speed = cfgRefInt(&cfgI2CSpeed);
+    if (speed > 0)
+        i2cSpeed = speed > 1000000 ? 1000000 : speed;
+    uint8_t foundDevices[TOPOLOGY_MAX];
     uint8_t devicesCount = 0;
-    i2cScan(foundDevices, &devicesCount);
+    int64_t start = esp_timer_get_time();
+    topologyStats.cached = topologyConfirm(foundDevices, &devicesCount);
+    if (!topologyStats.cached)
+        i2cScan(foundDevices, &devicesCount);
+    topologyStats.detectUs = esp_timer_get_time() - start;
+    topologyStats.count = devicesCount;
+    topologyStats.fingerprint = topologyFingerprint(foundDevices, devicesCount);
+    ESP_LOGI(TAG, "Topology from %s, %d devices, %u us", topologyStats.cached ? "cache" : "scan",
+             devicesCount, topologyStats.detectUs);
+    // скорость порта ограничивает самое медленное устройство
+    for (uint8_t i = 0; i < devicesCount; i++) {
+        if (foundDevices[i] >= PCF8574_FIRST && foundDevices[i] <= PCF8574_LAST && i2cSpeed > I2C_SLOW_SPEED)
+            i2cSpeed = I2C_SLOW_SPEED;
+    }
+    ESP_LOGI(TAG, "I2C speed %u", i2cSpeed);
 
     uint8_t aRCV2S[] = {0x20, 0x21, 0x40, 0x41};
     uint8_t aRCV2M[] = {0x20, 0x21, 0x22, 0x23, 0x27, 0x40, 0x41, 0x42};
@@ -320,6 +749,8 @@ esp_err_t initI2Cdevices(enum controllerTypes *ctrlType) {
         ESP_LOGW(TAG, "No i2c device found or controllerType is unknown");
         return err;
     }
+    if (!topologyStats.cached)
+        topologySave(foundDevices, devicesCount);
     
     /*
     // должна вернуть успех если есть минимальный набор
@@ -353,8 +784,10 @@ esp_err_t initI2Cdevices(enum controllerTypes *ctrlType) {
     ---
     0x18 - i2c-ow DS2484
 	*/
-    for (uint8_t i=0; i<9;i++)
+    for (uint8_t i=0; i<9;i++) {
         memset(&devices[i].device, 0, sizeof(i2c_dev_t));
+        devices[i].port = 0xFF;     // выводы PCF8574 подтянуты вверх
+    }
     // addresses
     devices[0].address = 0x51; // 8563 (clock)
     devices[1].address = 0x20; // 8574 (relay board)
@@ -373,6 +806,8 @@ esp_err_t initI2Cdevices(enum controllerTypes *ctrlType) {
     // TODO : часы сделать
     if (isInArray(foundDevices, devicesCount, devices[0].address)) {
         pcf8563_init_desc(&devices[0].device, 0, SDA, SCL);        
+        setI2CTiming(&devices[0].device);
+        i2cBusAddDevice(&devices[0].device, NULL);
         struct tm timeinfo;
         bool valid;
         if (pcf8563_get_time(&devices[0].device, &timeinfo, &valid) == ESP_OK) {
@@ -411,36 +846,236 @@ esp_err_t initI2Cdevices(enum controllerTypes *ctrlType) {
     pcf8574_init_desc(&devices[2].device, devices[2].address, I2CPORT, SDA, SCL);
     pcf8574_init_desc(&devices[5].device, devices[5].address, I2CPORT, SDA, SCL);
     pcf8574_init_desc(&devices[6].device, devices[6].address, I2CPORT, SDA, SCL);
+    static const uint8_t ports[] = {1, 2, 5, 6};
+    for (uint8_t i = 0; i < sizeof(ports); i++) {
+        setI2CTiming(&devices[ports[i]].device);
+        if (isInArray(foundDevices, devicesCount, devices[ports[i]].address))
+            i2cBusAddDevice(&devices[ports[i]].device, &reinitPCF8574);
+    }
     //pcf8574_init_desc(&devices[8].device, devices[8].address, I2CPORT, SDA, SCL);
 
     //3,4,7    
     initPCA9685(4, foundDevices, devicesCount);
     initPCA9685(7, foundDevices, devicesCount);
     initPCA9685(3, foundDevices, devicesCount);
+
+    // 1-Wire мост для датчиков температуры
+    ds2484SimInit();
+    if (isInArray(foundDevices, devicesCount, DS2484_ADDR) || ds2484Simulated()) {
+        ds2484InitDesc(&owBridge, I2CPORT, SDA, SCL);
+        setI2CTiming(&owBridge);
+        if (ds2484Reset(&owBridge) == ESP_OK) {
+            i2cBusAddDevice(&owBridge, &ds2484Reset);
+            owBridgePresent = true;
+            ESP_LOGI(TAG, "DS2484 inited OK");
+        } else {
+            ESP_LOGE(TAG, "Can't init DS2484");
+        }
+    }
  
     gpio_set_level(IO_EN, 0);
     setRGBFace("yellow");  
     gpio_set_level(IO_REN, 0);
  
-    xTaskCreate(&relayTask, "relayTask", 4096, NULL, 5, NULL);
+    // дальше шиной владеет только i2cBusTask
+    i2cBusStart();
+    initRelays();
+    relayTaskHandle = taskStart(TASK_RELAY, &relayTask, NULL);
     return ESP_OK;
 }
 
+i2c_dev_t *getOWBridge() {
+    return owBridgePresent ? &owBridge : NULL;
+}
+
 void setRelayValues(uint16_t values) {
-    for (uint8_t i=0;i<16;i++) {
-        if (!testbit(values, i) && testbit(relayValues, i)) {
-            // выключение
-            setI2COut(3, i, 0);            
-            clrbit(relayValues, i);            
-        } else if (testbit(values, i) && !testbit(relayValues, i)) {
-            // включение
-            setI2COut(3, i, 4096);            
-            setbit(relayValues, i);
-            clrbit(relayBits, i);
-            clrbit(relayPrepareBits, i);
+    // если реле уже включено, повторного импульса нет - только после выключения
+    // первое состояние после старта пишется целиком, даже если все выключено
+    static bool applied = false;
+    uint16_t changed = (values ^ relayValues) & ((1 << RELAYS) - 1);
+    if ((changed == 0 && applied) || relayTaskHandle == NULL)
+        return;
+    uint16_t initial = applied ? 0 : ~values & ((1 << RELAYS) - 1);
+    applied = true;
+    uint16_t turnedOn = changed & values;
+    uint16_t turnedOff = changed & ~values;
+    for (uint8_t i=0;i<RELAYS;i++) {
+        if (testbit(turnedOff, i))
+            esp_timer_stop(relays[i].timer);
+    }
+    int64_t now = esp_timer_get_time();
+    portENTER_CRITICAL(&relayMux);
+    for (uint8_t i=0;i<RELAYS;i++) {
+        if (testbit(turnedOff, i)) {
+            relayDuty[i] = 0;
+            relayTraceAdd(i, RELAY_EV_OFF, now);
+            wear[i].onUs += now - wear[i].onSince;
+            wear[i].onSince = 0;
+            wear[i].lastUs = now;
+        } else if (testbit(turnedOn, i)) {
+            relayTraceAdd(i, RELAY_EV_ON, now);
+            wear[i].cycles++;
+            wear[i].onSince = now;
+            wear[i].lastUs = now;
         }
     }
+    if (turnedOn && relayPending == 0)
+        relayRequested = now;
     relayValues = values;
+    relayDirty |= turnedOff | initial;
+    relayPulling &= ~turnedOff;
+    relayPending = (relayPending & ~turnedOff) | turnedOn;
+    portEXIT_CRITICAL(&relayMux);
+    relayNotify(NULL);
+}
+
+void relaysAddInfo(cJSON *info) {
+    cJSON *jRelays = cJSON_CreateObject();
+    cJSON_AddNumberToObject(jRelays, "slotMs", relaySlotMs);
+    cJSON_AddNumberToObject(jRelays, "maxPullIns", relayMaxPullIns);
+    cJSON_AddNumberToObject(jRelays, "pending", relayPending);
+    cJSON_AddNumberToObject(jRelays, "pulling", relayPulling);
+    // от запроса до включения последнего реле пачки, максимум
+    cJSON_AddNumberToObject(jRelays, "spreadMaxMs", relaySpreadMaxUs / 1000);
+    // [мс от первого события, реле, событие], события по enum relayEvents
+    relayTrace_t trace[RELAY_TRACE_SIZE];
+    portENTER_CRITICAL(&relayMux);
+    memcpy(trace, relayTrace, sizeof(trace));
+    uint8_t head = relayTraceHead;
+    portEXIT_CRITICAL(&relayMux);
+    cJSON *jTrace = cJSON_CreateArray();
+    uint32_t first = 0;
+    for (uint8_t n = 0; n < RELAY_TRACE_SIZE; n++) {
+        relayTrace_t *t = &trace[(head + n) % RELAY_TRACE_SIZE];
+        if (t->us == 0)
+            continue;
+        if (first == 0)
+            first = t->us;
+        cJSON *jEvent = cJSON_CreateArray();
+        cJSON_AddItemToArray(jEvent, cJSON_CreateNumber((t->us - first) / 1000.0));
+        cJSON_AddItemToArray(jEvent, cJSON_CreateNumber(t->relay));
+        cJSON_AddItemToArray(jEvent, cJSON_CreateNumber(t->event));
+        cJSON_AddItemToArray(jTrace, jEvent);
+    }
+    cJSON_AddItemToObject(jRelays, "trace", jTrace);
+    cJSON_AddItemToObject(info, "relays", jRelays);
+}
+
+static void wearSnapshot(relayWear_t *copy, int64_t now) {
+    // время текущего включения учитывается сразу
+    portENTER_CRITICAL(&relayMux);
+    memcpy(copy, wear, sizeof(wear));
+    portEXIT_CRITICAL(&relayMux);
+    for (uint8_t i = 0; i < RELAYS; i++) {
+        if (copy[i].onSince > 0)
+            copy[i].onUs += now - copy[i].onSince;
+    }
+}
+
+static uint32_t wearLastSwitch(const relayWear_t *w, uint8_t i, int64_t now) {
+    time_t epoch = time(NULL);
+    if (w->lastUs == 0 || epoch < WEAR_VALID_EPOCH)
+        return wearSaved.relays[i].lastSwitch;
+    return epoch - (now - w->lastUs) / 1000000;
+}
+
+static void wearSave(const relayWear_t *copy, int64_t now) {
+    for (uint8_t i = 0; i < RELAYS; i++) {
+        wearSaved.relays[i].cycles = copy[i].cycles;
+        wearSaved.relays[i].onSec = copy[i].onUs / 1000000;
+        wearSaved.relays[i].lastSwitch = wearLastSwitch(&copy[i], i, now);
+    }
+    int64_t start = esp_timer_get_time();
+    nvs_handle_t nvs;
+    esp_err_t err = nvs_open("hw", NVS_READWRITE, &nvs);
+    if (err == ESP_OK) {
+        err = nvs_set_blob(nvs, "wear", &wearSaved, sizeof(wearSaved));
+        if (err == ESP_OK)
+            err = nvs_commit(nvs);
+        nvs_close(nvs);
+    }
+    wearStats.lastSaveUs = esp_timer_get_time() - start;
+    if (wearStats.lastSaveUs > wearStats.maxSaveUs)
+        wearStats.maxSaveUs = wearStats.lastSaveUs;
+    wearSavedAt = now;
+    if (err != ESP_OK) {
+        wearStats.errors++;
+        ESP_LOGE(TAG, "Can't save relay wear: %s", esp_err_to_name(err));
+        return;
+    }
+    wearStats.saves++;
+}
+
+uint16_t relaysWearService(bool force) {
+    // serviceTask раз в секунду; возвращает реле, впервые перешедшие порог
+    int64_t now = esp_timer_get_time();
+    relayWear_t copy[RELAYS];
+    wearSnapshot(copy, now);
+    uint32_t unsaved = 0;
+    bool on = false;
+    uint16_t alerts = 0;
+    for (uint8_t i = 0; i < RELAYS; i++) {
+        unsaved += copy[i].cycles - wearSaved.relays[i].cycles;
+        on |= copy[i].onSince > 0;
+        if (testbit(wearSaved.alerted, i))
+            continue;
+        if ((wearLimits.alertCycles && copy[i].cycles >= wearLimits.alertCycles) ||
+            (wearLimits.alertOnHours && copy[i].onUs / 3600000000ULL >= wearLimits.alertOnHours))
+            setbit(alerts, i);
+    }
+    wearSaved.alerted |= alerts;
+    bool due = now - wearSavedAt >= (int64_t)wearLimits.flushSec * 1000000 && (unsaved > 0 || on);
+    if (alerts || (force && (unsaved > 0 || on)) || unsaved >= wearLimits.flushCycles || due)
+        wearSave(copy, now);
+    return alerts;
+}
+
+void relaysWearJson(uint16_t mask, cJSON *list) {
+    int64_t now = esp_timer_get_time();
+    relayWear_t copy[RELAYS];
+    wearSnapshot(copy, now);
+    for (uint8_t i = 0; i < RELAYS; i++) {
+        if (!testbit(mask, i))
+            continue;
+        cJSON *jRelay = cJSON_CreateObject();
+        cJSON_AddNumberToObject(jRelay, "output", i);
+        cJSON_AddNumberToObject(jRelay, "cycles", copy[i].cycles);
+        cJSON_AddNumberToObject(jRelay, "onHours", copy[i].onUs / 3600000000.0);
+        cJSON_AddNumberToObject(jRelay, "lastSwitch", wearLastSwitch(&copy[i], i, now));
+        cJSON_AddItemToArray(list, jRelay);
+    }
+}
+
+void relaysWearAddInfo(cJSON *info) {
+    cJSON *jWear = cJSON_CreateObject();
+    cJSON_AddNumberToObject(jWear, "saves", wearStats.saves);
+    cJSON_AddNumberToObject(jWear, "lastSaveUs", wearStats.lastSaveUs);
+    cJSON_AddNumberToObject(jWear, "maxSaveUs", wearStats.maxSaveUs);
+    cJSON_AddNumberToObject(jWear, "errors", wearStats.errors);
+    cJSON_AddNumberToObject(jWear, "alertCycles", wearLimits.alertCycles);
+    cJSON_AddNumberToObject(jWear, "alertOnHours", wearLimits.alertOnHours);
+    cJSON_AddNumberToObject(jWear, "alerted", wearSaved.alerted);
+    // только реле, которые хоть раз включались
+    uint16_t used = 0;
+    portENTER_CRITICAL(&relayMux);
+    for (uint8_t i = 0; i < RELAYS; i++) {
+        if (wear[i].cycles > 0)
+            setbit(used, i);
+    }
+    portEXIT_CRITICAL(&relayMux);
+    relaysWearJson(used, cJSON_AddArrayToObject(jWear, "relays"));
+    cJSON_AddItemToObject(info, "relayWear", jWear);
+}
+
+void topologyAddInfo(cJSON *info) {
+    cJSON *jTopology = cJSON_CreateObject();
+    cJSON_AddStringToObject(jTopology, "source", topologyStats.cached ? "cache" : "scan");
+    cJSON_AddNumberToObject(jTopology, "devices", topologyStats.count);
+    cJSON_AddNumberToObject(jTopology, "fingerprint", topologyStats.fingerprint);
+    cJSON_AddNumberToObject(jTopology, "detectMs", topologyStats.detectUs / 1000.0);
+    if (relayFirstUs > 0)
+        cJSON_AddNumberToObject(jTopology, "bootToFirstRelayMs", relayFirstUs / 1000);
+    cJSON_AddItemToObject(info, "topology", jTopology);
 }
 
 esp_err_t setClock() {
@@ -450,13 +1085,14 @@ esp_err_t setClock() {
     time(&now);
     localtime_r(&now, &timeinfo);
     ESP_LOGI(TAG, "setClock is %s", asctime(&timeinfo));    
-    return pcf8563_set_time(&devices[0].device, &timeinfo);
+    i2cTrans_t t = {.op = I2C_OP_CLOCK_SET, .dev = &devices[0].device, .time = timeinfo};
+    return i2cBusSubmit(&t, 1, 0);
 }
 
 esp_err_t getClock(struct tm time) {
-    bool valid;
-    esp_err_t ret = pcf8563_get_time(&devices[0].device, &time, &valid);     
-    if (!valid)
+    i2cTrans_t t = {.op = I2C_OP_CLOCK_GET, .dev = &devices[0].device};
+    esp_err_t ret = i2cBusSubmit(&t, 1, 0);
+    if (!t.valid)
         return ESP_FAIL;
     return ret;
 }
@@ -483,22 +1119,26 @@ void updateStateHW(uint16_t outputs, uint16_t inputsLeds, uint16_t outputsLeds)
         // TODO : сделать для новых
         // отдельно реле, индикация
         setRelayValues(outputs);
-
+        // индикация одной записью на устройство, шина пишет только изменившиеся
+        uint16_t leds[16];
         for (uint8_t i=0; i<6; i++) {
-            setI2COut(4, i, (inputsLeds & (0x1 << i) ) > 0 ? 0 : 4096);        
+            leds[i] = (inputsLeds & (0x1 << i) ) > 0 ? 0 : 4096;
         }
         for (uint8_t i=0; i<4; i++) {
-            setI2COut(4, i+6, (inputsLeds & (0x1 << i) ) > 0 ? 0 : 4096);        
+            leds[i+6] = (inputsLeds & (0x1 << i) ) > 0 ? 0 : 4096;
         }
+        setI2COuts(4, 0, 10, leds);
     } else if (controllerType == RCV2B) {   
         setRelayValues(outputs);
-
+        uint16_t leds[16];
         for (uint8_t i=0; i<16; i++) {
-            setI2COut(4, i, (inputsLeds & (0x1 << i) ) > 0 ? 0 : 4096);        
+            leds[i] = (inputsLeds & (0x1 << i) ) > 0 ? 0 : 4096;
         }
+        setI2COuts(4, 0, 16, leds);
         for (uint8_t i=0; i<12; i++) {
-            setI2COut(7, i, (outputsLeds & (0x1 << i) ) > 0 ? 0 : 4096);        
+            leds[i] = (outputsLeds & (0x1 << i) ) > 0 ? 0 : 4096;
         }
+        setI2COuts(7, 0, 12, leds);
     }   
 }
 
@@ -509,14 +1149,15 @@ void readInputs(uint8_t *values, uint8_t count) {
         readFrom165(values, count);        
     } else if (controllerType == RCV2S || controllerType == RCV2B || controllerType == RCV2M) {
         if (count == 2) {
-            values[0] = readFrom8574(1) & 0x3F;
-            values[1] = readFrom8574(2) & 0x0F;
+            static const uint8_t adrs[] = {1, 2};
+            readPorts(adrs, values, 2);
+            values[0] &= 0x3F;
+            values[1] &= 0x0F;
             //ESP_LOGI(TAG, "Inputs2 %d %d", values[0], values[1]);
         } else if (count == 4) {
-            values[0] = readFrom8574(1); // relay board inputs
-            values[1] = readFrom8574(5); // relay board inputs
-            values[2] = readFrom8574(2); // face
-            values[3] = readFrom8574(6); // face
+            // relay board inputs 1, 5, face 2, 6
+            static const uint8_t adrs[] = {1, 5, 2, 6};
+            readPorts(adrs, values, 4);
         }
     } else {
         // заглушка для неизвестных типов
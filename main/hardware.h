@@ -1,3 +1,4 @@
+#include "i2cdev.h"
 #define BOUTPUTS 6
 #define BINPUTS 4
 
@@ -6,10 +7,17 @@ void readFrom165(uint8_t *values, uint8_t count);
 void setGPIOOut(uint8_t gpio);
 void setGPIOIn(uint8_t gpio);
 void initHardware(SemaphoreHandle_t sem);
+void hardwareReadConfig();
 esp_err_t initI2Cdevices();
 void setI2COut(uint8_t adr, uint8_t num, uint16_t value);
 uint8_t readFrom8574(uint8_t adr);
 void setRelayValues(uint16_t values);
+void relaysAddInfo(cJSON *info);
+uint16_t relaysWearService(bool force);
+void relaysWearJson(uint16_t mask, cJSON *list);
+void relaysWearAddInfo(cJSON *info);
+void topologyAddInfo(cJSON *info);
+i2c_dev_t *getOWBridge();
 enum controllerTypes {
 		UNKNOWN = 0,
 		RCV1S = 1,
@@ -0,0 +1,218 @@
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_system.h"
+#include "esp_attr.h"
+#include "esp_heap_caps.h"
+#include "cJSON.h"
+#include "config.h"
+#include "utils.h"
+#include "health.h"
+
+// Список задач ведется по именам: uxTaskGetSystemState недоступен без
+// CONFIG_FREERTOS_USE_TRACE_FACILITY. Запись в RTC обновляется на каждой проверке,
+// поэтому после паники (например stack canary) видно, что было у края.
+
+#define HEALTH_MAGIC            0x48454C31      // "HEL1"
+#define HEALTH_RECORD_TASKS     4
+#define HEALTH_NAME_SIZE        16
+
+#define HEALTH_DEF_MIN_STACK    256
+#define HEALTH_DEF_MIN_HEAP     16384
+#define HEALTH_DEF_MIN_BLOCK    4096
+
+static const char *TAG = "HEALTH";
+
+static const char *knownTasks[] = {
+    "inputsTask", "serviceTask", "relayTask", "wsSenderTask", "logShipTask",
+    "i2cBusTask", "sensorsTask", "pulseTask", "actionWorker0", "actionWorker1", "actionWorker2",
+    "websocket_task", "mqtt_task", "httpd", "tiT", "sys_evt", "esp_timer"
+};
+
+typedef struct {
+    char name[HEALTH_NAME_SIZE];
+    uint16_t free;              // байт до конца стека, минимум за все время
+} healthStack_t;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t uptime;
+    uint32_t heapFree;
+    uint32_t heapMin;
+    uint32_t heapLargest;
+    uint8_t reason;             // healthReasons, причина перезагрузки по порогу
+    uint8_t count;
+    healthStack_t stacks[HEALTH_RECORD_TASKS];     // самые близкие к краю
+    uint32_t sum;
+} healthRecord_t;
+
+static RTC_NOINIT_ATTR healthRecord_t record;
+static healthRecord_t lastBoot;
+static bool lastBootValid = false;
+
+static struct {
+    uint16_t minStack;
+    uint32_t minHeap;
+    uint32_t minBlock;
+} limits;
+
+static healthStack_t stacks[sizeof(knownTasks) / sizeof(knownTasks[0])];
+static uint8_t stacksCount = 0;
+static uint32_t heapFree, heapMin, heapLargest;
+static uint8_t breachReason = HEALTH_OK;
+static uint8_t breachCount = 0;
+static char breachTask[HEALTH_NAME_SIZE] = "";
+static bool restart = false;
+static uint32_t samples = 0;
+
+static uint32_t recordSum(const healthRecord_t *r) {
+    const uint8_t *p = (const uint8_t*)r;
+    uint32_t sum = 0;
+    for (size_t i = 0; i < offsetof(healthRecord_t, sum); i++)
+        sum = sum * 31 + p[i];
+    return sum;
+}
+
+static void addStack(const char *name, uint16_t free) {
+    for (uint8_t i = 0; i < stacksCount; i++) {
+        if (!strcmp(stacks[i].name, name)) {
+            if (free < stacks[i].free)
+                stacks[i].free = free;
+            return;
+        }
+    }
+    if (stacksCount >= sizeof(stacks) / sizeof(stacks[0]))
+        return;
+    snprintf(stacks[stacksCount].name, HEALTH_NAME_SIZE, "%s", name);
+    stacks[stacksCount].free = free;
+    stacksCount++;
+}
+
+static void sampleTask(const char *name) {
+    TaskHandle_t handle = xTaskGetHandle(name);
+    if (handle == NULL)
+        return;
+    // в ESP-IDF значение в байтах
+    uint16_t free = uxTaskGetStackHighWaterMark(handle);
+    addStack(name, free);
+    if (limits.minStack > 0 && free < limits.minStack && breachReason == HEALTH_OK) {
+        breachReason = HEALTH_STACK;
+        snprintf(breachTask, HEALTH_NAME_SIZE, "%s", name);
+    }
+}
+
+static void saveRecord() {
+    // в запись попадают самые близкие к краю стеки
+    healthStack_t top[HEALTH_RECORD_TASKS] = {0};
+    uint8_t count = 0;
+    bool used[sizeof(stacks) / sizeof(stacks[0])] = {0};
+    for (; count < HEALTH_RECORD_TASKS && count < stacksCount; count++) {
+        int8_t min = -1;
+        for (uint8_t i = 0; i < stacksCount; i++) {
+            if (!used[i] && (min < 0 || stacks[i].free < stacks[min].free))
+                min = i;
+        }
+        used[min] = true;
+        top[count] = stacks[min];
+    }
+    record.magic = HEALTH_MAGIC;
+    record.uptime = getUpTimeRaw();
+    record.heapFree = heapFree;
+    record.heapMin = heapMin;
+    record.heapLargest = heapLargest;
+    record.reason = restart ? breachReason : HEALTH_OK;
+    record.count = count;
+    memcpy(record.stacks, top, sizeof(top));
+    record.sum = recordSum(&record);
+}
+
+static uint32_t limitValue(char *path, uint32_t def) {
+    // нет в конфиге - по умолчанию, отрицательное - порог выключен
+    int value = getConfigValueInt(path);
+    if (value < 0)
+        return 0;
+    return value > 0 ? value : def;
+}
+
+void healthInit() {
+    // запись с прошлой загрузки
+    if (record.magic == HEALTH_MAGIC && record.sum == recordSum(&record)) {
+        lastBoot = record;
+        lastBootValid = true;
+        ESP_LOGW(TAG, "Last boot: uptime %u, heap min %u, largest %u, reason %d",
+                 lastBoot.uptime, lastBoot.heapMin, lastBoot.heapLargest, lastBoot.reason);
+        for (uint8_t i = 0; i < lastBoot.count && i < HEALTH_RECORD_TASKS; i++)
+            ESP_LOGW(TAG, "Last boot: %s stack free %d", lastBoot.stacks[i].name, lastBoot.stacks[i].free);
+    }
+    memset(&record, 0, sizeof(record));
+    limits.minStack = limitValue("health/minStack", HEALTH_DEF_MIN_STACK);
+    limits.minHeap = limitValue("health/minHeap", HEALTH_DEF_MIN_HEAP);
+    limits.minBlock = limitValue("health/minBlock", HEALTH_DEF_MIN_BLOCK);
+    ESP_LOGI(TAG, "Limits: stack %d, heap %u, block %u", limits.minStack, limits.minHeap, limits.minBlock);
+}
+
+void healthCheck() {
+    // вызывается из serviceTask раз в HEALTH_SAMPLE_SEC
+    if (restart)
+        return;
+    samples++;
+    breachReason = HEALTH_OK;
+    for (uint8_t i = 0; i < sizeof(knownTasks) / sizeof(knownTasks[0]); i++)
+        sampleTask(knownTasks[i]);
+    heapFree = esp_get_free_heap_size();
+    heapMin = esp_get_minimum_free_heap_size();
+    heapLargest = heap_caps_get_largest_free_block(MALLOC_CAP_8BIT);
+    if (breachReason == HEALTH_OK && limits.minHeap > 0 && heapFree < limits.minHeap)
+        breachReason = HEALTH_HEAP;
+    if (breachReason == HEALTH_OK && limits.minBlock > 0 && heapLargest < limits.minBlock)
+        breachReason = HEALTH_BLOCK;
+
+    // кратковременный провал не повод перезагружаться
+    breachCount = breachReason != HEALTH_OK ? breachCount + 1 : 0;
+    if (breachCount >= HEALTH_BREACH_SAMPLES) {
+        ESP_LOGE(TAG, "Limit reached: reason %d, task %s, heap %u, largest %u. Restarting...",
+                 breachReason, breachTask, heapFree, heapLargest);
+        restart = true;
+    }
+    saveRecord();
+}
+
+bool healthRestartRequested() {
+    return restart;
+}
+
+static cJSON *stacksJson(const healthStack_t *list, uint8_t count) {
+    cJSON *jStacks = cJSON_CreateObject();
+    for (uint8_t i = 0; i < count; i++)
+        cJSON_AddNumberToObject(jStacks, list[i].name, list[i].free);
+    return jStacks;
+}
+
+void healthAddInfo(cJSON *info) {
+    cJSON *jHealth = cJSON_CreateObject();
+    cJSON_AddNumberToObject(jHealth, "samples", samples);
+    cJSON_AddItemToObject(jHealth, "stackFree", stacksJson(stacks, stacksCount));
+    cJSON_AddNumberToObject(jHealth, "heapFree", heapFree);
+    cJSON_AddNumberToObject(jHealth, "heapMin", heapMin);
+    cJSON_AddNumberToObject(jHealth, "heapLargest", heapLargest);
+    cJSON *jLimits = cJSON_CreateObject();
+    cJSON_AddNumberToObject(jLimits, "minStack", limits.minStack);
+    cJSON_AddNumberToObject(jLimits, "minHeap", limits.minHeap);
+    cJSON_AddNumberToObject(jLimits, "minBlock", limits.minBlock);
+    cJSON_AddItemToObject(jHealth, "limits", jLimits);
+    cJSON_AddNumberToObject(jHealth, "breach", breachReason);
+    if (lastBootValid) {
+        cJSON *jLast = cJSON_CreateObject();
+        cJSON_AddNumberToObject(jLast, "uptime", lastBoot.uptime);
+        cJSON_AddNumberToObject(jLast, "reason", lastBoot.reason);
+        cJSON_AddNumberToObject(jLast, "heapFree", lastBoot.heapFree);
+        cJSON_AddNumberToObject(jLast, "heapMin", lastBoot.heapMin);
+        cJSON_AddNumberToObject(jLast, "heapLargest", lastBoot.heapLargest);
+        cJSON_AddItemToObject(jLast, "stackFree", stacksJson(lastBoot.stacks, lastBoot.count));
+        cJSON_AddItemToObject(jHealth, "lastBoot", jLast);
+    }
+    cJSON_AddItemToObject(info, "health", jHealth);
+}
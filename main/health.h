@@ -0,0 +1,21 @@
+#pragma once
+#include "cJSON.h"
+
+// Контроль стеков и кучи. Пороги из конфига health/*: 0 или нет значения - порог
+// по умолчанию, отрицательное - порог выключен.
+// Запись о состоянии хранится в RTC памяти и переживает перезагрузку (не питание).
+
+#define HEALTH_SAMPLE_SEC       5       // период проверки
+#define HEALTH_BREACH_SAMPLES   3       // сколько проверок подряд до перезагрузки
+
+enum healthReasons {
+    HEALTH_OK = 0,
+    HEALTH_STACK,
+    HEALTH_HEAP,
+    HEALTH_BLOCK
+};
+
+void healthInit();
+void healthCheck();
+bool healthRestartRequested();
+void healthAddInfo(cJSON *info);
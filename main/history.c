@@ -0,0 +1,529 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_partition.h"
+#include "esp_http_server.h"
+#include "cJSON.h"
+#include "history.h"
+
+// Сектор начинается с заголовка: номер прохода по кругу, время загрузки (unix)
+// и время от загрузки последней записи перед сектором - от него считаются
+// приращения, поэтому каждый сектор читается сам по себе, даже самый старый.
+// Конец данных - 0xFF (вид 3 не используется). Стирание (десятки мс) и запись
+// останавливают кэш флеша, поэтому только из serviceTask, не из IO задач.
+// Раздел history занял последние 64К бывшего storage. Чужие данные в нем (хвост
+// старого SPIFFS) стираются, только если по текущей таблице раздел ни с кем не
+// пересекается: тогда хвост уже ничей. При пересечении история выключена и
+// раздел не трогается.
+
+#define HISTORY_SUBTYPE         0x40
+#define HISTORY_MAGIC           0x32545348      // "HST2"
+#define HISTORY_MAGIC_V1        0x31545348      // "HST1", 32-битное время, не читается
+#define HISTORY_BUFFER          512
+#define HISTORY_ROWS_DEFAULT    2000
+#define HISTORY_CHUNK           512
+#define HISTORY_RECORD_MAX      12
+#define HISTORY_VALID_EPOCH     1700000000
+
+#define HISTORY_KIND_IO         0x00
+#define HISTORY_KIND_SENSOR     0x40
+#define HISTORY_KIND_MARK       0x80
+#define HISTORY_KIND_MASK       0xC0
+#define HISTORY_IO_INPUT        0x20
+#define HISTORY_IO_ON           0x10
+#define HISTORY_IO_SLAVE        0x08
+#define HISTORY_MARK_BOOT       0x00
+#define HISTORY_MARK_TIME       0x01
+#define HISTORY_END             0xFF
+
+static const char *TAG = "HISTORY";
+
+typedef struct {
+    uint32_t magic;
+    uint32_t seq;
+    uint64_t uptimeMs;          // база для первой записи сектора
+    uint32_t bootEpoch;         // 0 - часы не выставлены
+    uint32_t reserved;
+} historySector_t;
+
+static const esp_partition_t *part = NULL;
+static uint16_t sectors = 0;
+static uint16_t current = 0;
+static uint32_t offset = 0;
+static uint32_t seq = 0;
+static uint64_t flushedMs = 0;          // время последней записанной во флеш записи
+static uint32_t bootEpoch = 0;
+static uint16_t foreignSectors = 0;     // чужие данные в разделе
+
+static uint8_t buffer[HISTORY_BUFFER];
+static uint16_t bufferLen = 0;
+static uint64_t lastMs = 0;             // время последней записи в буфере
+static portMUX_TYPE historyMux = portMUX_INITIALIZER_UNLOCKED;
+static SemaphoreHandle_t flashMutex = NULL;
+static StaticSemaphore_t flashMutexBuffer;
+
+static struct {
+    uint32_t events;
+    uint32_t bytes;
+    uint32_t dropped;           // буфер переполнен или не записаны во флеш
+    uint32_t writes;
+    uint64_t writeUs;
+    uint32_t maxWriteUs;
+    uint32_t flushedEvents;
+    uint32_t erases;
+    uint32_t maxEraseUs;
+    uint32_t errors;
+} stats;
+
+static uint8_t putVarint(uint8_t *p, uint32_t value) {
+    uint8_t len = 0;
+    do {
+        p[len] = value & 0x7F;
+        value >>= 7;
+        if (value)
+            p[len] |= 0x80;
+        len++;
+    } while (value);
+    return len;
+}
+
+static uint8_t getVarint(const uint8_t *p, uint16_t size, uint32_t *value) {
+    // 0 - запись оборвана
+    *value = 0;
+    for (uint8_t i = 0; i < 5 && i < size; i++) {
+        *value |= (uint32_t)(p[i] & 0x7F) << (7 * i);
+        if (!(p[i] & 0x80))
+            return i + 1;
+    }
+    return 0;
+}
+
+static uint8_t payloadSize(uint8_t tag) {
+    switch (tag & HISTORY_KIND_MASK) {
+        case HISTORY_KIND_IO:
+            return tag & HISTORY_IO_SLAVE ? 2 : 1;
+        case HISTORY_KIND_SENSOR:
+            return 3;
+        case HISTORY_KIND_MARK:
+            return 4;
+    }
+    return 0;
+}
+
+static uint16_t recordLength(const uint8_t *p, uint16_t size, uint32_t *dt) {
+    // 0 - конец данных или запись испорчена
+    if (size < 2 || p[0] == HISTORY_END || (p[0] & HISTORY_KIND_MASK) == 0xC0)
+        return 0;
+    uint8_t len = getVarint(&p[1], size - 1, dt);
+    if (len == 0 || 1 + len + payloadSize(p[0]) > size)
+        return 0;
+    return 1 + len + payloadSize(p[0]);
+}
+
+static void add(uint8_t tag, const uint8_t *payload) {
+    // из любой задачи, только память
+    uint64_t now = esp_timer_get_time() / 1000;
+    portENTER_CRITICAL(&historyMux);
+    if (part == NULL || bufferLen + HISTORY_RECORD_MAX > HISTORY_BUFFER) {
+        if (part != NULL)
+            stats.dropped++;
+        portEXIT_CRITICAL(&historyMux);
+        return;
+    }
+    uint8_t *p = &buffer[bufferLen];
+    p[0] = tag;
+    uint64_t dt = now - lastMs;
+    uint8_t len = 1 + putVarint(&p[1], dt > UINT32_MAX ? UINT32_MAX : dt);
+    memcpy(&p[len], payload, payloadSize(tag));
+    len += payloadSize(tag);
+    bufferLen += len;
+    lastMs = now;
+    stats.events++;
+    stats.bytes += len;
+    portEXIT_CRITICAL(&historyMux);
+}
+
+static void addMark(uint8_t mark, uint32_t epoch) {
+    uint8_t payload[4] = {epoch & 0xFF, (epoch >> 8) & 0xFF, (epoch >> 16) & 0xFF, epoch >> 24};
+    add(HISTORY_KIND_MARK | mark, payload);
+}
+
+void historyAddIO(bool input, uint8_t slaveId, uint8_t id, bool on) {
+    uint8_t tag = HISTORY_KIND_IO | (input ? HISTORY_IO_INPUT : 0) | (on ? HISTORY_IO_ON : 0);
+    uint8_t payload[2] = {id, slaveId};
+    if (slaveId > 0) {
+        tag |= HISTORY_IO_SLAVE;
+        payload[0] = slaveId;
+        payload[1] = id;
+    }
+    add(tag, payload);
+}
+
+void historyAddSensor(uint8_t id, int16_t raw) {
+    uint8_t payload[3] = {id, raw & 0xFF, (uint16_t)raw >> 8};
+    add(HISTORY_KIND_SENSOR, payload);
+}
+
+static uint32_t sectorAddress(uint16_t sector) {
+    return sector * SPI_FLASH_SEC_SIZE;
+}
+
+static esp_err_t openSector(uint16_t sector) {
+    // под flashMutex
+    int64_t start = esp_timer_get_time();
+    esp_err_t err = esp_partition_erase_range(part, sectorAddress(sector), SPI_FLASH_SEC_SIZE);
+    uint32_t us = esp_timer_get_time() - start;
+    stats.erases++;
+    if (us > stats.maxEraseUs)
+        stats.maxEraseUs = us;
+    historySector_t header = {
+        .magic = HISTORY_MAGIC,
+        .seq = ++seq,
+        .uptimeMs = flushedMs,
+        .bootEpoch = bootEpoch
+    };
+    if (err == ESP_OK)
+        err = esp_partition_write(part, sectorAddress(sector), &header, sizeof(header));
+    if (err != ESP_OK) {
+        stats.errors++;
+        ESP_LOGE(TAG, "Can't open sector %d: %s", sector, esp_err_to_name(err));
+        return err;
+    }
+    current = sector;
+    offset = sizeof(header);
+    return ESP_OK;
+}
+
+static esp_err_t writeRun(const uint8_t *data, uint16_t len, uint16_t events) {
+    int64_t start = esp_timer_get_time();
+    esp_err_t err = esp_partition_write(part, sectorAddress(current) + offset, data, len);
+    uint32_t us = esp_timer_get_time() - start;
+    stats.writes++;
+    stats.writeUs += us;
+    stats.flushedEvents += events;
+    if (us > stats.maxWriteUs)
+        stats.maxWriteUs = us;
+    if (err != ESP_OK) {
+        stats.errors++;
+        // недописанный хвост не стирается на месте, дальше - со следующего сектора
+        offset = SPI_FLASH_SEC_SIZE;
+        return err;
+    }
+    offset += len;
+    return ESP_OK;
+}
+
+void historyFlush() {
+    // serviceTask, раз в секунду
+    if (part == NULL)
+        return;
+    if (bootEpoch == 0 && time(NULL) > HISTORY_VALID_EPOCH) {
+        // часы выставлены - привязка времени загрузки
+        bootEpoch = time(NULL) - esp_timer_get_time() / 1000000;
+        addMark(HISTORY_MARK_TIME, bootEpoch);
+    }
+    // вызывается и из запроса истории, pending под flashMutex
+    static uint8_t pending[HISTORY_BUFFER];
+    uint16_t len;
+    xSemaphoreTake(flashMutex, portMAX_DELAY);
+    portENTER_CRITICAL(&historyMux);
+    len = bufferLen;
+    memcpy(pending, buffer, len);
+    bufferLen = 0;
+    portEXIT_CRITICAL(&historyMux);
+    // подряд идущие записи, помещающиеся в сектор - одной записью во флеш
+    uint16_t pos = 0;
+    while (pos < len) {
+        uint16_t run = 0;
+        uint16_t events = 0;
+        uint64_t ms = flushedMs;
+        while (pos + run < len) {
+            uint32_t dt;
+            uint16_t rl = recordLength(&pending[pos + run], len - pos - run, &dt);
+            if (rl == 0 || offset + run + rl > SPI_FLASH_SEC_SIZE)
+                break;
+            run += rl;
+            ms += dt;
+            events++;
+        }
+        if (run == 0) {
+            uint32_t dt;
+            if (recordLength(&pending[pos], len - pos, &dt) == 0 ||
+                openSector((current + 1) % sectors) != ESP_OK)
+                break;
+            continue;
+        }
+        if (writeRun(&pending[pos], run, events) != ESP_OK)
+            break;
+        flushedMs = ms;
+        pos += run;
+    }
+    // после ошибки остаток потерян, но его время учитывается: приращения
+    // следующих записей считаются от lastMs, который его уже включает
+    uint32_t dt;
+    uint16_t rl;
+    while (pos < len && (rl = recordLength(&pending[pos], len - pos, &dt)) > 0) {
+        flushedMs += dt;
+        pos += rl;
+        stats.dropped++;
+    }
+    xSemaphoreGive(flashMutex);
+}
+
+static uint16_t dataEnd(const uint8_t *data, uint16_t size) {
+    uint16_t pos = sizeof(historySector_t);
+    uint32_t dt;
+    uint16_t rl;
+    while ((rl = recordLength(&data[pos], size - pos, &dt)) > 0)
+        pos += rl;
+    return pos;
+}
+
+static bool sectorBlank(uint16_t sector, uint8_t *data) {
+    if (esp_partition_read(part, sectorAddress(sector), data, SPI_FLASH_SEC_SIZE) != ESP_OK)
+        return false;
+    for (uint16_t i = 0; i < SPI_FLASH_SEC_SIZE; i++) {
+        if (data[i] != 0xFF)
+            return false;
+    }
+    return true;
+}
+
+static bool overlapsPartition() {
+    // пересечение с любым другим разделом текущей таблицы
+    bool overlap = false;
+    esp_partition_iterator_t it = esp_partition_find(ESP_PARTITION_TYPE_ANY, ESP_PARTITION_SUBTYPE_ANY, NULL);
+    while (it != NULL && !overlap) {
+        const esp_partition_t *p = esp_partition_get(it);
+        if (p->address != part->address &&
+            p->address < part->address + part->size && part->address < p->address + p->size) {
+            ESP_LOGE(TAG, "History overlaps partition %s", p->label);
+            overlap = true;
+        }
+        it = esp_partition_next(it);
+    }
+    esp_partition_iterator_release(it);
+    return overlap;
+}
+
+void historyInit() {
+    part = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, HISTORY_SUBTYPE, "history");
+    if (part == NULL) {
+        ESP_LOGW(TAG, "No history partition");
+        return;
+    }
+    uint8_t *data = malloc(SPI_FLASH_SEC_SIZE);
+    if (data == NULL) {
+        part = NULL;
+        return;
+    }
+    flashMutex = xSemaphoreCreateMutexStatic(&flashMutexBuffer);
+    sectors = part->size / SPI_FLASH_SEC_SIZE;
+    // самый свежий сектор - с наибольшим номером прохода
+    historySector_t header;
+    bool found = false;
+    foreignSectors = 0;
+    for (uint16_t i = 0; i < sectors; i++) {
+        if (esp_partition_read(part, sectorAddress(i), &header, sizeof(header)) != ESP_OK)
+            continue;
+        if (header.magic == HISTORY_MAGIC) {
+            if (!found || header.seq > seq) {
+                seq = header.seq;
+                current = i;
+                found = true;
+            }
+        } else if (header.magic != HISTORY_MAGIC_V1 && !sectorBlank(i, data)) {
+            foreignSectors++;
+        }
+    }
+    if (foreignSectors > 0) {
+        if (overlapsPartition()) {
+            ESP_LOGE(TAG, "%d sectors hold foreign data, history disabled", foreignSectors);
+            free(data);
+            part = NULL;
+            return;
+        }
+        ESP_LOGW(TAG, "%d sectors hold foreign data (old storage tail), taking them", foreignSectors);
+    }
+    if (found) {
+        if (esp_partition_read(part, sectorAddress(current), data, SPI_FLASH_SEC_SIZE) == ESP_OK) {
+            offset = dataEnd(data, SPI_FLASH_SEC_SIZE);
+        } else {
+            offset = SPI_FLASH_SEC_SIZE;    // начать со следующего
+        }
+    } else if (openSector(0) != ESP_OK) {
+        free(data);
+        part = NULL;
+        return;
+    }
+    free(data);
+    // время от загрузки начинается заново, у отметки загрузки приращение - от нуля
+    addMark(HISTORY_MARK_BOOT, 0);
+    ESP_LOGI(TAG, "%d sectors, current %d, offset %u, seq %u", sectors, current, offset, seq);
+}
+
+typedef struct {
+    httpd_req_t *req;
+    char chunk[HISTORY_CHUNK];
+    uint16_t len;
+    uint32_t rows;
+    uint32_t limit;
+    uint32_t from;
+    uint32_t to;
+    bool first;
+} historyQuery_t;
+
+static void queryFlush(historyQuery_t *q) {
+    if (q->len > 0)
+        httpd_resp_send_chunk(q->req, q->chunk, q->len);
+    q->len = 0;
+}
+
+static void queryRow(historyQuery_t *q, const char *row) {
+    if (q->rows >= q->limit)
+        return;
+    uint16_t len = strlen(row) + 1;
+    if (q->len + len > HISTORY_CHUNK)
+        queryFlush(q);
+    if (!q->first)
+        q->chunk[q->len++] = ',';
+    q->first = false;
+    memcpy(&q->chunk[q->len], row, len - 1);
+    q->len += len - 1;
+    q->rows++;
+}
+
+static void querySector(historyQuery_t *q, const uint8_t *data) {
+    const historySector_t *header = (const historySector_t*)data;
+    uint32_t epoch = header->bootEpoch;
+    uint64_t ms = header->uptimeMs;
+    uint16_t pos = sizeof(historySector_t);
+    uint32_t dt;
+    uint16_t rl;
+    char row[48];
+    while ((rl = recordLength(&data[pos], SPI_FLASH_SEC_SIZE - pos, &dt)) > 0 && q->rows < q->limit) {
+        const uint8_t *p = &data[pos];
+        const uint8_t *payload = &p[rl - payloadSize(p[0])];
+        pos += rl;
+        ms += dt;
+        uint8_t kind = p[0] & HISTORY_KIND_MASK;
+        if (kind == HISTORY_KIND_MARK) {
+            epoch = payload[0] | (payload[1] << 8) | (payload[2] << 16) | ((uint32_t)payload[3] << 24);
+            if ((p[0] & 0x0F) == HISTORY_MARK_BOOT)
+                ms = dt;
+            snprintf(row, sizeof(row), "[\"%s\",%u]", (p[0] & 0x0F) == HISTORY_MARK_BOOT ? "b" : "t", epoch);
+            queryRow(q, row);
+            continue;
+        }
+        // с диапазоном - только записи с известным временем
+        double t = epoch ? (double)epoch * 1000 + ms : ms;
+        if ((q->from || q->to) &&
+            (!epoch || (q->from && t < (double)q->from * 1000) || (q->to && t > (double)q->to * 1000)))
+            continue;
+        if (kind == HISTORY_KIND_IO) {
+            bool slave = p[0] & HISTORY_IO_SLAVE;
+            if (slave)
+                snprintf(row, sizeof(row), "[%.0f,\"%s\",%d,%d,%d]", t, p[0] & HISTORY_IO_INPUT ? "i" : "o",
+                         payload[1], (p[0] & HISTORY_IO_ON) != 0, payload[0]);
+            else
+                snprintf(row, sizeof(row), "[%.0f,\"%s\",%d,%d]", t, p[0] & HISTORY_IO_INPUT ? "i" : "o",
+                         payload[0], (p[0] & HISTORY_IO_ON) != 0);
+        } else {
+            int16_t raw = payload[1] | (payload[2] << 8);
+            snprintf(row, sizeof(row), "[%.0f,\"s\",%d,%.2f]", t, payload[0], raw / 16.0);
+        }
+        queryRow(q, row);
+    }
+}
+
+static uint32_t queryParam(const char *query, const char *key) {
+    char value[16];
+    if (httpd_query_key_value(query, key, value, sizeof(value)) != ESP_OK)
+        return 0;
+    return strtoul(value, NULL, 10);
+}
+
+esp_err_t historyStream(httpd_req_t *req) {
+    // по сектору за раз: читаем под flashMutex, разбираем и отдаем без него
+    if (part == NULL)
+        return ESP_ERR_NOT_FOUND;
+    historyFlush();
+    historyQuery_t *q = calloc(1, sizeof(historyQuery_t));
+    uint8_t *data = malloc(SPI_FLASH_SEC_SIZE);
+    if (q == NULL || data == NULL) {
+        free(q);
+        free(data);
+        return ESP_ERR_NO_MEM;
+    }
+    char query[64] = {0};
+    httpd_req_get_url_query_str(req, query, sizeof(query));
+    q->req = req;
+    q->first = true;
+    q->from = queryParam(query, "from");
+    q->to = queryParam(query, "to");
+    q->limit = queryParam(query, "limit");
+    if (q->limit == 0)
+        q->limit = HISTORY_ROWS_DEFAULT;
+    httpd_resp_set_status(req, "200");
+    httpd_resp_send_chunk(req, "{\"events\":[", -1);
+    // от самого старого: сектор после текущего
+    xSemaphoreTake(flashMutex, portMAX_DELAY);
+    uint32_t lastSeq = seq;
+    uint16_t start = (current + 1) % sectors;
+    xSemaphoreGive(flashMutex);
+    for (uint16_t i = 0; i < sectors && q->rows < q->limit; i++) {
+        uint16_t sector = (start + i) % sectors;
+        xSemaphoreTake(flashMutex, portMAX_DELAY);
+        esp_err_t err = esp_partition_read(part, sectorAddress(sector), data, SPI_FLASH_SEC_SIZE);
+        xSemaphoreGive(flashMutex);
+        const historySector_t *header = (const historySector_t*)data;
+        // сектор, перезаписанный во время запроса, уже новее lastSeq
+        if (err != ESP_OK || header->magic != HISTORY_MAGIC || header->seq > lastSeq)
+            continue;
+        querySector(q, data);
+    }
+    queryFlush(q);
+    char tail[32];
+    snprintf(tail, sizeof(tail), "],\"rows\":%u}", q->rows);
+    httpd_resp_send_chunk(req, tail, -1);
+    httpd_resp_send_chunk(req, NULL, 0);
+    free(q);
+    free(data);
+    return ESP_OK;
+}
+
+void historyAddInfo(cJSON *info) {
+    if (part == NULL) {
+        if (foreignSectors > 0) {
+            cJSON *jHistory = cJSON_CreateObject();
+            cJSON_AddNumberToObject(jHistory, "foreignSectors", foreignSectors);
+            cJSON_AddItemToObject(info, "history", jHistory);
+        }
+        return;
+    }
+    cJSON *jHistory = cJSON_CreateObject();
+    cJSON_AddNumberToObject(jHistory, "sectors", sectors);
+    cJSON_AddNumberToObject(jHistory, "current", current);
+    cJSON_AddNumberToObject(jHistory, "offset", offset);
+    cJSON_AddNumberToObject(jHistory, "seq", seq);
+    cJSON_AddNumberToObject(jHistory, "events", stats.events);
+    cJSON_AddNumberToObject(jHistory, "bytes", stats.bytes);
+    cJSON_AddNumberToObject(jHistory, "dropped", stats.dropped);
+    cJSON_AddNumberToObject(jHistory, "writes", stats.writes);
+    cJSON_AddNumberToObject(jHistory, "maxWriteUs", stats.maxWriteUs);
+    // цена события: время записи во флеш на одно событие и байт на событие
+    if (stats.flushedEvents > 0)
+        cJSON_AddNumberToObject(jHistory, "usPerEvent", (uint32_t)(stats.writeUs / stats.flushedEvents));
+    if (stats.events > 0)
+        cJSON_AddNumberToObject(jHistory, "bytesPerEvent", (double)stats.bytes / stats.events);
+    cJSON_AddNumberToObject(jHistory, "erases", stats.erases);
+    cJSON_AddNumberToObject(jHistory, "maxEraseUs", stats.maxEraseUs);
+    cJSON_AddNumberToObject(jHistory, "errors", stats.errors);
+    cJSON_AddItemToObject(info, "history", jHistory);
+}
@@ -0,0 +1,22 @@
+#pragma once
+#include "esp_http_server.h"
+#include "cJSON.h"
+
+// История входов, выходов и датчиков в разделе history (partitions.csv).
+// Запись переменной длины: тег, время от предыдущей записи в мс (varint), данные.
+// Тег: биты 7-6 вид (0 - вход/выход, 1 - датчик, 2 - отметка), для входа/выхода
+// бит 5 - вход, бит 4 - on, бит 3 - есть slaveId. Смена состояния - 2-4 байта.
+// События копятся в памяти и пишутся во флеш из serviceTask раз в секунду.
+// Сектора идут по кругу, каждый стирается один раз за проход - износ равномерный.
+//
+// GET /ui/history?from=<unix>&to=<unix>&limit=<n> отдает частями:
+// {"events":[["b",epoch],[ms,"o",id,1],[ms,"i",id,0],[ms,"s",id,21.5],...]}
+// "b" - загрузка, epoch 0 если часы еще не были выставлены: тогда ms до
+// следующей отметки - от загрузки, иначе unix время в мс.
+
+void historyInit();
+void historyAddIO(bool input, uint8_t slaveId, uint8_t id, bool on);
+void historyAddSensor(uint8_t id, int16_t raw);
+void historyFlush();
+esp_err_t historyStream(httpd_req_t *req);
+void historyAddInfo(cJSON *info);
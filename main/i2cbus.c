@@ -0,0 +1,525 @@
+#include <stdio.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "driver/gpio.h"
+#include "driver/i2c.h"
+#include "rom/ets_sys.h"
+#include "pca9685.h"
+#include "pcf8574.h"
+#include "pcf8563.h"
+#include "cJSON.h"
+#include "config.h"
+#include "tasks.h"
+#include "i2cbus.h"
+
+// Запись PWM не ставится в очередь: значения сразу ложатся в теневую копию
+// устройства (каналы с новым значением помечаются dirty), в очередь уходит
+// только пробуждение. Если очередь полна, задача и так не спит и заберет копию
+// после очереди, поэтому запись не теряется. Пачка передается номером слота.
+// Слоты статические: если ждущий ушел по таймауту, слот помечается брошенным
+// и освобождается задачей шины, результат никуда не пишется.
+// Таймаут отдельной транзакции - CONFIG_I2CDEV_TIMEOUT (timeout_ticks устройств 0),
+// постановка в очередь и ожидание пачки укладываются в один таймаут i2cBusSubmit.
+// Устройство после I2C_OFFLINE_ERRORS ошибок подряд отключается: его транзакции
+// сразу завершаются ошибкой, не занимая шину, чтение порта возвращает последнее
+// хорошее значение. Отключенные раз в I2C_PROBE_MS проверяются и после ответа
+// инициализируются заново. Если после ошибки SDA прижата - восстановление шины.
+
+#define I2C_QUEUE_SIZE      16
+#define I2C_SLOTS           4
+#define I2C_PWM_DEVICES     4
+#define I2C_DEVICES         12
+#define I2C_NO_SLOT         -1
+
+static const char *TAG = "I2CBUS";
+
+typedef struct {
+    int8_t slot;                // I2C_NO_SLOT - есть новые значения PWM
+} i2cJob_t;
+
+enum i2cSlotStates {
+    I2C_SLOT_FREE = 0,
+    I2C_SLOT_QUEUED,
+    I2C_SLOT_DONE,
+    I2C_SLOT_ABANDONED
+};
+
+typedef struct {
+    i2cTrans_t trans[I2C_BATCH_SIZE];
+    uint8_t count;
+    uint8_t state;              // i2cSlotStates
+    SemaphoreHandle_t done;
+    StaticSemaphore_t doneBuffer;
+} i2cSlot_t;
+
+typedef struct {
+    i2c_dev_t *dev;
+    uint16_t values[I2C_PWM_CHANNELS];
+    uint16_t dirty;
+    uint16_t known;             // каналы, в которые что-то писали
+} i2cPwm_t;
+
+typedef struct {
+    i2c_dev_t *dev;
+    i2cReinit_t reinit;
+    uint8_t errorsInRow;
+    bool offline;
+    uint8_t port;               // последнее прочитанное без ошибки
+    uint32_t errors;
+    uint32_t offlineCount;
+    uint32_t reinits;
+} i2cDevice_t;
+
+static StaticQueue_t queueBuffer;
+static uint8_t queueStorage[I2C_QUEUE_SIZE * sizeof(i2cJob_t)];
+static QueueHandle_t queue = NULL;
+static TaskHandle_t busTask = NULL;
+static i2cSlot_t slots[I2C_SLOTS];
+static i2cPwm_t pwm[I2C_PWM_DEVICES];
+static i2cDevice_t devices[I2C_DEVICES];
+static uint8_t devicesCount = 0;
+static int64_t lastProbe = 0;
+static portMUX_TYPE busMux = portMUX_INITIALIZER_UNLOCKED;
+
+// имитация плохой шины для проверки на стенде:
+// hw/i2cFault {"latencyMs", "nakEvery", "failAddr"} - failAddr не отвечает никогда
+static struct {
+    uint16_t latencyMs;
+    uint16_t nakEvery;
+    uint8_t failAddr;
+    uint32_t count;
+} fault;
+
+static struct {
+    uint32_t posted;            // асинхронных записей
+    uint32_t unchanged;         // каналов с прежним значением, не записаны
+    uint32_t writes;            // транзакций записи после склейки
+    uint32_t reads;
+    uint32_t errors;
+    uint32_t timeouts;          // ждущий не дождался
+    uint32_t dropped;           // очередь полна
+    uint32_t faults;            // подставленные NAK
+    uint32_t maxQueue;
+    uint32_t maxBatchUs;
+    uint32_t skipped;           // транзакции к отключенным устройствам
+    uint32_t staleReads;        // вместо ошибки отдано последнее значение
+    uint32_t stuckSda;
+    uint32_t recoveries;        // SDA освобождена
+} stats;
+
+static esp_err_t faultCheck(i2c_dev_t *dev) {
+    if (fault.latencyMs)
+        vTaskDelay(fault.latencyMs / portTICK_RATE_MS);
+    if ((fault.failAddr && dev->addr == fault.failAddr) ||
+        (fault.nakEvery && ++fault.count % fault.nakEvery == 0)) {
+        stats.faults++;
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+static i2cDevice_t *deviceOf(i2c_dev_t *dev) {
+    for (uint8_t i = 0; i < devicesCount; i++) {
+        if (devices[i].dev == dev)
+            return &devices[i];
+    }
+    return NULL;
+}
+
+static void busRecover(i2c_dev_t *dev) {
+    // ведомый, сбитый посреди байта, держит SDA: до 9 тактов SCL и STOP
+    int sda = dev->cfg.sda_io_num;
+    int scl = dev->cfg.scl_io_num;
+    if (gpio_get_level(sda))
+        return;
+    stats.stuckSda++;
+    gpio_set_level(sda, 1);
+    gpio_set_level(scl, 1);
+    gpio_set_direction(sda, GPIO_MODE_INPUT_OUTPUT_OD);
+    gpio_set_direction(scl, GPIO_MODE_INPUT_OUTPUT_OD);
+    for (uint8_t i = 0; i < 9 && !gpio_get_level(sda); i++) {
+        gpio_set_level(scl, 0);
+        ets_delay_us(5);
+        gpio_set_level(scl, 1);
+        ets_delay_us(5);
+    }
+    gpio_set_level(scl, 0);
+    ets_delay_us(5);
+    gpio_set_level(sda, 0);
+    ets_delay_us(5);
+    gpio_set_level(scl, 1);
+    ets_delay_us(5);
+    gpio_set_level(sda, 1);
+    ets_delay_us(5);
+    bool freed = gpio_get_level(sda);
+    // вернуть пины контроллеру I2C
+    i2c_set_pin(dev->port, sda, scl, GPIO_PULLUP_ENABLE, GPIO_PULLUP_ENABLE, I2C_MODE_MASTER);
+    if (freed)
+        stats.recoveries++;
+    ESP_LOGW(TAG, "SDA stuck low, bus recovery %s", freed ? "done" : "failed");
+}
+
+static void deviceResult(i2cDevice_t *d, esp_err_t err) {
+    if (err == ESP_OK) {
+        d->errorsInRow = 0;
+        return;
+    }
+    d->errors++;
+    if (++d->errorsInRow >= I2C_OFFLINE_ERRORS && !d->offline) {
+        d->offline = true;
+        d->offlineCount++;
+        ESP_LOGE(TAG, "Device 0x%x offline: %s", d->dev->addr, esp_err_to_name(err));
+    }
+}
+
+static void restorePwm(i2c_dev_t *dev) {
+    // после повторной инициализации PCA9685 выходы сброшены, пишем заново
+    portENTER_CRITICAL(&busMux);
+    for (uint8_t i = 0; i < I2C_PWM_DEVICES; i++) {
+        if (pwm[i].dev == dev)
+            pwm[i].dirty |= pwm[i].known;
+    }
+    portEXIT_CRITICAL(&busMux);
+}
+
+static void probeOffline() {
+    lastProbe = esp_timer_get_time();
+    for (uint8_t i = 0; i < devicesCount; i++) {
+        i2cDevice_t *d = &devices[i];
+        if (!d->offline)
+            continue;
+        esp_err_t err = faultCheck(d->dev);
+        if (err == ESP_OK)
+            err = i2c_dev_probe(d->dev, I2C_DEV_WRITE);
+        if (err == ESP_OK && d->reinit != NULL)
+            err = d->reinit(d->dev);
+        if (err != ESP_OK) {
+            busRecover(d->dev);
+            continue;
+        }
+        d->offline = false;
+        d->errorsInRow = 0;
+        d->reinits++;
+        restorePwm(d->dev);
+        ESP_LOGI(TAG, "Device 0x%x back online", d->dev->addr);
+    }
+}
+
+static esp_err_t execute(i2cTrans_t *t) {
+    i2cDevice_t *d = deviceOf(t->dev);
+    esp_err_t err = ESP_OK;
+    if (d != NULL && d->offline) {
+        // не занимаем шину, другие устройства работают
+        stats.skipped++;
+        err = ESP_ERR_INVALID_STATE;
+    } else {
+        err = faultCheck(t->dev);
+    }
+    if (err == ESP_OK) {
+        switch (t->op) {
+            case I2C_OP_PWM_WRITE:
+                err = pca9685_set_pwm_values(t->dev, t->first, t->count, t->values);
+                stats.writes++;
+                break;
+            case I2C_OP_PORT_READ:
+                err = pcf8574_port_read(t->dev, &t->port);
+                stats.reads++;
+                break;
+            case I2C_OP_CLOCK_GET:
+                err = pcf8563_get_time(t->dev, &t->time, &t->valid);
+                break;
+            case I2C_OP_CLOCK_SET:
+                err = pcf8563_set_time(t->dev, &t->time);
+                break;
+            case I2C_OP_OW:
+                err = ds2484Execute(t->dev, &t->ow);
+                break;
+            default:
+                err = ESP_ERR_INVALID_ARG;
+        }
+    }
+    if (d != NULL && t->op == I2C_OP_PORT_READ) {
+        // без ошибок чтения не будет ложных событий входов
+        if (err == ESP_OK) {
+            d->port = t->port;
+        } else {
+            t->port = d->port;
+            stats.staleReads++;
+        }
+    }
+    if (err != ESP_OK && err != ESP_ERR_INVALID_STATE) {
+        stats.errors++;
+        if (d != NULL)
+            deviceResult(d, err);
+        busRecover(t->dev);
+    } else if (err == ESP_OK && d != NULL) {
+        deviceResult(d, err);
+    }
+    t->result = err;
+    return err;
+}
+
+static i2cPwm_t *pwmOf(i2c_dev_t *dev) {
+    // под busMux
+    for (uint8_t i = 0; i < I2C_PWM_DEVICES; i++) {
+        if (pwm[i].dev == dev)
+            return &pwm[i];
+    }
+    for (uint8_t i = 0; i < I2C_PWM_DEVICES; i++) {
+        if (pwm[i].dev == NULL) {
+            pwm[i].dev = dev;
+            return &pwm[i];
+        }
+    }
+    return NULL;
+}
+
+static void flush() {
+    // непрерывные диапазоны измененных каналов - по одной транзакции
+    i2cTrans_t t = {.op = I2C_OP_PWM_WRITE};
+    uint16_t values[I2C_PWM_CHANNELS];
+    for (uint8_t d = 0; d < I2C_PWM_DEVICES; d++) {
+        portENTER_CRITICAL(&busMux);
+        uint16_t dirty = pwm[d].dirty;
+        pwm[d].dirty = 0;
+        memcpy(values, pwm[d].values, sizeof(values));
+        portEXIT_CRITICAL(&busMux);
+        while (dirty) {
+            uint8_t first = __builtin_ctz(dirty);
+            uint8_t count = 0;
+            while (first + count < I2C_PWM_CHANNELS && (dirty >> (first + count) & 1))
+                count++;
+            t.dev = pwm[d].dev;
+            t.first = first;
+            t.count = count;
+            memcpy(t.values, &values[first], count * sizeof(uint16_t));
+            execute(&t);
+            dirty &= ~(((1 << count) - 1) << first);
+        }
+    }
+}
+
+static void runSlot(int8_t n) {
+    i2cSlot_t *slot = &slots[n];
+    int64_t start = esp_timer_get_time();
+    for (uint8_t i = 0; i < slot->count; i++) {
+        if (slot->state == I2C_SLOT_ABANDONED)
+            break;
+        execute(&slot->trans[i]);
+    }
+    uint32_t us = esp_timer_get_time() - start;
+    if (us > stats.maxBatchUs)
+        stats.maxBatchUs = us;
+    bool give = false;
+    portENTER_CRITICAL(&busMux);
+    if (slot->state == I2C_SLOT_ABANDONED) {
+        slot->state = I2C_SLOT_FREE;
+    } else {
+        slot->state = I2C_SLOT_DONE;
+        give = true;
+    }
+    portEXIT_CRITICAL(&busMux);
+    if (give)
+        xSemaphoreGive(slot->done);
+}
+
+static bool anyOffline() {
+    for (uint8_t i = 0; i < devicesCount; i++) {
+        if (devices[i].offline)
+            return true;
+    }
+    return false;
+}
+
+static void i2cBusTask(void *pvParameter) {
+    i2cJob_t job;
+    // записи, накопленные до старта
+    flush();
+    while (1) {
+        bool offline = anyOffline();
+        if (offline && esp_timer_get_time() - lastProbe >= I2C_PROBE_MS * 1000LL) {
+            probeOffline();
+            flush();
+        }
+        if (xQueueReceive(queue, &job, offline ? I2C_PROBE_MS / portTICK_RATE_MS : portMAX_DELAY) != pdTRUE)
+            continue;
+        uint32_t waiting = uxQueueMessagesWaiting(queue) + 1;
+        if (waiting > stats.maxQueue)
+            stats.maxQueue = waiting;
+        // забираем все, что накопилось; перед чтением записи уходят на шину
+        do {
+            if (job.slot != I2C_NO_SLOT) {
+                flush();
+                runSlot(job.slot);
+            }
+        } while (xQueueReceive(queue, &job, 0) == pdTRUE);
+        flush();
+    }
+}
+
+void i2cBusInit() {
+    queue = xQueueCreateStatic(I2C_QUEUE_SIZE, sizeof(i2cJob_t), queueStorage, &queueBuffer);
+    for (uint8_t i = 0; i < I2C_SLOTS; i++)
+        slots[i].done = xSemaphoreCreateBinaryStatic(&slots[i].doneBuffer);
+    cJSON *jFault = getConfigValueObject("hw/i2cFault");
+    if (cJSON_IsObject(jFault)) {
+        if (cJSON_IsNumber(cJSON_GetObjectItem(jFault, "latencyMs")))
+            fault.latencyMs = cJSON_GetObjectItem(jFault, "latencyMs")->valueint;
+        if (cJSON_IsNumber(cJSON_GetObjectItem(jFault, "nakEvery")))
+            fault.nakEvery = cJSON_GetObjectItem(jFault, "nakEvery")->valueint;
+        if (cJSON_IsNumber(cJSON_GetObjectItem(jFault, "failAddr")))
+            fault.failAddr = cJSON_GetObjectItem(jFault, "failAddr")->valueint;
+        ESP_LOGW(TAG, "Fault injection: latency %d ms, NAK every %d, fail 0x%x",
+                 fault.latencyMs, fault.nakEvery, fault.failAddr);
+    }
+}
+
+void i2cBusAddDevice(i2c_dev_t *dev, i2cReinit_t reinit) {
+    // до старта задачи шины
+    if (devicesCount >= I2C_DEVICES || deviceOf(dev) != NULL)
+        return;
+    devices[devicesCount].dev = dev;
+    devices[devicesCount].reinit = reinit;
+    devices[devicesCount].port = 0xFF;
+    devicesCount++;
+}
+
+bool i2cBusOnline(i2c_dev_t *dev) {
+    i2cDevice_t *d = deviceOf(dev);
+    return d == NULL || !d->offline;
+}
+
+void i2cBusStart() {
+    // до старта записи копятся в теневой копии, пачки выполняются в вызывающей задаче
+    busTask = taskStart(TASK_I2C, &i2cBusTask, NULL);
+}
+
+esp_err_t i2cBusWritePwm(i2c_dev_t *dev, uint8_t first, uint8_t count, const uint16_t *values) {
+    // последняя запись в канал перекрывает предыдущие, прежнее значение не пишется
+    if (queue == NULL || count == 0 || first + count > I2C_PWM_CHANNELS)
+        return ESP_ERR_INVALID_ARG;
+    uint16_t changed = 0;
+    portENTER_CRITICAL(&busMux);
+    i2cPwm_t *p = pwmOf(dev);
+    if (p != NULL) {
+        for (uint8_t i = 0; i < count; i++) {
+            uint8_t ch = first + i;
+            if (p->values[ch] != values[i] || !(p->known >> ch & 1)) {
+                p->values[ch] = values[i];
+                changed |= 1 << ch;
+            }
+        }
+        p->dirty |= changed;
+        p->known |= changed;
+    }
+    portEXIT_CRITICAL(&busMux);
+    if (p == NULL)
+        return ESP_ERR_NO_MEM;
+    stats.posted++;
+    stats.unchanged += count - __builtin_popcount(changed);
+    if (changed) {
+        // полная очередь - задача не спит и заберет копию, пробуждение не нужно
+        i2cJob_t job = {.slot = I2C_NO_SLOT};
+        xQueueSend(queue, &job, 0);
+    }
+    return ESP_OK;
+}
+
+esp_err_t i2cBusSubmit(i2cTrans_t *trans, uint8_t count, uint32_t timeoutMs) {
+    // результат - первая ошибка в пачке, результаты по отдельности в trans[].result
+    if (queue == NULL || count == 0 || count > I2C_BATCH_SIZE)
+        return ESP_ERR_INVALID_ARG;
+    if (busTask == NULL) {
+        esp_err_t err = ESP_OK;
+        for (uint8_t i = 0; i < count; i++) {
+            if (execute(&trans[i]) != ESP_OK && err == ESP_OK)
+                err = trans[i].result;
+        }
+        return err;
+    }
+    int8_t n = I2C_NO_SLOT;
+    portENTER_CRITICAL(&busMux);
+    for (uint8_t i = 0; i < I2C_SLOTS; i++) {
+        if (slots[i].state == I2C_SLOT_FREE) {
+            slots[i].state = I2C_SLOT_QUEUED;
+            n = i;
+            break;
+        }
+    }
+    portEXIT_CRITICAL(&busMux);
+    if (n == I2C_NO_SLOT)
+        return ESP_ERR_NO_MEM;
+    i2cSlot_t *slot = &slots[n];
+    memcpy(slot->trans, trans, count * sizeof(i2cTrans_t));
+    slot->count = count;
+    xSemaphoreTake(slot->done, 0);
+    i2cJob_t job = {.slot = n};
+    TickType_t ticks = (timeoutMs ? timeoutMs : I2C_WAIT_MS) / portTICK_RATE_MS;
+    TickType_t start = xTaskGetTickCount();
+    if (xQueueSend(queue, &job, ticks) != pdTRUE) {
+        slot->state = I2C_SLOT_FREE;
+        stats.dropped++;
+        return ESP_ERR_TIMEOUT;
+    }
+    TickType_t spent = xTaskGetTickCount() - start;
+    if (xSemaphoreTake(slot->done, spent < ticks ? ticks - spent : 0) != pdTRUE) {
+        bool done = false;
+        portENTER_CRITICAL(&busMux);
+        if (slot->state == I2C_SLOT_DONE)
+            done = true;
+        else
+            slot->state = I2C_SLOT_ABANDONED;
+        portEXIT_CRITICAL(&busMux);
+        if (!done) {
+            stats.timeouts++;
+            for (uint8_t i = 0; i < count; i++)
+                trans[i].result = ESP_ERR_TIMEOUT;
+            return ESP_ERR_TIMEOUT;
+        }
+        // завершилась между таймаутом и проверкой
+        xSemaphoreTake(slot->done, 0);
+    }
+    memcpy(trans, slot->trans, count * sizeof(i2cTrans_t));
+    slot->state = I2C_SLOT_FREE;
+    esp_err_t err = ESP_OK;
+    for (uint8_t i = 0; i < count && err == ESP_OK; i++)
+        err = trans[i].result;
+    return err;
+}
+
+void i2cBusAddInfo(cJSON *info) {
+    cJSON *jBus = cJSON_CreateObject();
+    cJSON_AddNumberToObject(jBus, "posted", stats.posted);
+    cJSON_AddNumberToObject(jBus, "unchanged", stats.unchanged);
+    cJSON_AddNumberToObject(jBus, "writes", stats.writes);
+    cJSON_AddNumberToObject(jBus, "reads", stats.reads);
+    cJSON_AddNumberToObject(jBus, "errors", stats.errors);
+    cJSON_AddNumberToObject(jBus, "timeouts", stats.timeouts);
+    cJSON_AddNumberToObject(jBus, "dropped", stats.dropped);
+    cJSON_AddNumberToObject(jBus, "maxQueue", stats.maxQueue);
+    cJSON_AddNumberToObject(jBus, "maxBatchUs", stats.maxBatchUs);
+    cJSON_AddNumberToObject(jBus, "skipped", stats.skipped);
+    cJSON_AddNumberToObject(jBus, "staleReads", stats.staleReads);
+    cJSON_AddNumberToObject(jBus, "stuckSda", stats.stuckSda);
+    cJSON_AddNumberToObject(jBus, "recoveries", stats.recoveries);
+    if (fault.latencyMs || fault.nakEvery || fault.failAddr)
+        cJSON_AddNumberToObject(jBus, "faults", stats.faults);
+    cJSON *jDevices = cJSON_CreateObject();
+    char name[8];
+    for (uint8_t i = 0; i < devicesCount; i++) {
+        cJSON *jDevice = cJSON_CreateObject();
+        cJSON_AddBoolToObject(jDevice, "offline", devices[i].offline);
+        cJSON_AddNumberToObject(jDevice, "errors", devices[i].errors);
+        cJSON_AddNumberToObject(jDevice, "offlineCount", devices[i].offlineCount);
+        cJSON_AddNumberToObject(jDevice, "reinits", devices[i].reinits);
+        snprintf(name, sizeof(name), "0x%02x", devices[i].dev->addr);
+        cJSON_AddItemToObject(jDevices, name, jDevice);
+    }
+    cJSON_AddItemToObject(jBus, "devices", jDevices);
+    cJSON_AddItemToObject(info, "i2c", jBus);
+}
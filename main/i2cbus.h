@@ -0,0 +1,50 @@
+#pragma once
+#include <time.h>
+#include "i2cdev.h"
+#include "cJSON.h"
+#include "ds2484.h"
+
+// Все обращения к шине I2C после старта выполняет одна задача-владелец.
+// Запись PWM асинхронная и не теряется: значения копятся в теневой копии
+// устройства, соседние измененные каналы склеиваются в одну транзакцию.
+// Чтения и часы - пачкой с ожиданием и таймаутом.
+
+#define I2C_PWM_CHANNELS    16
+#define I2C_BATCH_SIZE      4
+#define I2C_WAIT_MS         200     // ожидание пачки по умолчанию
+#define I2C_OFFLINE_ERRORS  3       // ошибок подряд до отключения устройства
+#define I2C_PROBE_MS        5000    // проверка отключенных устройств
+
+enum i2cOps {
+    I2C_OP_PWM_WRITE = 0,       // PCA9685: count каналов с first
+    I2C_OP_PORT_READ,           // PCF8574: результат в port
+    I2C_OP_CLOCK_GET,           // PCF8563: результат в time, valid
+    I2C_OP_CLOCK_SET,
+    I2C_OP_OW                   // DS2484: одна команда 1-Wire в ow
+};
+
+typedef struct {
+    uint8_t op;                 // i2cOps
+    i2c_dev_t *dev;
+    uint8_t first;
+    uint8_t count;
+    union {
+        uint16_t values[I2C_PWM_CHANNELS];
+        uint8_t port;
+        struct tm time;
+        owCmd_t ow;
+    };
+    bool valid;
+    esp_err_t result;
+} i2cTrans_t;
+
+// повторная инициализация устройства после восстановления связи
+typedef esp_err_t (*i2cReinit_t)(i2c_dev_t *dev);
+
+void i2cBusInit();
+void i2cBusAddDevice(i2c_dev_t *dev, i2cReinit_t reinit);
+void i2cBusStart();
+bool i2cBusOnline(i2c_dev_t *dev);
+esp_err_t i2cBusWritePwm(i2c_dev_t *dev, uint8_t first, uint8_t count, const uint16_t *values);
+esp_err_t i2cBusSubmit(i2cTrans_t *trans, uint8_t count, uint32_t timeoutMs);
+void i2cBusAddInfo(cJSON *info);
@@ -0,0 +1,98 @@
+#include <stdio.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "esp_log.h"
+#include "config.h"
+#include "utils.h"
+#include "identity.h"
+
+// Два экземпляра: новый собирается в свободном и подменяется одним указателем,
+// поэтому публикация из других задач не видит наполовину обновленную строку.
+
+#define IDENTITY_NAME_SIZE      32
+#define IDENTITY_DESCR_SIZE     64
+#define IDENTITY_MAC_SIZE       18
+#define IDENTITY_TOPIC_SIZE     48
+
+static const char *TAG = "IDENTITY";
+
+typedef struct {
+    char name[IDENTITY_NAME_SIZE];
+    char description[IDENTITY_DESCR_SIZE];
+    char mac[IDENTITY_MAC_SIZE];
+    char topics[IDENTITY_TOPICS][IDENTITY_TOPIC_SIZE];
+    char outputs[IDENTITY_TOPIC_SIZE];      // <name>/outputs/
+    char inputs[IDENTITY_TOPIC_SIZE];       // <name>/inputs/
+    uint8_t outputsLen;
+    uint8_t inputsLen;
+} identity_t;
+
+static identity_t slots[2];
+static identity_t *volatile current = &slots[0];
+
+void identityRefresh() {
+    identity_t *next = current == &slots[0] ? &slots[1] : &slots[0];
+    char *name = getConfigValueString("name");
+    char *description = getConfigValueString("description");
+    char *mac = getMac();
+    snprintf(next->name, sizeof(next->name), "%s", name != NULL ? name : "");
+    snprintf(next->description, sizeof(next->description), "%s", description != NULL ? description : "");
+    snprintf(next->mac, sizeof(next->mac), "%s", mac != NULL ? mac : "");
+    snprintf(next->topics[IDENTITY_TOPIC_INFO], IDENTITY_TOPIC_SIZE, "%s/info",
+             strlen(next->name) > 0 ? next->name : "unknown");
+    snprintf(next->topics[IDENTITY_TOPIC_ALERTS], IDENTITY_TOPIC_SIZE, "%s/alerts", next->name);
+    next->outputsLen = snprintf(next->outputs, IDENTITY_TOPIC_SIZE, "%s/outputs/", next->name);
+    next->inputsLen = snprintf(next->inputs, IDENTITY_TOPIC_SIZE, "%s/inputs/", next->name);
+    if (next->outputsLen >= IDENTITY_TOPIC_SIZE || next->inputsLen >= IDENTITY_TOPIC_SIZE) {
+        ESP_LOGE(TAG, "Name %s is too long for topics", next->name);
+        next->outputsLen = strlen(next->outputs);
+        next->inputsLen = strlen(next->inputs);
+    }
+    current = next;
+    ESP_LOGI(TAG, "Name %s, mac %s", next->name, next->mac);
+}
+
+const char *identityName() {
+    return current->name;
+}
+
+const char *identityDescription() {
+    return current->description;
+}
+
+const char *identityMac() {
+    return current->mac;
+}
+
+const char *identityTopic(uint8_t topic) {
+    return topic < IDENTITY_TOPICS ? current->topics[topic] : "";
+}
+
+static uint8_t appendNumber(char *dst, uint8_t value) {
+    char digits[3];
+    uint8_t len = 0;
+    do {
+        digits[len++] = '0' + value % 10;
+        value /= 10;
+    } while (value);
+    for (uint8_t i = 0; i < len; i++)
+        dst[i] = digits[len - 1 - i];
+    return len;
+}
+
+uint8_t identityIOTopic(char *topic, uint8_t size, bool input, uint8_t slaveId, uint8_t id) {
+    // <name>/outputs|inputs/<slaveId>/<id>, без форматирования префикса
+    identity_t *ident = current;
+    const char *prefix = input ? ident->inputs : ident->outputs;
+    uint8_t len = input ? ident->inputsLen : ident->outputsLen;
+    if (len + 8 > size) {
+        topic[0] = 0;
+        return 0;
+    }
+    memcpy(topic, prefix, len);
+    len += appendNumber(topic + len, slaveId);
+    topic[len++] = '/';
+    len += appendNumber(topic + len, id);
+    topic[len] = 0;
+    return len;
+}
@@ -0,0 +1,20 @@
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+
+// Имя, описание, MAC и префиксы MQTT топиков устройства. Собираются один раз при
+// загрузке конфига и заново в onConfigChanged (под sem_busy), читаются из любой
+// задачи без блокировки. Публикация дописывает только номера.
+
+enum identityTopics {
+    IDENTITY_TOPIC_INFO = 0,    // <name>/info, "unknown" при пустом имени
+    IDENTITY_TOPIC_ALERTS,      // <name>/alerts
+    IDENTITY_TOPICS
+};
+
+void identityRefresh();
+const char *identityName();
+const char *identityDescription();
+const char *identityMac();
+const char *identityTopic(uint8_t topic);
+uint8_t identityIOTopic(char *topic, uint8_t size, bool input, uint8_t slaveId, uint8_t id);
@@ -0,0 +1,398 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "cJSON.h"
+#include "iomodel.h"
+
+// Модель собирается обходом уже разобранного дерева io: io.outputs[n].поле и
+// io.inputs[n].поле, вложенные events/actions/acls пропускаются. Дерево остается
+// в компоненте config (его отдает GET /service/config), модель только дополняет
+// его для горячих путей. Модель собирается в новой структуре и подменяет старую
+// целиком.
+
+#define IO_GROW 8
+
+static const char *TAG = "IOMODEL";
+
+typedef struct {
+    ioOutput_t *outputs;
+    uint16_t outputsCount;
+    uint16_t outputsCap;
+    ioInput_t *inputs;
+    uint16_t inputsCount;
+    uint16_t inputsCap;
+    uint16_t typeCount[IO_OUT_TYPES];
+    size_t bytes;
+} ioModel_t;
+
+typedef struct {
+    ioModel_t *model;
+    uint8_t kind;           // 0 нет, 1 выход, 2 вход
+    bool hasId;
+    ioOutput_t output;
+    ioInput_t input;
+    bool noMem;
+} ioBuilder_t;
+
+static ioModel_t *model = NULL;
+static const char *stateNames[] = {"", "off", "on"};
+
+static struct {
+    size_t modelBytes;
+    size_t domBytes;        // оценка того же io в cJSON
+    uint32_t loadUs;
+} stats;
+
+static uint8_t outputType(const char *s) {
+    if (!strcmp(s, "t"))
+        return IO_OUT_TIMER;
+    if (!strcmp(s, "shooter"))
+        return IO_OUT_SHOOTER;
+    if (!strcmp(s, "os"))
+        return IO_OUT_ONESHOT;
+    return IO_OUT_SIMPLE;
+}
+
+static uint8_t inputType(const char *s) {
+    if (!strcmp(s, "SW"))
+        return IO_IN_SW;
+    if (!strcmp(s, "INVSW"))
+        return IO_IN_INVSW;
+    if (!strcmp(s, "BTN"))
+        return IO_IN_BTN;
+    if (!strcmp(s, "PULSE"))
+        return IO_IN_PULSE;
+    return IO_IN_OTHER;
+}
+
+static void modelFree(ioModel_t *m) {
+    if (m == NULL)
+        return;
+    free(m->outputs);
+    free(m->inputs);
+    free(m);
+}
+
+static bool grow(void **items, uint16_t *cap, size_t itemSize, size_t *bytes) {
+    void *p = realloc(*items, (*cap + IO_GROW) * itemSize);
+    if (p == NULL)
+        return false;
+    *items = p;
+    *cap += IO_GROW;
+    *bytes += IO_GROW * itemSize;
+    return true;
+}
+
+static void commit(ioBuilder_t *b) {
+    // элемент массива закончился
+    ioModel_t *m = b->model;
+    if (!b->hasId)
+        return;
+    if (b->kind == 1) {
+        if (m->outputsCount == m->outputsCap &&
+            !grow((void**)&m->outputs, &m->outputsCap, sizeof(ioOutput_t), &m->bytes)) {
+            b->noMem = true;
+            return;
+        }
+        m->outputs[m->outputsCount++] = b->output;
+        m->typeCount[b->output.type]++;
+    } else {
+        if (m->inputsCount == m->inputsCap &&
+            !grow((void**)&m->inputs, &m->inputsCap, sizeof(ioInput_t), &m->bytes)) {
+            b->noMem = true;
+            return;
+        }
+        m->inputs[m->inputsCount++] = b->input;
+    }
+}
+
+static void field(ioBuilder_t *b, const char *key, bool isNumber, int num, const char *value) {
+    // value - только для строк
+    if (b->kind == 1) {
+        ioOutput_t *o = &b->output;
+        if (isNumber) {
+            if (!strcmp(key, "id")) {
+                o->id = num;
+                b->hasId = true;
+            } else if (!strcmp(key, "slaveId")) {
+                o->slaveId = num;
+            } else if (!strcmp(key, "limit")) {
+                o->limit = num;
+            } else if (!strcmp(key, "on")) {
+                o->onTime = num;
+            } else if (!strcmp(key, "off")) {
+                o->offTime = num;
+            }
+        } else if (value != NULL) {
+            if (!strcmp(key, "type"))
+                o->type = outputType(value);
+            else if (!strcmp(key, "default"))
+                o->defaultOn = !strcmp(value, "on");
+        }
+    } else {
+        ioInput_t *in = &b->input;
+        if (isNumber) {
+            if (!strcmp(key, "id")) {
+                in->id = num;
+                b->hasId = true;
+            } else if (!strcmp(key, "slaveId")) {
+                in->slaveId = num;
+            } else if (!strcmp(key, "ci")) {
+                in->ci = num;
+            }
+        } else if (value != NULL && !strcmp(key, "type")) {
+            in->type = inputType(value);
+        }
+    }
+}
+
+static void begin(ioBuilder_t *b, uint8_t kind) {
+    b->kind = kind;
+    b->hasId = false;
+    memset(&b->output, 0, sizeof(ioOutput_t));
+    memset(&b->input, 0, sizeof(ioInput_t));
+    b->input.type = IO_IN_OTHER;
+}
+
+static bool walk(ioBuilder_t *b, cJSON *list, uint8_t kind) {
+    cJSON *item = NULL;
+    cJSON_ArrayForEach(item, list) {
+        if (!cJSON_IsObject(item))
+            continue;
+        begin(b, kind);
+        cJSON *f = NULL;
+        cJSON_ArrayForEach(f, item) {
+            field(b, f->string, cJSON_IsNumber(f), f->valueint,
+                  cJSON_IsString(f) ? f->valuestring : NULL);
+        }
+        commit(b);
+        if (b->noMem)
+            return false;
+    }
+    b->kind = 0;
+    return true;
+}
+
+static ioModel_t *modelNew() {
+    ioModel_t *m = calloc(1, sizeof(ioModel_t));
+    if (m != NULL)
+        m->bytes = sizeof(ioModel_t);
+    return m;
+}
+
+static void modelSwap(ioModel_t *next, int64_t start) {
+    ioModel_t *old = model;
+    model = next;
+    modelFree(old);
+    stats.modelBytes = model->bytes;
+    stats.loadUs = esp_timer_get_time() - start;
+    ESP_LOGI(TAG, "Loaded %d outputs, %d inputs, %d bytes in %u us",
+             model->outputsCount, model->inputsCount, model->bytes, stats.loadUs);
+}
+
+static size_t domBytes(cJSON *item) {
+    // примерный размер дерева: узлы и строки, без накладных расходов кучи
+    size_t bytes = 0;
+    for (; item != NULL; item = item->next) {
+        bytes += sizeof(cJSON);
+        if (item->string != NULL)
+            bytes += strlen(item->string) + 1;
+        if (cJSON_IsString(item) && item->valuestring != NULL)
+            bytes += strlen(item->valuestring) + 1;
+        bytes += domBytes(item->child);
+    }
+    return bytes;
+}
+
+static void viewState(cJSON *jState, uint8_t state) {
+    // строка-ссылка на константу, узел не пересоздается
+    if (jState == NULL || state == IO_STATE_UNKNOWN)
+        return;
+    if (!(jState->type & cJSON_IsReference)) {
+        cJSON_free(jState->valuestring);
+        jState->type |= cJSON_IsReference;
+    }
+    jState->valuestring = (char*)stateNames[state];
+}
+
+static void viewNumber(cJSON *jNumber, int value) {
+    if (jNumber == NULL)
+        return;
+    jNumber->valueint = value;
+    jNumber->valuedouble = value;
+}
+
+static cJSON *bindState(cJSON *item, uint8_t *state) {
+    cJSON *jState = cJSON_GetObjectItem(item, "state");
+    if (!cJSON_IsString(jState)) {
+        cJSON_DeleteItemFromObject(item, "state");
+        jState = cJSON_CreateStringReference(stateNames[IO_STATE_OFF]);
+        cJSON_AddItemToObject(item, "state", jState);
+    }
+    *state = iomodelState(jState->valuestring);
+    viewState(jState, *state);
+    return jState;
+}
+
+static cJSON *bindNumber(cJSON *item, const char *key, int value, int *current) {
+    // числовой узел создается один раз, дальше меняется на месте
+    cJSON *jNumber = cJSON_GetObjectItem(item, key);
+    if (!cJSON_IsNumber(jNumber)) {
+        cJSON_DeleteItemFromObject(item, key);
+        jNumber = cJSON_CreateNumber(value);
+        cJSON_AddItemToObject(item, key, jNumber);
+    }
+    *current = jNumber->valueint;
+    return jNumber;
+}
+
+static bool bind(cJSON *io) {
+    // элементы в модели идут в том же порядке, что и в дереве (без элементов без id)
+    uint16_t n = 0;
+    cJSON *child = NULL;
+    cJSON_ArrayForEach(child, cJSON_GetObjectItem(io, "outputs")) {
+        if (!cJSON_IsNumber(cJSON_GetObjectItem(child, "id")))
+            continue;
+        if (n >= model->outputsCount || model->outputs[n].id != cJSON_GetObjectItem(child, "id")->valueint)
+            return false;
+        ioOutput_t *o = &model->outputs[n++];
+        int timer;
+        o->jState = bindState(child, &o->state);
+        // t/shooter/os без таймера раньше получали 1 на первом тике
+        o->jTimer = bindNumber(child, "timer", o->type == IO_OUT_SIMPLE ? 0 : 1, &timer);
+        o->timer = timer;
+    }
+    n = 0;
+    cJSON_ArrayForEach(child, cJSON_GetObjectItem(io, "inputs")) {
+        if (!cJSON_IsNumber(cJSON_GetObjectItem(child, "id")))
+            continue;
+        if (n >= model->inputsCount || model->inputs[n].id != cJSON_GetObjectItem(child, "id")->valueint)
+            return false;
+        ioInput_t *in = &model->inputs[n++];
+        in->jState = bindState(child, &in->state);
+        if (in->ci > 0) {
+            int i;
+            in->jI = bindNumber(child, "i", 0, &i);
+            in->i = i;
+        }
+    }
+    return true;
+}
+
+esp_err_t iomodelLoadJson(cJSON *io) {
+    // io уже разобран компонентом config, модель строится обходом дерева,
+    // без печати в текст и повторного разбора.
+    // Старая модель ссылается на узлы прежнего дерева, которое к этому моменту
+    // может быть освобождено, поэтому она сбрасывается до первого шага с ошибкой
+    int64_t start = esp_timer_get_time();
+    esp_err_t err = ESP_OK;
+    modelFree(model);
+    model = NULL;
+    ioBuilder_t b = {0};
+    b.model = modelNew();
+    if (b.model == NULL) {
+        err = ESP_ERR_NO_MEM;
+    } else if (!walk(&b, cJSON_GetObjectItem(io, "outputs"), 1) ||
+               !walk(&b, cJSON_GetObjectItem(io, "inputs"), 2)) {
+        modelFree(b.model);
+        err = ESP_ERR_NO_MEM;
+    } else {
+        modelSwap(b.model, start);
+    }
+    if (io != NULL)
+        stats.domBytes = sizeof(cJSON) + domBytes(io->child);
+    if (err == ESP_OK && !bind(io))
+        err = ESP_ERR_INVALID_STATE;
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "io model dropped, %s", esp_err_to_name(err));
+        modelFree(model);
+        model = NULL;
+    }
+    return err;
+}
+
+ioOutput_t *iomodelOutput(uint8_t slaveId, uint8_t id) {
+    if (model == NULL)
+        return NULL;
+    for (uint16_t i = 0; i < model->outputsCount; i++) {
+        if (model->outputs[i].id == id && (slaveId == IO_ANY_SLAVE || model->outputs[i].slaveId == slaveId))
+            return &model->outputs[i];
+    }
+    return NULL;
+}
+
+ioInput_t *iomodelInput(uint8_t slaveId, uint8_t id) {
+    if (model == NULL)
+        return NULL;
+    for (uint16_t i = 0; i < model->inputsCount; i++) {
+        if (model->inputs[i].id == id && (slaveId == IO_ANY_SLAVE || model->inputs[i].slaveId == slaveId))
+            return &model->inputs[i];
+    }
+    return NULL;
+}
+
+ioOutput_t *iomodelOutputAt(uint16_t index) {
+    if (model == NULL || index >= model->outputsCount)
+        return NULL;
+    return &model->outputs[index];
+}
+
+ioInput_t *iomodelInputAt(uint16_t index) {
+    if (model == NULL || index >= model->inputsCount)
+        return NULL;
+    return &model->inputs[index];
+}
+
+uint16_t iomodelOutputsCount(uint8_t type) {
+    if (model == NULL || type >= IO_OUT_TYPES)
+        return 0;
+    return model->typeCount[type];
+}
+
+uint8_t iomodelState(const char *value) {
+    if (value == NULL)
+        return IO_STATE_UNKNOWN;
+    if (!strcmp(value, "on"))
+        return IO_STATE_ON;
+    if (!strcmp(value, "off"))
+        return IO_STATE_OFF;
+    return IO_STATE_UNKNOWN;
+}
+
+const char *iomodelStateName(uint8_t state) {
+    // неизвестное состояние отдается как "off", как и раньше при отсутствии state
+    return state == IO_STATE_ON ? stateNames[IO_STATE_ON] : stateNames[IO_STATE_OFF];
+}
+
+void iomodelSetOutput(ioOutput_t *output, uint8_t state, uint16_t timer) {
+    output->state = state;
+    viewState(output->jState, state);
+    iomodelSetOutputTimer(output, timer);
+}
+
+void iomodelSetOutputTimer(ioOutput_t *output, uint16_t timer) {
+    output->timer = timer;
+    viewNumber(output->jTimer, timer);
+}
+
+void iomodelSetInput(ioInput_t *input, uint8_t state) {
+    input->state = state;
+    viewState(input->jState, state);
+}
+
+void iomodelSetInputCounter(ioInput_t *input, uint8_t i) {
+    input->i = i;
+    viewNumber(input->jI, i);
+}
+
+void iomodelAddInfo(cJSON *info) {
+    cJSON *jModel = cJSON_CreateObject();
+    cJSON_AddNumberToObject(jModel, "outputs", model != NULL ? model->outputsCount : 0);
+    cJSON_AddNumberToObject(jModel, "inputs", model != NULL ? model->inputsCount : 0);
+    cJSON_AddNumberToObject(jModel, "modelBytes", stats.modelBytes);
+    cJSON_AddNumberToObject(jModel, "domBytes", stats.domBytes);
+    cJSON_AddNumberToObject(jModel, "loadUs", stats.loadUs);
+    cJSON_AddItemToObject(info, "ioModel", jModel);
+}
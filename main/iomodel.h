@@ -0,0 +1,73 @@
+#pragma once
+#include "esp_err.h"
+#include "cJSON.h"
+
+// Компактная модель входов/выходов для горячих путей. iomodelLoadJson строит ее
+// обходом дерева io, которое уже держит компонент config.
+// Состояние и таймеры живут в модели. Узлы "state"/"timer"/"i" в дереве io - только
+// представление для сериализации: обновляются на месте, "state" ссылается на
+// константную строку, поэтому смена состояния не выделяет память.
+
+#define IO_ANY_SLAVE    0xFF    // поиск только по id, первый найденный
+
+enum ioOutputTypes {
+    IO_OUT_SIMPLE = 0,      // "s"
+    IO_OUT_TIMER,           // "t" тепличный таймер
+    IO_OUT_SHOOTER,         // "shooter"
+    IO_OUT_ONESHOT,         // "os"
+    IO_OUT_TYPES
+};
+
+enum ioStates {
+    IO_STATE_UNKNOWN = 0,
+    IO_STATE_OFF,
+    IO_STATE_ON
+};
+
+enum ioInputTypes {
+    IO_IN_SW = 0,
+    IO_IN_INVSW,
+    IO_IN_BTN,
+    IO_IN_PULSE,            // счетный вход, обрабатывается в pulse.c
+    IO_IN_OTHER,
+    IO_IN_TYPES
+};
+
+typedef struct {
+    uint8_t id;
+    uint8_t slaveId;
+    uint8_t type;           // ioOutputTypes
+    bool defaultOn;
+    uint16_t limit;
+    uint16_t onTime;        // "on" для t/shooter
+    uint16_t offTime;       // "off" для t/shooter
+    uint8_t state;          // ioStates
+    uint16_t timer;
+    cJSON *jState;          // представление в дереве io
+    cJSON *jTimer;
+} ioOutput_t;
+
+typedef struct {
+    uint8_t id;
+    uint8_t slaveId;
+    uint8_t type;           // ioInputTypes
+    uint8_t ci;             // счетчик для INVSW
+    uint8_t state;          // ioStates
+    uint8_t i;              // текущее значение счетчика
+    cJSON *jState;
+    cJSON *jI;
+} ioInput_t;
+
+esp_err_t iomodelLoadJson(cJSON *io);
+ioOutput_t *iomodelOutput(uint8_t slaveId, uint8_t id);
+ioInput_t *iomodelInput(uint8_t slaveId, uint8_t id);
+ioOutput_t *iomodelOutputAt(uint16_t index);
+ioInput_t *iomodelInputAt(uint16_t index);
+uint16_t iomodelOutputsCount(uint8_t type);
+uint8_t iomodelState(const char *value);
+const char *iomodelStateName(uint8_t state);
+void iomodelSetOutput(ioOutput_t *output, uint8_t state, uint16_t timer);
+void iomodelSetOutputTimer(ioOutput_t *output, uint16_t timer);
+void iomodelSetInput(ioInput_t *input, uint8_t state);
+void iomodelSetInputCounter(ioInput_t *input, uint8_t i);
+void iomodelAddInfo(cJSON *info);
@@ -0,0 +1,222 @@
+#include <stdio.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "cJSON.h"
+#include "wssender.h"
+#include "logship.h"
+#include "tasks.h"
+
+// Отправка логов в вебсокет.
+// Хук vprintf только форматирует строку в готовую ячейку кольцевого буфера (без malloc
+// и без cJSON), отдельный таск раз в LOG_BATCH_MS собирает накопленные строки в один
+// фрейм LOG. Фильтр по уровню и ограничение строк в секунду срабатывают до форматирования.
+
+#define LOG_SLOTS           64          // степень двойки
+#define LOG_LINE_SIZE       160
+#define LOG_FRAME_SIZE      2048
+#define LOG_BATCH_MS        250
+#define LOG_RATE_DEFAULT    50          // строк в секунду
+
+static const char *TAG = "LOGSHIP";
+
+typedef struct {
+    volatile uint32_t seq;
+    char text[LOG_LINE_SIZE];
+} logSlot_t;
+
+static logSlot_t slots[LOG_SLOTS];
+static volatile uint32_t enqueuePos = 0;
+static uint32_t dequeuePos = 0;
+static TaskHandle_t shipTask = NULL;
+static volatile bool enabled = false;
+static volatile uint8_t maxLevel = ESP_LOG_INFO;
+static volatile uint16_t rateLimit = LOG_RATE_DEFAULT;
+static volatile uint32_t rateSecond = 0;
+static volatile uint16_t rateCount = 0;
+static char frame[LOG_FRAME_SIZE];
+
+static struct {
+    uint32_t lines;
+    uint32_t filtered;
+    uint32_t limited;
+    uint32_t dropped;
+    uint32_t frames;
+    uint64_t hookUs;            // lines, hookUs и hookUsMax под statsMux
+    uint32_t hookUsMax;
+} stats;
+static portMUX_TYPE statsMux = portMUX_INITIALIZER_UNLOCKED;
+
+static uint8_t fmtLevel(const char *fmt) {
+    // формат ESP_LOG: [\033[0;3Xm]L (%u) %s: ...
+    if (fmt[0] == '\033') {
+        const char *m = strchr(fmt, 'm');
+        if (m == NULL)
+            return ESP_LOG_INFO;
+        fmt = m + 1;
+    }
+    switch (fmt[0]) {
+        case 'E': return ESP_LOG_ERROR;
+        case 'W': return ESP_LOG_WARN;
+        case 'I': return ESP_LOG_INFO;
+        case 'D': return ESP_LOG_DEBUG;
+        case 'V': return ESP_LOG_VERBOSE;
+    }
+    return ESP_LOG_INFO;
+}
+
+void logShipWrite(const char *fmt, va_list args) {
+    // вызывается из любого таска, который пишет в лог: ничего не логировать и не блокировать
+    if (!enabled || shipTask == NULL)
+        return;
+    // esp_timer, а не счетчик тактов: он свой у каждого ядра, а пишут в лог с обоих
+    int64_t start = esp_timer_get_time();
+    if (fmtLevel(fmt) > maxLevel) {
+        __atomic_add_fetch(&stats.filtered, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    uint32_t second = start / 1000000;
+    if (second != rateSecond) {
+        // гонка при смене секунды допустима, ошибка максимум на пару строк
+        rateSecond = second;
+        rateCount = 0;
+    }
+    if (__atomic_add_fetch(&rateCount, 1, __ATOMIC_RELAXED) > rateLimit) {
+        __atomic_add_fetch(&stats.limited, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    uint32_t pos = __atomic_load_n(&enqueuePos, __ATOMIC_RELAXED);
+    logSlot_t *slot;
+    while (1) {
+        slot = &slots[pos & (LOG_SLOTS - 1)];
+        int32_t diff = (int32_t)__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - (int32_t)pos;
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&enqueuePos, &pos, pos + 1, true,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if (diff < 0) {
+            __atomic_add_fetch(&stats.dropped, 1, __ATOMIC_RELAXED);
+            return; // full
+        } else {
+            pos = __atomic_load_n(&enqueuePos, __ATOMIC_RELAXED);
+        }
+    }
+    vsnprintf(slot->text, LOG_LINE_SIZE, fmt, args);
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+    uint32_t us = esp_timer_get_time() - start;
+    portENTER_CRITICAL(&statsMux);
+    stats.lines++;
+    stats.hookUs += us;
+    if (us > stats.hookUsMax)
+        stats.hookUsMax = us;
+    portEXIT_CRITICAL(&statsMux);
+}
+
+static uint16_t escapedLen(const char *s) {
+    uint16_t len = 0;
+    for (; *s; s++) {
+        uint8_t c = *s;
+        len += (c == '"' || c == '\\' || c == '\n') ? 2 : (c < 0x20 ? 6 : 1);
+    }
+    return len;
+}
+
+static uint16_t appendEscaped(uint16_t len, const char *s) {
+    // JSON экранирование, как у cJSON; не влезающий хвост отбрасывается
+    for (; *s && len < LOG_FRAME_SIZE - 8; s++) {
+        uint8_t c = *s;
+        if (c == '"' || c == '\\') {
+            frame[len++] = '\\';
+            frame[len++] = c;
+        } else if (c == '\n') {
+            frame[len++] = '\\';
+            frame[len++] = 'n';
+        } else if (c < 0x20) {
+            len += snprintf(&frame[len], 7, "\\u%04x", c);
+        } else {
+            frame[len++] = c;
+        }
+    }
+    return len;
+}
+
+static void flush(uint16_t len, uint16_t header, uint16_t count) {
+    if (len == header)
+        return;
+    memcpy(&frame[len], "\"}", 3);
+    if (wsSend(frame, WS_PRIO_LOG, false))
+        stats.frames++;
+    else
+        __atomic_add_fetch(&stats.dropped, count, __ATOMIC_RELAXED);
+}
+
+static void logShipTask(void *pvParameter) {
+    static const char header[] = "{\"type\":\"LOG\",\"payload\":\"";
+    const uint16_t headerLen = sizeof(header) - 1;
+    memcpy(frame, header, headerLen);
+    while (1) {
+        vTaskDelay(LOG_BATCH_MS / portTICK_RATE_MS);
+        uint16_t len = headerLen;
+        uint16_t count = 0;
+        while (1) {
+            logSlot_t *slot = &slots[dequeuePos & (LOG_SLOTS - 1)];
+            if ((int32_t)__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - (int32_t)(dequeuePos + 1) < 0)
+                break; // empty
+            // не влезает в текущий фрейм - отправляем накопленное
+            if (len + escapedLen(slot->text) > LOG_FRAME_SIZE - 8 && len > headerLen) {
+                flush(len, headerLen, count);
+                len = headerLen;
+                count = 0;
+            }
+            if (enabled) {
+                len = appendEscaped(len, slot->text);
+                count++;
+            }
+            __atomic_store_n(&slot->seq, dequeuePos + LOG_SLOTS, __ATOMIC_RELEASE);
+            dequeuePos++;
+        }
+        flush(len, headerLen, count);
+    }
+}
+
+void logShipSetEnabled(bool value, uint8_t level, uint16_t rate) {
+    if (level >= ESP_LOG_ERROR && level <= ESP_LOG_VERBOSE)
+        maxLevel = level;
+    if (rate > 0)
+        rateLimit = rate;
+    enabled = value;
+}
+
+void logShipInit() {
+    if (shipTask != NULL)
+        return;
+    for (uint32_t i = 0; i < LOG_SLOTS; i++)
+        slots[i].seq = i;
+    shipTask = taskStart(TASK_LOG_SHIP, &logShipTask, NULL);
+    ESP_LOGI(TAG, "Log shipper started");
+}
+
+void logShipAddInfo(cJSON *info) {
+    if (shipTask == NULL)
+        return;
+    cJSON *jShip = cJSON_CreateObject();
+    cJSON_AddBoolToObject(jShip, "enabled", enabled);
+    cJSON_AddNumberToObject(jShip, "level", maxLevel);
+    cJSON_AddNumberToObject(jShip, "rate", rateLimit);
+    portENTER_CRITICAL(&statsMux);
+    uint32_t lines = stats.lines;
+    uint64_t hookUs = stats.hookUs;
+    uint32_t hookUsMax = stats.hookUsMax;
+    portEXIT_CRITICAL(&statsMux);
+    cJSON_AddNumberToObject(jShip, "lines", lines);
+    cJSON_AddNumberToObject(jShip, "filtered", stats.filtered);
+    cJSON_AddNumberToObject(jShip, "limited", stats.limited);
+    cJSON_AddNumberToObject(jShip, "dropped", stats.dropped);
+    cJSON_AddNumberToObject(jShip, "frames", stats.frames);
+    // время хука на принятую строку, мкс (с вытеснением, если оно было)
+    cJSON_AddNumberToObject(jShip, "hookUsAvg", lines ? (uint32_t)(hookUs / lines) : 0);
+    cJSON_AddNumberToObject(jShip, "hookUsMax", hookUsMax);
+    cJSON_AddItemToObject(info, "logShip", jShip);
+}
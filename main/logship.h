@@ -0,0 +1,8 @@
+#pragma once
+#include <stdarg.h>
+#include "cJSON.h"
+
+void logShipInit();
+void logShipSetEnabled(bool enabled, uint8_t level, uint16_t rate);
+void logShipWrite(const char *fmt, va_list args);
+void logShipAddInfo(cJSON *info);
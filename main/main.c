@@ -11,6 +11,7 @@
 #include "storage.h"
 #include "webserver.h"
 #include "config.h"
+#include "boot.h"
 
 #include "driver/gpio.h"
 // #define CONFIG_LOG_MAXIMUM_LEVEL INFO
@@ -19,6 +20,14 @@ static const char *TAG = "MAIN";
 static bool inited = false;
 static SemaphoreHandle_t sem;
 
+static void startServices(uint32_t address) {
+	// из serviceTask. Облако и MQTT первыми - у них самое долгое подключение
+	initWS();
+	initMQTT();
+	runWebServer();
+	initFTP(address);
+}
+
 void networkHandler(uint8_t event, uint32_t address) {
 	ESP_LOGI(TAG, "event %d, address %d.%d.%d.%d", event, 
 		     address & 0xFF, (address & 0xFFFF) >> 8, 
@@ -26,10 +35,8 @@ void networkHandler(uint8_t event, uint32_t address) {
 	if (!inited && (event == WIFI_CONNECTED || event == ETH_CONNECTED)) {
 		inited = true;
 		//otaCheck(getSettingsValueString("otaurl"), cert_pem_start);
-		runWebServer();
-	    initWS();
-	    initMQTT();
-	    initFTP(address);
+		bootStage(BOOT_NETWORK_UP);
+		bootDeferServices(&startServices, address);
 	} else if (event == WIFI_EVENT_AP_START) {
 		ESP_LOGI(TAG, "WIFI_EVENT_AP_START. Starting webserver for AP");
 		initWebServer(0);
@@ -45,6 +52,7 @@ void app_main(void)
     sem = xSemaphoreCreateMutex();
     initStorage(sem);
     initConfig();
+    bootStage(BOOT_CONFIG);
     initNetwork(&networkHandler);
 //printConfig();
     if (initCore(sem) == ESP_OK) 
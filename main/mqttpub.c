@@ -0,0 +1,494 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "cJSON.h"
+#include "mqtt.h"
+#include "cfgref.h"
+#include "mqttpub.h"
+
+// Публикация состояния в MQTT.
+// После (пере)подключения к брокеру публикуются состояния всех входов/выходов
+// по отдельным топикам, общий снимок <name>/state и, если включено mqtt/discovery,
+// конфигурации Home Assistant discovery. Все сообщения собираются в один
+// переиспользуемый буфер без cJSON.
+// Пока брокер недоступен, публикации складываются в ограниченную очередь,
+// где по каждому топику хранится только последнее значение. После подключения
+// очередь отправляется первой, с ограничением скорости.
+// Состояния и discovery публикуются с retain: новый подписчик и Home Assistant
+// после перезапуска сразу получают последнее значение. Обход io сбрасывается при
+// разрыве связи и при каждой смене конфига - курсор указывает в дерево io.
+
+#define MQTTPUB_BUFFER_SIZE 768
+#define MQTTPUB_TOPIC_SIZE  96
+#define MQTTPUB_NAME_SIZE   32
+#define MQTTPUB_MAC_SIZE    20
+#define MQTTPUB_SLAVES      16
+#define MQTTPUB_MAX_ID      32
+#define MQTTPUB_PER_TICK    8   // сообщений за один тик inputsTask
+#define MQTTQ_MAX_ENTRIES   48
+#define MQTTQ_MAX_BYTES     3072
+#define MQTTQ_PER_TICK      4   // скорость отправки очереди, сообщений за тик
+
+static const char *TAG = "MQTTPUB";
+
+static char buffer[MQTTPUB_BUFFER_SIZE];
+static uint16_t bufLen = 0;
+static bool bufOverflow = false;
+static char topic[MQTTPUB_TOPIC_SIZE];
+static char devName[MQTTPUB_NAME_SIZE] = "unknown";
+static char devMac[MQTTPUB_MAC_SIZE] = "";
+static char devModel[MQTTPUB_NAME_SIZE] = "";
+
+// что осталось отправить после подключения
+enum {
+    STAGE_IDLE = 0,
+    STAGE_QUEUE,
+    STAGE_DISCOVERY,
+    STAGE_STATES,
+    STAGE_SNAPSHOT
+};
+static uint8_t stage = STAGE_IDLE;
+// события задачи MQTT, разбирает mqttPubTick; последнее событие побеждает
+enum {
+    PENDING_NONE = 0,
+    PENDING_CONNECTED,
+    PENDING_STOP
+};
+static volatile uint8_t pending = PENDING_NONE;
+static cJSON *cursor = NULL;     // текущий элемент outputs/inputs
+static bool cursorInputs = false;
+
+// элемент очереди: "topic\0value\0" одним блоком
+typedef struct {
+    char *data;
+    uint16_t size;
+    bool retain;
+} queueItem_t;
+
+static queueItem_t queue[MQTTQ_MAX_ENTRIES];
+static uint8_t queueHead = 0;    // самый старый элемент
+static uint8_t queueCount = 0;
+static uint16_t queueBytes = 0;
+static SemaphoreHandle_t queueMutex = NULL;
+static bool queueEnabled = false;
+static uint32_t queueDrops = 0;
+static uint32_t queueCompacted = 0;
+static uint32_t queueSuperseded = 0;
+static uint32_t queueReplayed = 0;
+static uint16_t queueMaxDepth = 0;
+static int64_t replayStart = 0;
+static uint32_t replayTimeMs = 0;
+
+typedef struct {
+    uint8_t slaveId;
+    uint32_t outputs;
+    uint32_t outputsExist;
+    uint32_t inputs;
+    uint32_t inputsExist;
+} slaveState_t;
+
+static void bufReset() {
+    bufLen = 0;
+    bufOverflow = false;
+    buffer[0] = '\0';
+}
+
+static void bufAppend(const char *fmt, ...) {
+    if (bufOverflow)
+        return;
+    va_list args;
+    va_start(args, fmt);
+    int n = vsnprintf(buffer + bufLen, sizeof(buffer) - bufLen, fmt, args);
+    va_end(args);
+    if (n < 0 || n >= sizeof(buffer) - bufLen) {
+        bufOverflow = true;
+        return;
+    }
+    bufLen += n;
+}
+
+static void bufAppendStr(const char *s) {
+    // строка JSON с экранированием
+    bufAppend("\"");
+    for (; s != NULL && *s && !bufOverflow; s++) {
+        if (*s == '"' || *s == '\\')
+            bufAppend("\\%c", *s);
+        else if ((uint8_t)*s < 0x20)
+            bufAppend("\\u%04x", *s);
+        else if (bufLen + 1 < sizeof(buffer)) {
+            buffer[bufLen++] = *s;
+            buffer[bufLen] = '\0';
+        } else
+            bufOverflow = true;
+    }
+    bufAppend("\"");
+}
+
+// компонент mqtt без публикации с retain отдает только MQTTPublish
+void MQTTPublishRetained(char *topic, char *data) __attribute__((weak));
+
+void mqttPubPublish(const char *topic, const char *data, bool retain) {
+    if (retain && MQTTPublishRetained != NULL)
+        MQTTPublishRetained((char*)topic, (char*)data);
+    else
+        MQTTPublish((char*)topic, (char*)data);
+}
+
+static void publishBuffer() {
+    // все, что собирается в буфере - состояния и discovery
+    if (bufOverflow) {
+        ESP_LOGE(TAG, "Payload for %s is too long", topic);
+        return;
+    }
+    mqttPubPublish(topic, buffer, true);
+}
+
+static uint8_t itemInt(cJSON *item, const char *name, uint8_t def) {
+    cJSON *value = cJSON_GetObjectItem(item, name);
+    return cJSON_IsNumber(value) ? value->valueint : def;
+}
+
+static bool itemIsOn(cJSON *item) {
+    cJSON *state = cJSON_GetObjectItem(item, "state");
+    return cJSON_IsString(state) && !strcmp(state->valuestring, "on");
+}
+
+static bool itemIsButton(cJSON *item) {
+    cJSON *type = cJSON_GetObjectItem(item, "type");
+    return cJSON_IsString(type) && !strcmp(type->valuestring, "BTN");
+}
+
+void mqttPubSetIdentity(const char *name, const char *mac, const char *model) {
+    snprintf(devName, sizeof(devName), "%s", (name != NULL && strlen(name) > 0) ? name : "unknown");
+    snprintf(devMac, sizeof(devMac), "%s", mac != NULL ? mac : "");
+    snprintf(devModel, sizeof(devModel), "%s", model != NULL ? model : "");
+}
+
+static uint8_t queueIndex(uint8_t i) {
+    return (queueHead + i) % MQTTQ_MAX_ENTRIES;
+}
+
+static void queueDropOldest() {
+    queueItem_t *item = &queue[queueHead];
+    queueBytes -= item->size;
+    free(item->data);
+    item->data = NULL;
+    queueHead = queueIndex(1);
+    queueCount--;
+}
+
+void mqttPubInit(bool enabled) {
+    if (queueMutex == NULL)
+        queueMutex = xSemaphoreCreateMutex();
+    queueEnabled = enabled;
+}
+
+static bool queueRemoveTopic(const char *topic) {
+    // под queueMutex
+    for (uint8_t i = 0; i < queueCount; i++) {
+        queueItem_t *item = &queue[queueIndex(i)];
+        if (!strcmp(item->data, topic)) {
+            queueBytes -= item->size;
+            free(item->data);
+            for (uint8_t j = i; j + 1 < queueCount; j++)
+                queue[queueIndex(j)] = queue[queueIndex(j+1)];
+            queue[queueIndex(queueCount - 1)].data = NULL;
+            queueCount--;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool mqttPubQueue(const char *topic, const char *value, bool retain) {
+    // публикация во время отсутствия связи. Храним только последнее значение топика
+    if (!queueEnabled || queueMutex == NULL)
+        return false;
+    uint16_t topicLen = strlen(topic);
+    uint16_t size = topicLen + strlen(value) + 2;
+    if (size > MQTTQ_MAX_BYTES)
+        return false;
+    char *data = malloc(size);
+    if (data == NULL)
+        return false;
+    memcpy(data, topic, topicLen + 1);
+    strcpy(data + topicLen + 1, value);
+    if (xSemaphoreTake(queueMutex, portMAX_DELAY) == pdTRUE) {
+        // старое значение того же топика удаляется, новое встает в конец
+        if (queueRemoveTopic(topic))
+            queueCompacted++;
+        while (queueCount > 0 &&
+               (queueCount >= MQTTQ_MAX_ENTRIES || queueBytes + size > MQTTQ_MAX_BYTES)) {
+            queueDropOldest();
+            queueDrops++;
+        }
+        queueItem_t *item = &queue[queueIndex(queueCount)];
+        item->data = data;
+        item->size = size;
+        item->retain = retain;
+        queueCount++;
+        queueBytes += size;
+        if (queueCount > queueMaxDepth)
+            queueMaxDepth = queueCount;
+        xSemaphoreGive(queueMutex);
+    }
+    return true;
+}
+
+static bool queueReplayOne() {
+    char *data = NULL;
+    bool retain = false;
+    if (xSemaphoreTake(queueMutex, portMAX_DELAY) == pdTRUE) {
+        if (queueCount > 0) {
+            data = queue[queueHead].data;
+            retain = queue[queueHead].retain;
+            queue[queueHead].data = NULL;
+            queueBytes -= queue[queueHead].size;
+            queueHead = queueIndex(1);
+            queueCount--;
+        }
+        xSemaphoreGive(queueMutex);
+    }
+    if (data == NULL)
+        return false;
+    mqttPubPublish(data, data + strlen(data) + 1, retain);
+    free(data);
+    queueReplayed++;
+    return true;
+}
+
+void mqttPubSuperseded(const char *topic) {
+    // живая публикация новее значения в очереди, повтор старого не нужен
+    if (queueCount == 0 || queueMutex == NULL)
+        return;
+    if (xSemaphoreTake(queueMutex, portMAX_DELAY) == pdTRUE) {
+        if (queueRemoveTopic(topic))
+            queueSuperseded++;
+        xSemaphoreGive(queueMutex);
+    }
+}
+
+void mqttPubConnected() {
+    // из задачи MQTT: обход начнется заново в mqttPubTick, курсор трогает только он
+    pending = PENDING_CONNECTED;
+}
+
+void mqttPubDisconnected() {
+    // из задачи MQTT: обход останавливается в mqttPubTick
+    pending = PENDING_STOP;
+}
+
+void mqttPubConfigChanged() {
+    // под sem_busy, как и mqttPubTick: курсор указывает в прежнее дерево io.
+    // При подключенном брокере onConfigChanged сразу запускает обход заново
+    stage = STAGE_IDLE;
+    cursor = NULL;
+    cursorInputs = false;
+}
+
+void mqttPubAddInfo(cJSON *info) {
+    cJSON *jQueue = cJSON_CreateObject();
+    cJSON_AddNumberToObject(jQueue, "depth", queueCount);
+    cJSON_AddNumberToObject(jQueue, "maxDepth", queueMaxDepth);
+    cJSON_AddNumberToObject(jQueue, "bytes", queueBytes);
+    cJSON_AddNumberToObject(jQueue, "drops", queueDrops);
+    cJSON_AddNumberToObject(jQueue, "compacted", queueCompacted);
+    cJSON_AddNumberToObject(jQueue, "replayed", queueReplayed);
+    cJSON_AddNumberToObject(jQueue, "superseded", queueSuperseded);
+    cJSON_AddNumberToObject(jQueue, "replayMs", replayTimeMs);
+    cJSON_AddBoolToObject(jQueue, "retain", MQTTPublishRetained != NULL);
+    cJSON_AddItemToObject(info, "mqttQueue", jQueue);
+}
+
+static void publishItemState(cJSON *item, bool input) {
+    snprintf(topic, sizeof(topic), "%s/%s/%d/%d", devName, input ? "inputs" : "outputs",
+             itemInt(item, "slaveId", 0), itemInt(item, "id", 0));
+    bufReset();
+    bufAppend(itemIsOn(item) ? "ON" : "OFF");
+    publishBuffer();
+}
+
+static void publishItemDiscovery(cJSON *item, bool input) {
+    uint8_t slaveId = itemInt(item, "slaveId", 0);
+    uint8_t id = itemInt(item, "id", 0);
+    static cfgRef_t cfgPrefix = CFG_REF("mqtt/discoveryPrefix");
+    const char *prefix = cfgRefString(&cfgPrefix);
+    if (prefix == NULL || strlen(prefix) == 0)
+        prefix = "homeassistant";
+    char ioTopic[MQTTPUB_TOPIC_SIZE];
+    cJSON *name = cJSON_GetObjectItem(item, "name");
+    bufReset();
+    bufAppend("{\"name\":");
+    bufAppendStr(cJSON_IsString(name) ? name->valuestring : "");
+    bufAppend(",\"uniq_id\":\"%s_%d_%c%d\"", devMac, slaveId, input ? 'i' : 'o', id);
+    snprintf(ioTopic, sizeof(ioTopic), "%s/%s/%d/%d", devName, input ? "inputs" : "outputs", slaveId, id);
+    bufAppend(",\"stat_t\":");
+    bufAppendStr(ioTopic);
+    if (!input) {
+        // команды принимаются на <name>/in/<slaveId>/<output>
+        snprintf(ioTopic, sizeof(ioTopic), "%s/in/%d/%d", devName, slaveId, id);
+        bufAppend(",\"cmd_t\":");
+        bufAppendStr(ioTopic);
+    }
+    bufAppend(",\"pl_on\":\"ON\",\"pl_off\":\"OFF\",\"dev\":{\"ids\":[\"%s\"],\"name\":", devMac);
+    bufAppendStr(devName);
+    bufAppend(",\"mdl\":\"%s\",\"mf\":\"RelayController\"}}", devModel);
+    snprintf(topic, sizeof(topic), "%s/%s/%s_%d_%c%d/config", prefix,
+             input ? "binary_sensor" : "switch", devMac, slaveId, input ? 'i' : 'o', id);
+    publishBuffer();
+}
+
+static slaveState_t *slaveGet(slaveState_t *slaves, uint8_t *count, uint8_t slaveId) {
+    for (uint8_t i = 0; i < *count; i++) {
+        if (slaves[i].slaveId == slaveId)
+            return &slaves[i];
+    }
+    if (*count >= MQTTPUB_SLAVES)
+        return NULL;
+    memset(&slaves[*count], 0, sizeof(slaveState_t));
+    slaves[*count].slaveId = slaveId;
+    return &slaves[(*count)++];
+}
+
+static void appendBits(uint32_t bits, uint32_t exist) {
+    // строка, где позиция символа - id: 1 вкл, 0 выкл, - нет такого id
+    uint8_t max = 0;
+    for (uint8_t i = 0; i < MQTTPUB_MAX_ID; i++) {
+        if (exist >> i & 0x01)
+            max = i + 1;
+    }
+    bufAppend("\"");
+    for (uint8_t i = 0; i < max; i++)
+        bufAppend("%c", !(exist >> i & 0x01) ? '-' : (bits >> i & 0x01) ? '1' : '0');
+    bufAppend("\"");
+}
+
+void mqttPubSnapshot(cJSON *io) {
+    // компактный снимок всех входов/выходов, включая слейвы модбаса
+    // {"outputs":{"0":"0110","1":"00"},"inputs":{"0":"100000"}}
+    slaveState_t slaves[MQTTPUB_SLAVES];
+    uint8_t count = 0;
+    cJSON *item = NULL;
+    cJSON_ArrayForEach(item, cJSON_GetObjectItem(io, "outputs")) {
+        uint8_t id = itemInt(item, "id", 0xFF);
+        slaveState_t *slave = slaveGet(slaves, &count, itemInt(item, "slaveId", 0));
+        if (slave == NULL || id >= MQTTPUB_MAX_ID)
+            continue;
+        slave->outputsExist |= 1UL << id;
+        if (itemIsOn(item))
+            slave->outputs |= 1UL << id;
+    }
+    cJSON_ArrayForEach(item, cJSON_GetObjectItem(io, "inputs")) {
+        uint8_t id = itemInt(item, "id", 0xFF);
+        if (itemIsButton(item))
+            continue;
+        slaveState_t *slave = slaveGet(slaves, &count, itemInt(item, "slaveId", 0));
+        if (slave == NULL || id >= MQTTPUB_MAX_ID)
+            continue;
+        slave->inputsExist |= 1UL << id;
+        if (itemIsOn(item))
+            slave->inputs |= 1UL << id;
+    }
+    bufReset();
+    bufAppend("{\"outputs\":{");
+    bool first = true;
+    for (uint8_t i = 0; i < count; i++) {
+        if (!slaves[i].outputsExist)
+            continue;
+        bufAppend("%s\"%d\":", first ? "" : ",", slaves[i].slaveId);
+        appendBits(slaves[i].outputs, slaves[i].outputsExist);
+        first = false;
+    }
+    bufAppend("},\"inputs\":{");
+    first = true;
+    for (uint8_t i = 0; i < count; i++) {
+        if (!slaves[i].inputsExist)
+            continue;
+        bufAppend("%s\"%d\":", first ? "" : ",", slaves[i].slaveId);
+        appendBits(slaves[i].inputs, slaves[i].inputsExist);
+        first = false;
+    }
+    bufAppend("}}");
+    snprintf(topic, sizeof(topic), "%s/state", devName);
+    publishBuffer();
+}
+
+void mqttPubDiscovery(cJSON *io) {
+    cJSON *item = NULL;
+    cJSON_ArrayForEach(item, cJSON_GetObjectItem(io, "outputs"))
+        publishItemDiscovery(item, false);
+    cJSON_ArrayForEach(item, cJSON_GetObjectItem(io, "inputs")) {
+        if (!itemIsButton(item))
+            publishItemDiscovery(item, true);
+    }
+}
+
+static bool nextItem(cJSON *io) {
+    // обход outputs, затем inputs (без кнопок) по одному элементу за вызов
+    if (cursor != NULL) {
+        cursor = cursor->next;
+    } else if (!cursorInputs) {
+        cursor = cJSON_GetObjectItem(io, "outputs") ? cJSON_GetObjectItem(io, "outputs")->child : NULL;
+    }
+    while (true) {
+        while (cursor != NULL && cursorInputs && itemIsButton(cursor))
+            cursor = cursor->next;
+        if (cursor != NULL)
+            return true;
+        if (cursorInputs)
+            return false;
+        cursorInputs = true;
+        cursor = cJSON_GetObjectItem(io, "inputs") ? cJSON_GetObjectItem(io, "inputs")->child : NULL;
+    }
+}
+
+void mqttPubTick(cJSON *io) {
+    // вызывается из inputsTask под семафором, поэтому IOConfig не меняется во время обхода.
+    // за один тик отправляется не больше MQTTPUB_PER_TICK сообщений
+    uint8_t event = pending;
+    if (event != PENDING_NONE) {
+        pending = PENDING_NONE;
+        stage = event == PENDING_CONNECTED ? STAGE_QUEUE : STAGE_IDLE;
+        cursor = NULL;
+        cursorInputs = false;
+        replayStart = esp_timer_get_time();
+    }
+    if (stage == STAGE_IDLE || !cJSON_IsObject(io))
+        return;
+    if (stage == STAGE_QUEUE) {
+        for (uint8_t sent = 0; sent < MQTTQ_PER_TICK; sent++) {
+            if (!queueReplayOne()) {
+                replayTimeMs = (esp_timer_get_time() - replayStart) / 1000;
+                if (queueReplayed)
+                    ESP_LOGI(TAG, "Offline queue replayed in %d ms", replayTimeMs);
+                static cfgRef_t cfgDiscovery = CFG_REF("mqtt/discovery");
+                stage = cfgRefBool(&cfgDiscovery) ? STAGE_DISCOVERY : STAGE_STATES;
+                break;
+            }
+        }
+        return;
+    }
+    for (uint8_t sent = 0; sent < MQTTPUB_PER_TICK; sent++) {
+        if (stage == STAGE_SNAPSHOT) {
+            mqttPubSnapshot(io);
+            ESP_LOGI(TAG, "States published");
+            stage = STAGE_IDLE;
+            return;
+        }
+        if (!nextItem(io)) {
+            // следующий этап
+            stage = stage == STAGE_DISCOVERY ? STAGE_STATES : STAGE_SNAPSHOT;
+            cursor = NULL;
+            cursorInputs = false;
+            continue;
+        }
+        if (stage == STAGE_DISCOVERY)
+            publishItemDiscovery(cursor, cursorInputs);
+        else
+            publishItemState(cursor, cursorInputs);
+    }
+}
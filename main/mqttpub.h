@@ -0,0 +1,16 @@
+#pragma once
+#include <stdbool.h>
+#include "cJSON.h"
+
+void mqttPubInit(bool enabled);
+void mqttPubPublish(const char *topic, const char *data, bool retain);
+bool mqttPubQueue(const char *topic, const char *value, bool retain);
+void mqttPubAddInfo(cJSON *info);
+void mqttPubSetIdentity(const char *name, const char *mac, const char *model);
+void mqttPubSuperseded(const char *topic);
+void mqttPubConnected();
+void mqttPubDisconnected();
+void mqttPubConfigChanged();
+void mqttPubTick(cJSON *io);
+void mqttPubSnapshot(cJSON *io);
+void mqttPubDiscovery(cJSON *io);
@@ -0,0 +1,510 @@
+#include <stdio.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_attr.h"
+#include "driver/gpio.h"
+#include "driver/pcnt.h"
+#include "nvs.h"
+#include "cJSON.h"
+#include "config.h"
+#include "tasks.h"
+#include "hardware.h"
+#include "pulse.h"
+
+// Счетчики PCNT идут до PULSE_PCNT_LIMIT и сами сбрасываются в 0, задача раз в
+// PULSE_PCNT_MS берет разницу по модулю - прерывания переполнения не нужны, пока
+// за период меньше PULSE_PCNT_LIMIT импульсов (327 кГц).
+// Программный счет только на платах с PCF8574: чтение идет через очередь шины,
+// а 74HC165 на RCV1 делит выводы с 595 и читается только из inputsTask.
+// Частота - импульсы за окно не короче секунды; при редких импульсах окно растет
+// до PULSE_RATE_MIN импульсов или PULSE_WINDOW_MAX_MS.
+// При смене конфига набор входов собирается заново под lock: итоги сохраняются
+// в NVS и подхватываются новым набором по id, задача пересчитывает период опроса.
+
+#define PULSE_MAX               8
+#define PULSE_PCNT_LIMIT        32767
+#define PULSE_PCNT_MS           100
+#define PULSE_RATE_MS           1000
+#define PULSE_RATE_MIN          4
+#define PULSE_WINDOW_MAX_MS     60000
+#define PULSE_FILTER_MAX        1023    // такты APB 80 МГц, 12.7 мкс
+#define PULSE_DEF_FILTER_US     10
+#define PULSE_DEF_SAVE_SEC      600
+#define PULSE_EVENTS            16
+#define PULSE_MAGIC             0x31534C50  // "PLS1"
+#define PULSE_NO_GPIO           0xFF
+
+static const char *TAG = "PULSE";
+
+enum pulseEdges {
+    PULSE_EDGE_FALLING = 0,
+    PULSE_EDGE_RISING,
+    PULSE_EDGE_BOTH
+};
+
+typedef struct {
+    uint8_t id;
+    uint8_t gpio;               // PULSE_NO_GPIO - вход расширителя
+    uint8_t raw;                // бит в прочитанных портах
+    uint8_t edge;               // pulseEdges
+    uint8_t unit;               // PCNT
+    int16_t last;               // прошлое показание PCNT
+    double factor;
+    double rateAbove;           // 0 - нет
+    double rateBelow;
+    uint32_t every;
+    uint64_t total;
+    uint64_t nextEvery;
+    double hz;
+    bool high;
+    bool low;
+    uint64_t windowStart;       // total в начале окна
+    int64_t windowTime;
+} pulseInput_t;
+
+typedef struct {
+    uint8_t id;
+    const char *event;
+} pulseEvent_t;
+
+typedef struct {
+    uint32_t magic;
+    uint8_t count;
+    uint8_t ids[PULSE_MAX];
+    uint64_t totals[PULSE_MAX];
+} pulseBlob_t;
+
+static pulseInput_t inputs[PULSE_MAX];
+static uint8_t inputsCount = 0;
+static uint8_t softCount = 0;
+static uint8_t portBytes = 0;
+static uint8_t ports[BINPUTS];
+static int8_t intGpio = -1;
+static int8_t attachedGpio = -1;        // INT, на котором висит обработчик
+static uint8_t unitsUsed = 0;
+static bool softFirst = true;           // первое чтение портов только запоминает уровни
+static uint16_t saveSec = PULSE_DEF_SAVE_SEC;
+static uint64_t savedSum = 0;
+static TaskHandle_t task = NULL;
+static SemaphoreHandle_t lock = NULL;   // inputs[] между pulseTask и pulseInit
+static StaticSemaphore_t lockBuffer;
+static QueueHandle_t events = NULL;
+static StaticQueue_t eventsBuffer;
+static uint8_t eventsStorage[PULSE_EVENTS * sizeof(pulseEvent_t)];
+static portMUX_TYPE pulseMux = portMUX_INITIALIZER_UNLOCKED;
+
+static struct {
+    uint32_t irqs;
+    uint32_t portReads;
+    uint32_t maxReadUs;
+    uint32_t eventsLost;
+    uint32_t saves;
+    uint32_t lastSaveUs;
+    uint32_t saveErrors;
+} stats;
+
+static void IRAM_ATTR intHandler(void *arg) {
+    // INT расширителей: линия держится до чтения порта
+    BaseType_t woken = pdFALSE;
+    stats.irqs++;
+    vTaskNotifyGiveFromISR(task, &woken);
+    if (woken == pdTRUE)
+        portYIELD_FROM_ISR();
+}
+
+static uint8_t edgeMode(const char *text) {
+    if (text != NULL && !strcmp(text, "rising"))
+        return PULSE_EDGE_RISING;
+    if (text != NULL && !strcmp(text, "both"))
+        return PULSE_EDGE_BOTH;
+    return PULSE_EDGE_FALLING;
+}
+
+static double numberOr(cJSON *item, const char *name, double def) {
+    cJSON *jValue = cJSON_GetObjectItem(item, name);
+    return cJSON_IsNumber(jValue) && jValue->valuedouble >= 0 ? jValue->valuedouble : def;
+}
+
+static bool initUnit(pulseInput_t *p, uint8_t unit, uint32_t filterUs) {
+    pcnt_config_t cfg = {
+        .pulse_gpio_num = p->gpio,
+        .ctrl_gpio_num = PCNT_PIN_NOT_USED,
+        .lctrl_mode = PCNT_MODE_KEEP,
+        .hctrl_mode = PCNT_MODE_KEEP,
+        .pos_mode = p->edge != PULSE_EDGE_FALLING ? PCNT_COUNT_INC : PCNT_COUNT_DIS,
+        .neg_mode = p->edge != PULSE_EDGE_RISING ? PCNT_COUNT_INC : PCNT_COUNT_DIS,
+        .counter_h_lim = PULSE_PCNT_LIMIT,
+        .counter_l_lim = 0,
+        .unit = unit,
+        .channel = PCNT_CHANNEL_0,
+    };
+    if (pcnt_unit_config(&cfg) != ESP_OK)
+        return false;
+    uint32_t filter = filterUs * 80;
+    if (filter > 0) {
+        pcnt_set_filter_value(unit, filter > PULSE_FILTER_MAX ? PULSE_FILTER_MAX : filter);
+        pcnt_filter_enable(unit);
+    }
+    pcnt_counter_pause(unit);
+    pcnt_counter_clear(unit);
+    pcnt_counter_resume(unit);
+    p->unit = unit;
+    p->last = 0;
+    return true;
+}
+
+static void loadTotals() {
+    pulseBlob_t blob;
+    size_t len = sizeof(blob);
+    nvs_handle_t nvs;
+    esp_err_t err = ESP_FAIL;
+    if (nvs_open("hw", NVS_READONLY, &nvs) == ESP_OK) {
+        err = nvs_get_blob(nvs, "pulse", &blob, &len);
+        nvs_close(nvs);
+    }
+    if (err != ESP_OK || len != sizeof(blob) || blob.magic != PULSE_MAGIC)
+        return;
+    for (uint8_t i = 0; i < inputsCount; i++) {
+        for (uint8_t j = 0; j < blob.count && j < PULSE_MAX; j++) {
+            if (blob.ids[j] == inputs[i].id)
+                inputs[i].total = blob.totals[j];
+        }
+        savedSum += inputs[i].total;
+    }
+}
+
+static void saveLocked() {
+    if (inputsCount == 0)
+        return;
+    pulseBlob_t blob = {.magic = PULSE_MAGIC, .count = inputsCount};
+    uint64_t sum = 0;
+    portENTER_CRITICAL(&pulseMux);
+    for (uint8_t i = 0; i < inputsCount; i++) {
+        blob.ids[i] = inputs[i].id;
+        blob.totals[i] = inputs[i].total;
+        sum += inputs[i].total;
+    }
+    portEXIT_CRITICAL(&pulseMux);
+    if (sum == savedSum)
+        return;
+    int64_t start = esp_timer_get_time();
+    nvs_handle_t nvs;
+    esp_err_t err = nvs_open("hw", NVS_READWRITE, &nvs);
+    if (err == ESP_OK) {
+        err = nvs_set_blob(nvs, "pulse", &blob, sizeof(blob));
+        if (err == ESP_OK)
+            err = nvs_commit(nvs);
+        nvs_close(nvs);
+    }
+    stats.lastSaveUs = esp_timer_get_time() - start;
+    if (err != ESP_OK) {
+        stats.saveErrors++;
+        ESP_LOGE(TAG, "Can't save totals: %s", esp_err_to_name(err));
+        return;
+    }
+    savedSum = sum;
+    stats.saves++;
+}
+
+void pulseInit(cJSON *io, uint8_t inputBytes, pulseInputMap_t mapInput) {
+    // при старте и после замены конфига (под sem_busy)
+    if (lock == NULL) {
+        lock = xSemaphoreCreateMutexStatic(&lockBuffer);
+        events = xQueueCreateStatic(PULSE_EVENTS, sizeof(pulseEvent_t), eventsStorage, &eventsBuffer);
+    }
+    xSemaphoreTake(lock, portMAX_DELAY);
+    // итоги прежнего набора - в NVS, оттуда новый набор возьмет их по id
+    saveLocked();
+    for (uint8_t u = 0; u < unitsUsed; u++) {
+        pcnt_counter_pause(u);
+        pcnt_counter_clear(u);
+    }
+    unitsUsed = 0;
+    inputsCount = 0;
+    softCount = 0;
+    savedSum = 0;
+    softFirst = true;
+    intGpio = -1;
+    cJSON *jInputs = cJSON_GetObjectItem(io, "inputs");
+    if (!cJSON_IsArray(jInputs))
+        jInputs = NULL;
+    bool expanders = controllerType == RCV2S || controllerType == RCV2B || controllerType == RCV2M;
+    uint32_t filterUs = PULSE_DEF_FILTER_US;
+    uint8_t unit = PCNT_UNIT_0;
+    cJSON *jInput = NULL;
+    cJSON_ArrayForEach(jInput, jInputs) {
+        cJSON *jType = cJSON_GetObjectItem(jInput, "type");
+        cJSON *jId = cJSON_GetObjectItem(jInput, "id");
+        if (!cJSON_IsString(jType) || strcmp(jType->valuestring, "PULSE") || !cJSON_IsNumber(jId))
+            continue;
+        if (inputsCount >= PULSE_MAX) {
+            ESP_LOGW(TAG, "Too many pulse inputs, %d ignored", jId->valueint);
+            continue;
+        }
+        pulseInput_t *p = &inputs[inputsCount];
+        memset(p, 0, sizeof(pulseInput_t));
+        p->id = jId->valueint;
+        p->edge = edgeMode(cJSON_IsString(cJSON_GetObjectItem(jInput, "edge")) ?
+                           cJSON_GetObjectItem(jInput, "edge")->valuestring : NULL);
+        p->factor = numberOr(jInput, "factor", 1);
+        if (p->factor == 0)
+            p->factor = 1;
+        p->rateAbove = numberOr(jInput, "rateAbove", 0);
+        p->rateBelow = numberOr(jInput, "rateBelow", 0);
+        p->every = numberOr(jInput, "every", 0);
+        p->gpio = numberOr(jInput, "gpio", PULSE_NO_GPIO);
+        filterUs = numberOr(jInput, "filterUs", PULSE_DEF_FILTER_US);
+        if (p->gpio != PULSE_NO_GPIO) {
+            if (unit >= PCNT_UNIT_MAX || !initUnit(p, unit, filterUs)) {
+                ESP_LOGE(TAG, "Can't init PCNT for input %d, gpio %d", p->id, p->gpio);
+                continue;
+            }
+            unit++;
+        } else {
+            // бит расширителя, который inputsTask отдал бы этому входу
+            p->raw = 0xFF;
+            for (uint8_t raw = 0; raw < inputBytes * 8 && expanders; raw++) {
+                if (mapInput(raw) == p->id) {
+                    p->raw = raw;
+                    break;
+                }
+            }
+            if (p->raw == 0xFF) {
+                ESP_LOGE(TAG, "Input %d: no gpio and no expander input", p->id);
+                continue;
+            }
+            softCount++;
+        }
+        inputsCount++;
+    }
+    unitsUsed = unit;
+    if (inputsCount > 0) {
+        portBytes = inputBytes;
+        int value = getConfigValueInt("pulse/saveSec");
+        saveSec = value > 0 ? value : PULSE_DEF_SAVE_SEC;
+        if (softCount > 0 && cJSON_IsNumber(getConfigValueObject("pulse/intGpio")))
+            intGpio = getConfigValueInt("pulse/intGpio");
+        loadTotals();
+        int64_t now = esp_timer_get_time();
+        for (uint8_t i = 0; i < inputsCount; i++)
+            inputs[i].windowTime = now;
+    }
+    xSemaphoreGive(lock);
+    ESP_LOGI(TAG, "%d pulse inputs, %d on expanders, int gpio %d", inputsCount, softCount, intGpio);
+}
+
+static void addEvent(uint8_t id, const char *event) {
+    pulseEvent_t ev = {.id = id, .event = event};
+    if (xQueueSend(events, &ev, 0) != pdTRUE)
+        stats.eventsLost++;
+}
+
+static void countPulses(pulseInput_t *p, uint32_t count) {
+    portENTER_CRITICAL(&pulseMux);
+    p->total += count;
+    portEXIT_CRITICAL(&pulseMux);
+    if (p->every == 0)
+        return;
+    if (p->nextEvery == 0)
+        p->nextEvery = (p->total / p->every + 1) * p->every;
+    if (p->total >= p->nextEvery) {
+        p->nextEvery = (p->total / p->every + 1) * p->every;
+        addEvent(p->id, "count");
+    }
+}
+
+static void readSoft() {
+    // прошлое состояние портов
+    static uint8_t old[BINPUTS];
+    int64_t start = esp_timer_get_time();
+    readInputs(ports, portBytes);
+    uint32_t us = esp_timer_get_time() - start;
+    if (us > stats.maxReadUs)
+        stats.maxReadUs = us;
+    stats.portReads++;
+    for (uint8_t i = 0; i < inputsCount && !softFirst; i++) {
+        pulseInput_t *p = &inputs[i];
+        if (p->gpio != PULSE_NO_GPIO)
+            continue;
+        bool level = ports[p->raw / 8] >> (p->raw % 8) & 0x01;
+        bool was = old[p->raw / 8] >> (p->raw % 8) & 0x01;
+        if (level == was)
+            continue;
+        if (p->edge == PULSE_EDGE_BOTH || (p->edge == PULSE_EDGE_RISING) == level)
+            countPulses(p, 1);
+    }
+    memcpy(old, ports, portBytes);
+    softFirst = false;
+}
+
+static void readUnits() {
+    for (uint8_t i = 0; i < inputsCount; i++) {
+        pulseInput_t *p = &inputs[i];
+        int16_t value;
+        if (p->gpio == PULSE_NO_GPIO || pcnt_get_counter_value(p->unit, &value) != ESP_OK)
+            continue;
+        uint32_t count = (value - p->last + PULSE_PCNT_LIMIT) % PULSE_PCNT_LIMIT;
+        p->last = value;
+        if (count > 0)
+            countPulses(p, count);
+    }
+}
+
+static void updateRates(int64_t now) {
+    for (uint8_t i = 0; i < inputsCount; i++) {
+        pulseInput_t *p = &inputs[i];
+        uint64_t count = p->total - p->windowStart;
+        int64_t ms = (now - p->windowTime) / 1000;
+        // после pulseInit окно начинается заново и не совпадает с lastRate:
+        // короткое окно дает ложные rateHigh/rateLow, ждем следующего прохода
+        if (ms < PULSE_RATE_MS)
+            continue;
+        if (count < PULSE_RATE_MIN && ms < PULSE_WINDOW_MAX_MS)
+            continue;
+        double hz = count * 1000.0 / ms;
+        portENTER_CRITICAL(&pulseMux);
+        p->hz = hz;
+        portEXIT_CRITICAL(&pulseMux);
+        p->windowStart = p->total;
+        p->windowTime = now;
+        // по одному событию на переход порога
+        if (p->rateAbove > 0) {
+            if (!p->high && hz > p->rateAbove)
+                addEvent(p->id, "rateHigh");
+            p->high = hz > p->rateAbove;
+        }
+        if (p->rateBelow > 0) {
+            if (!p->low && hz < p->rateBelow)
+                addEvent(p->id, "rateLow");
+            p->low = hz < p->rateBelow;
+        }
+    }
+}
+
+void pulseSave() {
+    if (lock == NULL)
+        return;
+    xSemaphoreTake(lock, portMAX_DELAY);
+    saveLocked();
+    xSemaphoreGive(lock);
+}
+
+static void pulseTask(void *pvParameter) {
+    int64_t now = esp_timer_get_time();
+    int64_t lastUnits = now;
+    int64_t lastRate = now;
+    int64_t lastSave = now;
+    while (1) {
+        // порты опрашиваются только при входах на расширителях: без INT каждый тик,
+        // с INT - по прерыванию и раз в PULSE_PCNT_MS на случай пропущенного фронта.
+        // Без счетных входов задача спит до следующего pulseStart
+        TickType_t wait = (softCount > 0 && intGpio < 0 ? 1 : PULSE_PCNT_MS) / portTICK_RATE_MS;
+        if (wait == 0)
+            wait = 1;
+        ulTaskNotifyTake(pdTRUE, inputsCount > 0 ? wait : portMAX_DELAY);
+        xSemaphoreTake(lock, portMAX_DELAY);
+        if (softCount > 0)
+            readSoft();
+        now = esp_timer_get_time();
+        if (now - lastUnits >= PULSE_PCNT_MS * 1000) {
+            lastUnits = now;
+            readUnits();
+        }
+        if (now - lastRate >= PULSE_RATE_MS * 1000) {
+            lastRate = now;
+            updateRates(now);
+        }
+        if (now - lastSave >= (int64_t)saveSec * 1000000) {
+            lastSave = now;
+            saveLocked();
+        }
+        xSemaphoreGive(lock);
+    }
+}
+
+void pulseStart() {
+    // после каждого pulseInit: задача создается при первом счетном входе,
+    // дальше только будится пересчитать период, INT перевешивается при смене
+    if (lock == NULL)
+        return;
+    if (task == NULL && inputsCount > 0)
+        task = taskStart(TASK_PULSE, &pulseTask, NULL);
+    if (task == NULL)
+        return;
+    xSemaphoreTake(lock, portMAX_DELAY);
+    if (attachedGpio != intGpio) {
+        if (attachedGpio >= 0) {
+            gpio_isr_handler_remove(attachedGpio);
+            attachedGpio = -1;
+        }
+        if (intGpio >= 0) {
+            // INT PCF8574 - открытый сток, активный ноль
+            gpio_pad_select_gpio(intGpio);
+            gpio_set_direction(intGpio, GPIO_MODE_INPUT);
+            gpio_set_pull_mode(intGpio, GPIO_PULLUP_ONLY);
+            gpio_set_intr_type(intGpio, GPIO_INTR_NEGEDGE);
+            esp_err_t err = gpio_install_isr_service(0);
+            if (err == ESP_OK || err == ESP_ERR_INVALID_STATE)
+                err = gpio_isr_handler_add(intGpio, &intHandler, NULL);
+            if (err != ESP_OK) {
+                ESP_LOGE(TAG, "Can't attach INT on gpio %d, polling", intGpio);
+                intGpio = -1;
+            } else {
+                attachedGpio = intGpio;
+            }
+        }
+    }
+    xSemaphoreGive(lock);
+    xTaskNotifyGive(task);
+}
+
+bool pulseNextEvent(uint8_t *id, const char **event) {
+    // из inputsTask под семафором
+    pulseEvent_t ev;
+    if (events == NULL || xQueueReceive(events, &ev, 0) != pdTRUE)
+        return false;
+    *id = ev.id;
+    *event = ev.event;
+    return true;
+}
+
+void pulseAddInfo(cJSON *info) {
+    if (lock == NULL)
+        return;
+    xSemaphoreTake(lock, portMAX_DELAY);
+    if (inputsCount == 0) {
+        xSemaphoreGive(lock);
+        return;
+    }
+    cJSON *jPulse = cJSON_CreateObject();
+    cJSON_AddNumberToObject(jPulse, "intGpio", intGpio);
+    cJSON_AddNumberToObject(jPulse, "irqs", stats.irqs);
+    cJSON_AddNumberToObject(jPulse, "portReads", stats.portReads);
+    cJSON_AddNumberToObject(jPulse, "maxReadUs", stats.maxReadUs);
+    cJSON_AddNumberToObject(jPulse, "eventsLost", stats.eventsLost);
+    cJSON_AddNumberToObject(jPulse, "saves", stats.saves);
+    cJSON_AddNumberToObject(jPulse, "lastSaveUs", stats.lastSaveUs);
+    cJSON_AddNumberToObject(jPulse, "saveErrors", stats.saveErrors);
+    cJSON *jList = cJSON_AddArrayToObject(jPulse, "inputs");
+    for (uint8_t i = 0; i < inputsCount; i++) {
+        portENTER_CRITICAL(&pulseMux);
+        uint64_t total = inputs[i].total;
+        double hz = inputs[i].hz;
+        portEXIT_CRITICAL(&pulseMux);
+        cJSON *jInput = cJSON_CreateObject();
+        cJSON_AddNumberToObject(jInput, "id", inputs[i].id);
+        cJSON_AddStringToObject(jInput, "source", inputs[i].gpio != PULSE_NO_GPIO ? "pcnt" : "expander");
+        cJSON_AddNumberToObject(jInput, "total", total);
+        cJSON_AddNumberToObject(jInput, "value", total / inputs[i].factor);
+        cJSON_AddNumberToObject(jInput, "hz", hz);
+        cJSON_AddNumberToObject(jInput, "perHour", hz * 3600 / inputs[i].factor);
+        cJSON_AddItemToArray(jList, jInput);
+    }
+    xSemaphoreGive(lock);
+    cJSON_AddItemToObject(info, "pulse", jPulse);
+}
@@ -0,0 +1,25 @@
+#pragma once
+#include "cJSON.h"
+
+// Счетные входы (счетчики воды, электроэнергии с импульсным выходом).
+// Вход io.inputs с "type": "PULSE":
+// {"id": 20, "type": "PULSE", "gpio": 35, "edge": "falling", "filterUs": 10,
+//  "factor": 1000, "rateAbove": 50, "rateBelow": 5, "every": 1000}
+// С "gpio" - аппаратный счетчик PCNT, частоты до сотен кГц, задача только
+// снимает показания. Без "gpio" - вход расширителя с тем же id, импульсы
+// считаются программно по чтению портов: по прерыванию INT расширителей
+// (config pulse/intGpio) до сотен Гц, без него опросом раз в тик - до десятков Гц.
+// Частота в импульсах в секунду, value = total / factor.
+// События в processInputEvents: rateHigh/rateLow при переходе порогов частоты,
+// count - каждые every импульсов. Итоги в NVS раз в pulse/saveSec и перед
+// перезагрузкой, при пропадании питания теряются импульсы с последней записи.
+// pulseInit + pulseStart повторяются после смены конфига: итоги входов с тем же
+// id сохраняются, порты опрашиваются, только пока есть входы без "gpio".
+
+typedef uint8_t (*pulseInputMap_t)(uint8_t raw);
+
+void pulseInit(cJSON *io, uint8_t inputBytes, pulseInputMap_t mapInput);
+void pulseStart();
+bool pulseNextEvent(uint8_t *id, const char **event);
+void pulseSave();
+void pulseAddInfo(cJSON *info);
@@ -0,0 +1,430 @@
+#include <stdio.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "cJSON.h"
+#include "config.h"
+#include "utils.h"
+#include "tasks.h"
+#include "i2cbus.h"
+#include "history.h"
+#include "sensors.h"
+
+// Опрос идет в своей задаче с низким приоритетом: пока идет преобразование
+// (750 мс при 12 битах) задача спит, шина свободна. Команды 1-Wire уходят пачками
+// по I2C_BATCH_SIZE, поиск ROM - по одной, т.к. направление зависит от ответа.
+// После SENSORS_ERRORS ошибок подряд у датчика или пропажи присутствия - новый поиск.
+
+#define SENSORS_MAX             16
+#define SENSORS_RING            256
+#define SENSORS_ERRORS          3
+#define SENSORS_CONVERT_MS      750
+#define SENSORS_DEF_PERIOD      10
+#define SENSORS_MIN_PERIOD      2
+#define SENSORS_STALE_PERIODS   3       // показание старше - условие не выполнено
+
+#define DS18B20_FAMILY          0x28
+#define DS18B20_POWER_ON        0x0550  // 85 градусов, преобразования еще не было
+#define OW_SEARCH_ROM           0xF0
+#define OW_MATCH_ROM            0x55
+#define OW_SKIP_ROM             0xCC
+#define DS18B20_CONVERT         0x44
+#define DS18B20_READ            0xBE
+
+static const char *TAG = "SENSORS";
+
+typedef struct {
+    uint8_t rom[8];
+    uint8_t id;
+    int16_t raw;                // 1/16 градуса
+    bool valid;
+    int64_t time;
+    uint8_t errorsInRow;
+    uint32_t errors;
+} sensor_t;
+
+typedef struct {
+    uint32_t time;              // секунды от загрузки
+    uint8_t id;
+    int16_t raw;
+} sensorSample_t;
+
+typedef struct {
+    uint8_t rom[8];
+    uint8_t id;
+} sensorBinding_t;
+
+static i2c_dev_t *bridge = NULL;
+static uint16_t period = SENSORS_DEF_PERIOD;
+static sensor_t sensors[SENSORS_MAX];
+static uint8_t sensorsCount = 0;
+static sensorBinding_t bindings[SENSORS_MAX];
+static uint8_t bindingsCount = 0;
+static bool searchNeeded = true;
+static sensorSample_t ring[SENSORS_RING];
+static uint16_t ringHead = 0;
+static uint16_t ringCount = 0;
+static portMUX_TYPE sensorsMux = portMUX_INITIALIZER_UNLOCKED;
+
+static struct {
+    uint32_t cycles;
+    uint32_t searches;
+    uint32_t reads;
+    uint32_t crcErrors;
+    uint32_t noPresence;
+    uint32_t busErrors;
+    uint32_t shorts;
+    uint32_t lastCycleMs;       // без ожидания преобразования
+} stats;
+
+static bool parseRom(const char *text, uint8_t *rom) {
+    if (text == NULL || strlen(text) != 16)
+        return false;
+    for (uint8_t i = 0; i < 8; i++) {
+        unsigned int byte;
+        if (sscanf(&text[i * 2], "%2x", &byte) != 1)
+            return false;
+        rom[i] = byte;
+    }
+    return true;
+}
+
+static void romText(const uint8_t *rom, char *text) {
+    for (uint8_t i = 0; i < 8; i++)
+        sprintf(&text[i * 2], "%02x", rom[i]);
+}
+
+static esp_err_t owRun(owCmd_t *cmds, uint8_t count) {
+    // пачками через очередь шины, результаты обратно в cmds
+    i2cTrans_t trans[I2C_BATCH_SIZE];
+    for (uint8_t i = 0; i < count; i += I2C_BATCH_SIZE) {
+        uint8_t n = count - i < I2C_BATCH_SIZE ? count - i : I2C_BATCH_SIZE;
+        for (uint8_t j = 0; j < n; j++) {
+            memset(&trans[j], 0, sizeof(i2cTrans_t));
+            trans[j].op = I2C_OP_OW;
+            trans[j].dev = bridge;
+            trans[j].ow = cmds[i + j];
+        }
+        esp_err_t err = i2cBusSubmit(trans, n, 0);
+        for (uint8_t j = 0; j < n; j++)
+            cmds[i + j] = trans[j].ow;
+        if (err != ESP_OK) {
+            stats.busErrors++;
+            return err;
+        }
+    }
+    return ESP_OK;
+}
+
+static bool owPresence(const owCmd_t *reset) {
+    if (reset->status & DS2484_STATUS_SD) {
+        stats.shorts++;
+        return false;
+    }
+    if (!(reset->status & DS2484_STATUS_PPD)) {
+        stats.noPresence++;
+        return false;
+    }
+    return true;
+}
+
+static uint8_t freeId(const sensor_t *list, uint8_t count) {
+    for (uint8_t id = 1; id < 255; id++) {
+        bool used = false;
+        for (uint8_t i = 0; i < bindingsCount && !used; i++)
+            used = bindings[i].id == id;
+        for (uint8_t i = 0; i < count && !used; i++)
+            used = list[i].id == id;
+        if (!used)
+            return id;
+    }
+    return 0;
+}
+
+static void addFound(sensor_t *list, uint8_t *count, const uint8_t *rom) {
+    sensor_t *s = &list[*count];
+    memset(s, 0, sizeof(sensor_t));
+    memcpy(s->rom, rom, 8);
+    for (uint8_t i = 0; i < bindingsCount; i++) {
+        if (!memcmp(bindings[i].rom, rom, 8))
+            s->id = bindings[i].id;
+    }
+    if (s->id == 0)
+        s->id = freeId(list, *count);
+    // показания уже известных датчиков сохраняются
+    for (uint8_t i = 0; i < sensorsCount; i++) {
+        if (!memcmp(sensors[i].rom, rom, 8)) {
+            s->raw = sensors[i].raw;
+            s->valid = sensors[i].valid;
+            s->time = sensors[i].time;
+            s->errors = sensors[i].errors;
+        }
+    }
+    (*count)++;
+}
+
+static void search() {
+    // поиск ROM через триплеты DS2484
+    sensor_t found[SENSORS_MAX];
+    uint8_t count = 0;
+    uint8_t rom[8] = {0};
+    int8_t lastDiscrepancy = -1;
+    bool lastDevice = false;
+    stats.searches++;
+    while (!lastDevice && count < SENSORS_MAX) {
+        owCmd_t start[2] = {{.cmd = OW_RESET}, {.cmd = OW_WRITE, .arg = OW_SEARCH_ROM}};
+        if (owRun(start, 2) != ESP_OK || !owPresence(&start[0]))
+            break;
+        int8_t lastZero = -1;
+        bool failed = false;
+        for (uint8_t bit = 0; bit < 64; bit++) {
+            bool current = (rom[bit / 8] >> (bit % 8)) & 0x01;
+            owCmd_t triplet = {
+                .cmd = OW_TRIPLET,
+                .arg = bit < lastDiscrepancy ? current : bit == lastDiscrepancy
+            };
+            if (owRun(&triplet, 1) != ESP_OK ||
+                ((triplet.status & DS2484_STATUS_SBR) && (triplet.status & DS2484_STATUS_TSB))) {
+                // никто не ответил - устройство пропало посреди поиска
+                failed = true;
+                break;
+            }
+            bool taken = triplet.status & DS2484_STATUS_DIR;
+            if (!(triplet.status & (DS2484_STATUS_SBR | DS2484_STATUS_TSB)) && !taken)
+                lastZero = bit;
+            if (taken)
+                rom[bit / 8] |= 1 << (bit % 8);
+            else
+                rom[bit / 8] &= ~(1 << (bit % 8));
+        }
+        if (failed)
+            break;
+        lastDiscrepancy = lastZero;
+        lastDevice = lastDiscrepancy < 0;
+        if (owCrc8(rom, 7) != rom[7]) {
+            stats.crcErrors++;
+            break;
+        }
+        if (rom[0] == DS18B20_FAMILY)
+            addFound(found, &count, rom);
+        else
+            ESP_LOGW(TAG, "Skip 1-Wire device family 0x%02x", rom[0]);
+    }
+    portENTER_CRITICAL(&sensorsMux);
+    memcpy(sensors, found, count * sizeof(sensor_t));
+    sensorsCount = count;
+    portEXIT_CRITICAL(&sensorsMux);
+    // прерванный поиск повторяется в следующем цикле
+    searchNeeded = !lastDevice && count < SENSORS_MAX;
+    ESP_LOGI(TAG, "Search done, %d sensors", count);
+}
+
+static bool convertAll() {
+    // одна команда на все датчики
+    owCmd_t cmds[3] = {
+        {.cmd = OW_RESET},
+        {.cmd = OW_WRITE, .arg = OW_SKIP_ROM},
+        {.cmd = OW_WRITE, .arg = DS18B20_CONVERT}
+    };
+    if (owRun(cmds, 3) != ESP_OK)
+        return false;
+    if (!owPresence(&cmds[0])) {
+        searchNeeded = true;
+        return false;
+    }
+    return true;
+}
+
+static void ringAdd(uint8_t id, int16_t raw) {
+    // под sensorsMux
+    ring[ringHead].time = getUpTimeRaw();
+    ring[ringHead].id = id;
+    ring[ringHead].raw = raw;
+    ringHead = (ringHead + 1) % SENSORS_RING;
+    if (ringCount < SENSORS_RING)
+        ringCount++;
+}
+
+static void readSensor(uint8_t n) {
+    owCmd_t cmds[20];
+    memset(cmds, 0, sizeof(cmds));
+    cmds[0].cmd = OW_RESET;
+    cmds[1].cmd = OW_WRITE;
+    cmds[1].arg = OW_MATCH_ROM;
+    for (uint8_t i = 0; i < 8; i++) {
+        cmds[2 + i].cmd = OW_WRITE;
+        cmds[2 + i].arg = sensors[n].rom[i];
+    }
+    cmds[10].cmd = OW_WRITE;
+    cmds[10].arg = DS18B20_READ;
+    for (uint8_t i = 0; i < 9; i++)
+        cmds[11 + i].cmd = OW_READ;
+    bool ok = owRun(cmds, 20) == ESP_OK && owPresence(&cmds[0]);
+    uint8_t data[9];
+    for (uint8_t i = 0; i < 9; i++)
+        data[i] = cmds[11 + i].data;
+    if (ok && owCrc8(data, 8) != data[8]) {
+        stats.crcErrors++;
+        ok = false;
+    }
+    stats.reads++;
+    int16_t raw = data[0] | (data[1] << 8);
+    bool changed = false;
+    portENTER_CRITICAL(&sensorsMux);
+    sensor_t *s = &sensors[n];
+    if (!ok) {
+        s->errors++;
+        if (++s->errorsInRow >= SENSORS_ERRORS)
+            searchNeeded = true;
+    } else if (raw != DS18B20_POWER_ON || s->valid) {
+        // 85 сразу после включения - преобразование не успело, не показание
+        changed = !s->valid || s->raw != raw;
+        s->errorsInRow = 0;
+        s->raw = raw;
+        s->valid = true;
+        s->time = esp_timer_get_time();
+        ringAdd(s->id, raw);
+    }
+    portEXIT_CRITICAL(&sensorsMux);
+    // во флеш только изменения
+    if (changed)
+        historyAddSensor(sensors[n].id, raw);
+}
+
+static void sensorsTask(void *pvParameter) {
+    TickType_t lastWake = xTaskGetTickCount();
+    while (1) {
+        stats.cycles++;
+        if (searchNeeded)
+            search();
+        if (sensorsCount > 0 && convertAll()) {
+            vTaskDelay(SENSORS_CONVERT_MS / portTICK_RATE_MS);
+            int64_t start = esp_timer_get_time();
+            for (uint8_t i = 0; i < sensorsCount; i++)
+                readSensor(i);
+            stats.lastCycleMs = (esp_timer_get_time() - start) / 1000;
+        } else if (sensorsCount == 0) {
+            searchNeeded = true;
+        }
+        vTaskDelayUntil(&lastWake, period * 1000 / portTICK_RATE_MS);
+    }
+}
+
+void sensorsInit(i2c_dev_t *dev) {
+    bridge = dev;
+    if (bridge == NULL)
+        return;
+    int value = getConfigValueInt("sensors/periodSec");
+    if (value > 0)
+        period = value < SENSORS_MIN_PERIOD ? SENSORS_MIN_PERIOD : value;
+    cJSON *jList = getConfigValueObject("sensors/list");
+    cJSON *jItem = NULL;
+    if (cJSON_IsArray(jList)) {
+        cJSON_ArrayForEach(jItem, jList) {
+            cJSON *jId = cJSON_GetObjectItem(jItem, "id");
+            cJSON *jRom = cJSON_GetObjectItem(jItem, "rom");
+            if (bindingsCount >= SENSORS_MAX || !cJSON_IsNumber(jId) || !cJSON_IsString(jRom))
+                continue;
+            if (!parseRom(jRom->valuestring, bindings[bindingsCount].rom)) {
+                ESP_LOGW(TAG, "Wrong rom %s", jRom->valuestring);
+                continue;
+            }
+            bindings[bindingsCount].id = jId->valueint;
+            bindingsCount++;
+        }
+    }
+    ESP_LOGI(TAG, "Period %d s, %d bound sensors", period, bindingsCount);
+}
+
+void sensorsStart() {
+    if (bridge != NULL)
+        taskStart(TASK_SENSORS, &sensorsTask, NULL);
+}
+
+bool sensorsCondition(uint8_t id, const char *state, double value) {
+    bool above = !strcmp(state, "above");
+    if (!above && strcmp(state, "below"))
+        return false;
+    int64_t now = esp_timer_get_time();
+    bool fresh = false;
+    int16_t raw = 0;
+    portENTER_CRITICAL(&sensorsMux);
+    for (uint8_t i = 0; i < sensorsCount; i++) {
+        if (sensors[i].id == id && sensors[i].valid &&
+            now - sensors[i].time < (int64_t)period * SENSORS_STALE_PERIODS * 1000000) {
+            fresh = true;
+            raw = sensors[i].raw;
+        }
+    }
+    portEXIT_CRITICAL(&sensorsMux);
+    if (!fresh)
+        return false;
+    double t = raw / 16.0;
+    return above ? t > value : t < value;
+}
+
+cJSON *sensorsHistoryJson() {
+    // {"now": uptime, "samples": [[time, id, t], ...]} от старых к новым.
+    // Копия статическая, вызывается только из обработчика сообщений вебсокета
+    static sensorSample_t copy[SENSORS_RING];
+    uint16_t count, first;
+    portENTER_CRITICAL(&sensorsMux);
+    count = ringCount;
+    first = (ringHead + SENSORS_RING - ringCount) % SENSORS_RING;
+    for (uint16_t i = 0; i < count; i++)
+        copy[i] = ring[(first + i) % SENSORS_RING];
+    portEXIT_CRITICAL(&sensorsMux);
+    cJSON *json = cJSON_CreateObject();
+    cJSON_AddNumberToObject(json, "now", getUpTimeRaw());
+    cJSON *jSamples = cJSON_AddArrayToObject(json, "samples");
+    for (uint16_t i = 0; i < count; i++) {
+        cJSON *jSample = cJSON_CreateArray();
+        cJSON_AddItemToArray(jSample, cJSON_CreateNumber(copy[i].time));
+        cJSON_AddItemToArray(jSample, cJSON_CreateNumber(copy[i].id));
+        cJSON_AddItemToArray(jSample, cJSON_CreateNumber(copy[i].raw / 16.0));
+        cJSON_AddItemToArray(jSamples, jSample);
+    }
+    return json;
+}
+
+void sensorsAddInfo(cJSON *info) {
+    if (bridge == NULL)
+        return;
+    cJSON *jSensors = cJSON_CreateObject();
+    cJSON_AddBoolToObject(jSensors, "simulated", ds2484Simulated());
+    cJSON_AddNumberToObject(jSensors, "periodSec", period);
+    cJSON_AddNumberToObject(jSensors, "cycles", stats.cycles);
+    cJSON_AddNumberToObject(jSensors, "searches", stats.searches);
+    cJSON_AddNumberToObject(jSensors, "reads", stats.reads);
+    cJSON_AddNumberToObject(jSensors, "crcErrors", stats.crcErrors);
+    cJSON_AddNumberToObject(jSensors, "noPresence", stats.noPresence);
+    cJSON_AddNumberToObject(jSensors, "busErrors", stats.busErrors);
+    cJSON_AddNumberToObject(jSensors, "shorts", stats.shorts);
+    cJSON_AddNumberToObject(jSensors, "lastCycleMs", stats.lastCycleMs);
+    cJSON_AddNumberToObject(jSensors, "history", ringCount);
+    sensor_t list[SENSORS_MAX];
+    portENTER_CRITICAL(&sensorsMux);
+    uint8_t count = sensorsCount;
+    memcpy(list, sensors, count * sizeof(sensor_t));
+    portEXIT_CRITICAL(&sensorsMux);
+    int64_t now = esp_timer_get_time();
+    cJSON *jList = cJSON_CreateObject();
+    char rom[17];
+    char id[4];
+    for (uint8_t i = 0; i < count; i++) {
+        cJSON *jSensor = cJSON_CreateObject();
+        romText(list[i].rom, rom);
+        cJSON_AddStringToObject(jSensor, "rom", rom);
+        if (list[i].valid) {
+            cJSON_AddNumberToObject(jSensor, "t", list[i].raw / 16.0);
+            cJSON_AddNumberToObject(jSensor, "age", (uint32_t)((now - list[i].time) / 1000000));
+        }
+        cJSON_AddNumberToObject(jSensor, "errors", list[i].errors);
+        snprintf(id, sizeof(id), "%d", list[i].id);
+        cJSON_AddItemToObject(jList, id, jSensor);
+    }
+    cJSON_AddItemToObject(jSensors, "list", jList);
+    cJSON_AddItemToObject(info, "sensors", jSensors);
+}
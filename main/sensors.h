@@ -0,0 +1,19 @@
+#pragma once
+#include "i2cdev.h"
+#include "cJSON.h"
+
+// Датчики температуры DS18B20 на 1-Wire мосте DS2484.
+// Раз в sensors/periodSec одна широковещательная команда Convert T на все датчики,
+// через время преобразования чтение памяти каждого командами через очередь шины,
+// шина между командами свободна для выходов. Показания - в кольцевой буфер.
+// Номера датчиков: config sensors/list [{"id": 1, "rom": "28..."}], не найденные
+// в списке получают свободные номера по порядку поиска.
+// Условие в acls событий входов и задач планировщика:
+// {"type": "deny", "io": "sensor", "id": 1, "state": "above", "value": 30}
+// state - above/below. Без свежего показания условие не выполнено.
+
+void sensorsInit(i2c_dev_t *bridge);
+void sensorsStart();
+bool sensorsCondition(uint8_t id, const char *state, double value);
+cJSON *sensorsHistoryJson();
+void sensorsAddInfo(cJSON *info);
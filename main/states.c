@@ -0,0 +1,447 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_system.h"
+#include "cJSON.h"
+#include "utils.h"
+#include "wssender.h"
+#include "wire.h"
+#include "identity.h"
+#include "states.h"
+
+// Последовательность состояний для облака, описание протокола в states.h.
+// Индекс (slaveId, id) -> номер бита строится при загрузке и смене конфига,
+// история хранит маски изменившихся битов последних STATES_HISTORY кадров.
+
+#define STATES_HISTORY      32          // кадров в истории
+#define STATES_MAX_IO       256         // на каждый вид
+#define STATES_FRAME_SIZE   640
+
+static const char *TAG = "STATES";
+
+typedef struct {
+    uint16_t key;                       // slaveId << 8 | id
+    uint16_t bit;
+} stateKey_t;
+
+typedef struct {
+    uint16_t count;
+    uint8_t words;
+    uint16_t offset;                    // смещение в кадре истории, в словах
+    stateKey_t *sorted;                 // по key, для поиска
+    uint16_t *keys;                     // в порядке битов
+    uint32_t *values;
+    uint32_t *pending;
+} stateKind_t;
+
+static stateKind_t kinds[STATE_KINDS];
+static uint32_t *history = NULL;        // STATES_HISTORY кадров по frameWords слов
+static uint16_t frameWords = 0;
+static uint32_t historyCount = 0;
+static uint32_t seq = 0;
+static uint32_t epoch = 0;
+static volatile bool deltaMode = false;
+static SemaphoreHandle_t sem_data = NULL;  // индекс и маски
+static SemaphoreHandle_t sem_send = NULL;  // буфер кадра и порядок отправки
+static char frame[STATES_FRAME_SIZE];
+
+static struct {
+    uint32_t deltas;
+    uint32_t resyncs;
+    uint32_t snapshots;
+    uint32_t drift;
+} stats;
+
+static const char *kindNames[STATE_KINDS] = {"outputs", "inputs"};
+
+static int keyCompare(const void *a, const void *b) {
+    return (int)((const stateKey_t*)a)->key - (int)((const stateKey_t*)b)->key;
+}
+
+static bool isIndexed(uint8_t kind, cJSON *child) {
+    // тот же набор, что и в IOSTATES: все выходы и входы кроме кнопок
+    if (!cJSON_IsNumber(cJSON_GetObjectItem(child, "id")))
+        return false;
+    if (kind == STATE_INPUT)
+        return cJSON_IsString(cJSON_GetObjectItem(child, "type")) &&
+               strcmp(cJSON_GetObjectItem(child, "type")->valuestring, "BTN");
+    return true;
+}
+
+static bool isOn(cJSON *child) {
+    cJSON *jState = cJSON_GetObjectItem(child, "state");
+    return cJSON_IsString(jState) && !strcmp(jState->valuestring, "on");
+}
+
+static uint16_t childKey(cJSON *child) {
+    uint8_t slaveId = 0;
+    if (cJSON_IsNumber(cJSON_GetObjectItem(child, "slaveId")))
+        slaveId = cJSON_GetObjectItem(child, "slaveId")->valueint;
+    return (slaveId << 8) | (uint8_t)cJSON_GetObjectItem(child, "id")->valueint;
+}
+
+static int16_t keyFind(stateKind_t *k, uint16_t key) {
+    stateKey_t needle = {.key = key};
+    stateKey_t *found = bsearch(&needle, k->sorted, k->count, sizeof(stateKey_t), keyCompare);
+    return found != NULL ? found->bit : -1;
+}
+
+static void setBit(uint32_t *mask, uint16_t bit, bool value) {
+    if (value)
+        mask[bit / 32] |= 1u << (bit % 32);
+    else
+        mask[bit / 32] &= ~(1u << (bit % 32));
+}
+
+static bool getBit(const uint32_t *mask, uint16_t bit) {
+    return (mask[bit / 32] >> (bit % 32)) & 1;
+}
+
+static void kindFree(stateKind_t *k) {
+    free(k->sorted);
+    free(k->keys);
+    free(k->values);
+    free(k->pending);
+    memset(k, 0, sizeof(stateKind_t));
+}
+
+static bool kindBuild(uint8_t kind, cJSON *items, uint16_t offset) {
+    stateKind_t *k = &kinds[kind];
+    cJSON *child = NULL;
+    uint16_t count = 0;
+    cJSON_ArrayForEach(child, items) {
+        if (isIndexed(kind, child) && count < STATES_MAX_IO)
+            count++;
+    }
+    k->count = count;
+    k->words = (count + 31) / 32;
+    k->offset = offset;
+    k->sorted = malloc(count * sizeof(stateKey_t) + 1);
+    k->keys = malloc(count * sizeof(uint16_t) + 1);
+    k->values = calloc(k->words + 1, sizeof(uint32_t));
+    k->pending = calloc(k->words + 1, sizeof(uint32_t));
+    if (k->sorted == NULL || k->keys == NULL || k->values == NULL || k->pending == NULL) {
+        kindFree(k);
+        return false;
+    }
+    uint16_t bit = 0;
+    cJSON_ArrayForEach(child, items) {
+        if (!isIndexed(kind, child) || bit >= count)
+            continue;
+        k->keys[bit] = childKey(child);
+        k->sorted[bit].key = k->keys[bit];
+        k->sorted[bit].bit = bit;
+        setBit(k->values, bit, isOn(child));
+        bit++;
+    }
+    qsort(k->sorted, count, sizeof(stateKey_t), keyCompare);
+    return true;
+}
+
+void statesRebuild(cJSON *io) {
+    if (sem_data == NULL)
+        return;
+    xSemaphoreTake(sem_data, portMAX_DELAY);
+    for (uint8_t i = 0; i < STATE_KINDS; i++)
+        kindFree(&kinds[i]);
+    free(history);
+    history = NULL;
+    historyCount = 0;
+    bool ok = kindBuild(STATE_OUTPUT, cJSON_GetObjectItem(io, "outputs"), 0) &&
+              kindBuild(STATE_INPUT, cJSON_GetObjectItem(io, "inputs"), kinds[STATE_OUTPUT].words);
+    frameWords = kinds[STATE_OUTPUT].words + kinds[STATE_INPUT].words;
+    if (ok && frameWords > 0) {
+        history = calloc(STATES_HISTORY * frameWords, sizeof(uint32_t));
+        ok = history != NULL;
+    }
+    // раскладка битов поменялась - старые seq больше ничего не значат
+    epoch = esp_random() & 0x7FFFFFFF;
+    xSemaphoreGive(sem_data);
+    if (!ok)
+        ESP_LOGE(TAG, "Can't allocate states index");
+    ESP_LOGI(TAG, "States index: %d outputs, %d inputs, epoch %u",
+             kinds[STATE_OUTPUT].count, kinds[STATE_INPUT].count, epoch);
+}
+
+bool statesChanged(uint8_t kind, uint8_t slaveId, uint8_t id, const char *state) {
+    // false - состояние не индексировано и должно уйти по старому протоколу
+    if (sem_data == NULL || kind >= STATE_KINDS || state == NULL)
+        return false;
+    bool on = !strcmp(state, "on");
+    if (!on && strcmp(state, "off"))
+        return false;
+    xSemaphoreTake(sem_data, portMAX_DELAY);
+    stateKind_t *k = &kinds[kind];
+    int16_t bit = keyFind(k, (slaveId << 8) | id);
+    if (bit >= 0) {
+        setBit(k->pending, bit, true);
+        setBit(k->values, bit, on);
+    }
+    xSemaphoreGive(sem_data);
+    return bit >= 0;
+}
+
+void statesRefresh(cJSON *io) {
+    // сверка с IOConfig: ловит изменения, прошедшие мимо publishOutput (setAllOff и т.п.)
+    if (sem_data == NULL)
+        return;
+    xSemaphoreTake(sem_data, portMAX_DELAY);
+    for (uint8_t kind = 0; kind < STATE_KINDS; kind++) {
+        stateKind_t *k = &kinds[kind];
+        cJSON *child = NULL;
+        uint16_t bit = 0;
+        cJSON_ArrayForEach(child, cJSON_GetObjectItem(io, kindNames[kind])) {
+            if (!isIndexed(kind, child) || bit >= k->count)
+                continue;
+            if (k->keys[bit] == childKey(child) && getBit(k->values, bit) != isOn(child)) {
+                setBit(k->values, bit, isOn(child));
+                setBit(k->pending, bit, true);
+                stats.drift++;
+            }
+            bit++;
+        }
+    }
+    xSemaphoreGive(sem_data);
+}
+
+static uint16_t appendMask(uint16_t len, const uint32_t *mask, uint16_t count) {
+    static const char hex[] = "0123456789abcdef";
+    for (uint16_t n = 0; n < (count + 3) / 4 && len < STATES_FRAME_SIZE - 1; n++)
+        frame[len++] = hex[(mask[n / 8] >> ((n % 8) * 4)) & 0xF];
+    return len;
+}
+
+static void buildDeltaCbor(uint32_t base, uint32_t *changed) {
+    // то же в cbor1: маски байтовыми строками, младший байт первым
+    uint8_t buf[STATES_FRAME_SIZE / 2];
+    uint8_t kindsChanged = 0;
+    for (uint8_t kind = 0; kind < STATE_KINDS; kind++) {
+        for (uint8_t w = 0; w < kinds[kind].words; w++) {
+            if (changed[kinds[kind].offset + w]) {
+                kindsChanged++;
+                break;
+            }
+        }
+    }
+    cbor_t c;
+    cborInit(&c, buf, sizeof(buf));
+    cborMap(&c, 2);
+    cborKey(&c, "type");
+    cborText(&c, "DELTA");
+    cborKey(&c, "payload");
+    cborMap(&c, 4 + kindsChanged);
+    cborKey(&c, "mac");
+    cborText(&c, identityMac());
+    cborKey(&c, "epoch");
+    cborUint(&c, epoch);
+    cborKey(&c, "base");
+    cborUint(&c, base);
+    cborKey(&c, "seq");
+    cborUint(&c, seq);
+    for (uint8_t kind = 0; kind < STATE_KINDS; kind++) {
+        stateKind_t *k = &kinds[kind];
+        uint8_t cb[STATES_MAX_IO / 8], vb[STATES_MAX_IO / 8];
+        uint16_t bytes = (k->count + 7) / 8;
+        bool any = false;
+        for (uint16_t b = 0; b < bytes; b++) {
+            uint32_t cw = changed[k->offset + b / 4];
+            cb[b] = cw >> ((b % 4) * 8);
+            vb[b] = (k->values[b / 4] & cw) >> ((b % 4) * 8);
+            any |= cb[b] != 0;
+        }
+        if (!any)
+            continue;
+        cborKey(&c, kindNames[kind]);
+        cborMap(&c, 2);
+        cborKey(&c, "c");
+        cborBytes(&c, cb, bytes);
+        cborKey(&c, "v");
+        cborBytes(&c, vb, bytes);
+    }
+    char *text = wireWrap(&c);
+    snprintf(frame, STATES_FRAME_SIZE, "%s", text != NULL ? text : "");
+    free(text);
+}
+
+static uint16_t buildDelta(uint32_t base, uint32_t *changed) {
+    // changed - кадр в раскладке истории
+    if (wireGetFormat() == WIRE_CBOR) {
+        buildDeltaCbor(base, changed);
+        return strlen(frame);
+    }
+    int len = snprintf(frame, STATES_FRAME_SIZE,
+                       "{\"type\":\"DELTA\",\"payload\":{\"mac\":\"%s\",\"epoch\":%u,\"base\":%u,\"seq\":%u",
+                       identityMac(), epoch, base, seq);
+    for (uint8_t kind = 0; kind < STATE_KINDS; kind++) {
+        stateKind_t *k = &kinds[kind];
+        uint32_t *c = &changed[k->offset];
+        bool any = false;
+        for (uint8_t w = 0; w < k->words; w++)
+            any |= c[w] != 0;
+        if (!any)
+            continue;
+        // значения только для изменившихся битов
+        uint32_t v[(STATES_MAX_IO + 31) / 32];
+        for (uint8_t w = 0; w < k->words; w++)
+            v[w] = k->values[w] & c[w];
+        len += snprintf(&frame[len], STATES_FRAME_SIZE - len, ",\"%s\":{\"c\":\"", kindNames[kind]);
+        len = appendMask(len, c, k->count);
+        len += snprintf(&frame[len], STATES_FRAME_SIZE - len, "\",\"v\":\"");
+        len = appendMask(len, v, k->count);
+        len += snprintf(&frame[len], STATES_FRAME_SIZE - len, "\"}");
+    }
+    len += snprintf(&frame[len], STATES_FRAME_SIZE - len, "}}");
+    return len;
+}
+
+static bool flushLocked(bool send) {
+    // под sem_send и sem_data. Закрывает текущий кадр, true если он был не пустой
+    bool any = false;
+    for (uint8_t kind = 0; kind < STATE_KINDS; kind++) {
+        for (uint8_t w = 0; w < kinds[kind].words; w++)
+            any |= kinds[kind].pending[w] != 0;
+    }
+    if (!any || history == NULL)
+        return false;
+    seq++;
+    uint32_t *slot = &history[(seq % STATES_HISTORY) * frameWords];
+    for (uint8_t kind = 0; kind < STATE_KINDS; kind++) {
+        stateKind_t *k = &kinds[kind];
+        memcpy(&slot[k->offset], k->pending, k->words * sizeof(uint32_t));
+        memset(k->pending, 0, k->words * sizeof(uint32_t));
+    }
+    if (historyCount < STATES_HISTORY)
+        historyCount++;
+    if (send)
+        buildDelta(seq - 1, slot);
+    return true;
+}
+
+static void snapshotLocked();
+
+void statesFlush() {
+    // раз в тик inputsTask, вне sem_busy
+    if (sem_data == NULL)
+        return;
+    xSemaphoreTake(sem_send, portMAX_DELAY);
+    xSemaphoreTake(sem_data, portMAX_DELAY);
+    bool send = deltaMode;
+    bool flushed = flushLocked(send);
+    xSemaphoreGive(sem_data);
+    if (flushed && send) {
+        wsSend(frame, WS_PRIO_STATE, false);
+        stats.deltas++;
+    }
+    // очередь STATE переполнялась - один снимок вместо потерянных сообщений
+    if (wsSenderTakeStateDrop())
+        snapshotLocked();
+    xSemaphoreGive(sem_send);
+}
+
+static void snapshotLocked() {
+    // под sem_send
+    xSemaphoreTake(sem_data, portMAX_DELAY);
+    flushLocked(false);
+    cJSON *payload = cJSON_CreateObject();
+    cJSON_AddNumberToObject(payload, "epoch", epoch);
+    cJSON_AddNumberToObject(payload, "seq", seq);
+    for (uint8_t kind = 0; kind < STATE_KINDS; kind++) {
+        stateKind_t *k = &kinds[kind];
+        cJSON *jItems = cJSON_CreateArray();
+        for (uint16_t bit = 0; bit < k->count; bit++) {
+            cJSON *jItem = cJSON_CreateObject();
+            cJSON_AddNumberToObject(jItem, "id", k->keys[bit] & 0xFF);
+            cJSON_AddStringToObject(jItem, "state", getBit(k->values, bit) ? "on" : "off");
+            if (k->keys[bit] >> 8)
+                cJSON_AddNumberToObject(jItem, "slaveId", k->keys[bit] >> 8);
+            cJSON_AddItemToArray(jItems, jItem);
+        }
+        cJSON_AddItemToObject(payload, kindNames[kind], jItems);
+    }
+    xSemaphoreGive(sem_data);
+    cJSON *json = cJSON_CreateObject();
+    cJSON_AddStringToObject(json, "type", "IOSTATES");
+    cJSON_AddItemToObject(json, "payload", payload);
+    wireSend(json, WS_PRIO_STATE, false);
+    cJSON_Delete(json);
+    stats.snapshots++;
+}
+
+void statesSnapshot() {
+    if (sem_data == NULL)
+        return;
+    xSemaphoreTake(sem_send, portMAX_DELAY);
+    snapshotLocked();
+    xSemaphoreGive(sem_send);
+}
+
+void statesSync(uint32_t serverEpoch, uint32_t serverSeq) {
+    // сервер знает состояние на serverSeq, досылаем разницу одним кадром
+    if (sem_data == NULL)
+        return;
+    xSemaphoreTake(sem_send, portMAX_DELAY);
+    xSemaphoreTake(sem_data, portMAX_DELAY);
+    deltaMode = true;
+    flushLocked(false);
+    bool resync = serverEpoch == epoch && serverSeq <= seq && seq - serverSeq <= historyCount;
+    if (resync) {
+        uint32_t changed[2 * ((STATES_MAX_IO + 31) / 32)] = {0};
+        for (uint32_t s = serverSeq + 1; s <= seq; s++) {
+            uint32_t *slot = &history[(s % STATES_HISTORY) * frameWords];
+            for (uint16_t w = 0; w < frameWords; w++)
+                changed[w] |= slot[w];
+        }
+        buildDelta(serverSeq, changed);
+    }
+    xSemaphoreGive(sem_data);
+    if (resync) {
+        wsSend(frame, WS_PRIO_STATE, false);
+        stats.resyncs++;
+    } else {
+        ESP_LOGI(TAG, "Can't resync from %u/%u, current %u/%u. Sending snapshot",
+                 serverEpoch, serverSeq, epoch, seq);
+        snapshotLocked();
+    }
+    xSemaphoreGive(sem_send);
+}
+
+void statesSetDeltaMode(bool value) {
+    deltaMode = value;
+}
+
+bool statesDeltaMode() {
+    return deltaMode;
+}
+
+void statesInit() {
+    if (sem_data != NULL)
+        return;
+    sem_data = xSemaphoreCreateMutex();
+    sem_send = xSemaphoreCreateMutex();
+}
+
+void statesAddHello(cJSON *payload) {
+    // сервер видит поддержку протокола и текущую позицию
+    cJSON *jStates = cJSON_CreateObject();
+    cJSON_AddNumberToObject(jStates, "epoch", epoch);
+    cJSON_AddNumberToObject(jStates, "seq", seq);
+    cJSON_AddItemToObject(payload, "states", jStates);
+}
+
+void statesAddInfo(cJSON *info) {
+    cJSON *jStates = cJSON_CreateObject();
+    cJSON_AddNumberToObject(jStates, "epoch", epoch);
+    cJSON_AddNumberToObject(jStates, "seq", seq);
+    cJSON_AddNumberToObject(jStates, "outputs", kinds[STATE_OUTPUT].count);
+    cJSON_AddNumberToObject(jStates, "inputs", kinds[STATE_INPUT].count);
+    cJSON_AddNumberToObject(jStates, "history", historyCount);
+    cJSON_AddBoolToObject(jStates, "deltaMode", deltaMode);
+    cJSON_AddNumberToObject(jStates, "deltas", stats.deltas);
+    cJSON_AddNumberToObject(jStates, "resyncs", stats.resyncs);
+    cJSON_AddNumberToObject(jStates, "snapshots", stats.snapshots);
+    cJSON_AddNumberToObject(jStates, "drift", stats.drift);
+    cJSON_AddItemToObject(info, "states", jStates);
+}
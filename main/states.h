@@ -0,0 +1,31 @@
+#pragma once
+#include "cJSON.h"
+
+// Версионированные состояния входов/выходов для облака.
+// Каждое изменение попадает в маску текущего кадра, раз в тик inputsTask кадр получает
+// следующий seq и уходит как DELTA:
+// {"type":"DELTA","payload":{"mac":..,"epoch":E,"base":S-1,"seq":S,"outputs":{"c":"..","v":".."},"inputs":{..}}}
+// c - маска изменившихся, v - их значения (1 = on). Маска - hex строка, символ k кодирует
+// биты 4k..4k+3, бит n - n-й выход/вход в порядке IOSTATES (порядок конфига).
+// epoch меняется при загрузке и при смене конфига, seq между epoch не сравнимы.
+// Сервер присылает SYNC {"epoch":E,"seq":N} (или те же поля в AUTHORIZED) - в ответ
+// одна объединенная DELTA от N до текущего seq из истории, либо IOSTATES с epoch/seq,
+// если истории не хватает. GETSTATES - полный снимок по запросу.
+
+enum stateKinds {
+    STATE_OUTPUT = 0,
+    STATE_INPUT = 1,
+    STATE_KINDS
+};
+
+void statesInit();
+void statesRebuild(cJSON *io);
+bool statesChanged(uint8_t kind, uint8_t slaveId, uint8_t id, const char *state);
+void statesFlush();
+void statesRefresh(cJSON *io);
+void statesSync(uint32_t epoch, uint32_t seq);
+void statesSnapshot();
+void statesSetDeltaMode(bool value);
+bool statesDeltaMode();
+void statesAddHello(cJSON *payload);
+void statesAddInfo(cJSON *info);
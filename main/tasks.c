@@ -0,0 +1,233 @@
+#include <stdio.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "cJSON.h"
+#include "config.h"
+#include "tasks.h"
+
+// Пул рассчитан на профиль default, compact в него тоже помещается, поэтому
+// раскладка памяти не зависит от конфига. Профиль large (для отладки) в пул не
+// влезает, не поместившиеся задачи создаются в куче.
+// Размеры в байтах (в ESP-IDF глубина стека задается в байтах).
+// Пул - статический резерв в .bss: куча при старте больше на его размер, но
+// память не экономится, а переносится. Полный расход на задачи - footprintBytes
+// в INFO (резерв плюс то, что ушло в кучу).
+// Размещение (config tasks/placement):
+//  split - IO (входы, реле, действия) на APP_CPU с повышенным приоритетом,
+//          сеть и логи на PRO_CPU рядом с WiFi/lwIP. По умолчанию.
+//  swap  - наоборот, для сравнения.
+//  none  - как раньше: приоритет 5, без привязки к ядру.
+// Приоритет задач входов и реле можно переопределить через tasks/ioPriority,
+// i2cBusTask (владелец шины) при этом остается строго выше своих клиентов.
+// Размеры сверяются с минимумом свободного стека из health (uxTaskGetStackHighWaterMark):
+// serviceTask выполняет healthCheck, historyFlush, запись износа в NVS, отложенный
+// saveConfig и запуск сетевых сервисов (initWS, initMQTT, веб-сервер, FTP - см.
+// bootRunDeferred), поэтому его стек самый большой; relayTask - не меньше 4096.
+
+#define TASKS_POOL_SIZE     (4096 + 6144 + 4096 + 4096 + 3072 + 3072 + 3072 + 3072 + TASK_ACTION_WORKERS * 4096)
+#define TASK_SLOTS          (TASK_IDS - 1 + TASK_ACTION_WORKERS)
+#define TASK_NAME_SIZE      16
+
+static const char *TAG = "TASKS";
+
+#define TASK_LEGACY_PRIORITY    5
+#define TASK_IO_CORE            1
+#define TASK_NET_CORE           0
+
+enum taskGroups {
+    TASK_GROUP_IO = 0,
+    TASK_GROUP_NET
+};
+
+enum taskPlacements {
+    TASK_PLACE_SPLIT = 0,
+    TASK_PLACE_SWAP,
+    TASK_PLACE_NONE
+};
+
+typedef struct {
+    const char *name;
+    uint16_t stack[3];          // default, compact, large
+    UBaseType_t priority;
+    uint8_t instances;
+    uint8_t group;
+} taskProfile_t;
+
+static const char *profileNames[] = {"default", "compact", "large"};
+static const char *placementNames[] = {"split", "swap", "none"};
+
+static const taskProfile_t profiles[TASK_IDS] = {
+    // modbus RTU (порт на приоритете 10) привязан к тому же ядру через sdkconfig
+    [TASK_INPUTS]    = {"inputsTask",   {4096, 3072, 6144}, 9, 1, TASK_GROUP_IO},
+    [TASK_SERVICE]   = {"serviceTask",  {6144, 6144, 8192}, 3, 1, TASK_GROUP_NET},
+    [TASK_RELAY]     = {"relayTask",    {4096, 4096, 6144}, 9, 1, TASK_GROUP_IO},
+    [TASK_WS_SENDER] = {"wsSenderTask", {4096, 3072, 6144}, 5, 1, TASK_GROUP_NET},
+    [TASK_LOG_SHIP]  = {"logShipTask",  {3072, 2560, 4096}, 4, 1, TASK_GROUP_NET},
+    [TASK_I2C]       = {"i2cBusTask",   {3072, 2560, 4096}, 10, 1, TASK_GROUP_IO},
+    [TASK_SENSORS]   = {"sensorsTask",  {3072, 2560, 4096}, 2, 1, TASK_GROUP_NET},
+    [TASK_PULSE]     = {"pulseTask",    {3072, 2560, 4096}, 7, 1, TASK_GROUP_IO},
+    [TASK_ACTION]    = {"actionWorker", {4096, 3072, 6144}, 8, TASK_ACTION_WORKERS, TASK_GROUP_IO},
+};
+
+static StackType_t pool[TASKS_POOL_SIZE / sizeof(StackType_t)];
+static StaticTask_t tcbs[TASK_SLOTS];
+
+static uint8_t profile = 0;
+static uint8_t placement = TASK_PLACE_SPLIT;
+static uint8_t ioPriority = 0;          // 0 - из таблицы
+static uint32_t poolUsed = 0;
+static uint8_t tcbUsed = 0;
+static uint8_t heapTasks = 0;          // не поместились в пул
+static uint32_t heapTaskBytes = 0;     // их стеки и TCB в куче
+static uint8_t started[TASK_IDS];
+static uint32_t heapBeforeTasks = 0;
+static uint32_t heapAfterBoot = 0;
+
+typedef struct {
+    int64_t last;
+    uint32_t samples;
+    uint64_t sumUs;             // сумма отклонений от периода
+    uint32_t maxUs;
+    uint32_t late;              // опоздание больше тика
+} taskJitter_t;
+
+static taskJitter_t jitter[TASK_IDS];
+
+static uint8_t findName(char *name, const char **list, uint8_t count) {
+    for (uint8_t i = 0; name != NULL && i < count; i++) {
+        if (!strcmp(name, list[i]))
+            return i;
+    }
+    return 0;
+}
+
+void tasksInit() {
+    profile = findName(getConfigValueString("tasks/profile"), profileNames,
+                       sizeof(profileNames) / sizeof(profileNames[0]));
+    placement = findName(getConfigValueString("tasks/placement"), placementNames,
+                         sizeof(placementNames) / sizeof(placementNames[0]));
+    int value = getConfigValueInt("tasks/ioPriority");
+    // место над ним нужно для задачи шины
+    ioPriority = (value > 0 && value < configMAX_PRIORITIES - 1) ? value : 0;
+    uint32_t total = 0;
+    for (uint8_t i = 0; i < TASK_IDS; i++)
+        total += profiles[i].stack[profile] * profiles[i].instances;
+    heapBeforeTasks = esp_get_free_heap_size();
+    ESP_LOGI(TAG, "Profile %s, placement %s, stacks %u of %u bytes",
+             profileNames[profile], placementNames[placement], total, TASKS_POOL_SIZE);
+}
+
+static UBaseType_t taskPriority(uint8_t id) {
+    if (placement == TASK_PLACE_NONE)
+        return TASK_LEGACY_PRIORITY;
+    if (ioPriority > 0 && (id == TASK_INPUTS || id == TASK_RELAY))
+        return ioPriority;
+    if (id == TASK_I2C && ioPriority >= profiles[id].priority)
+        return ioPriority + 1;
+    return profiles[id].priority;
+}
+
+static BaseType_t taskCore(uint8_t id) {
+    if (placement == TASK_PLACE_NONE)
+        return tskNO_AFFINITY;
+    bool io = profiles[id].group == TASK_GROUP_IO;
+    if (placement == TASK_PLACE_SWAP)
+        io = !io;
+    return io ? TASK_IO_CORE : TASK_NET_CORE;
+}
+
+TaskHandle_t taskStart(uint8_t id, TaskFunction_t function, void *param) {
+    if (id >= TASK_IDS || started[id] >= profiles[id].instances) {
+        ESP_LOGE(TAG, "No slot for task %d", id);
+        return NULL;
+    }
+    uint32_t size = profiles[id].stack[profile];
+    // FreeRTOS копирует имя в TCB, буфер нужен только на время создания
+    char name[TASK_NAME_SIZE];
+    if (profiles[id].instances > 1)
+        snprintf(name, TASK_NAME_SIZE, "%s%d", profiles[id].name, started[id]);
+    else
+        snprintf(name, TASK_NAME_SIZE, "%s", profiles[id].name);
+    started[id]++;
+    TaskHandle_t handle = NULL;
+    if (poolUsed + size > TASKS_POOL_SIZE || tcbUsed >= TASK_SLOTS) {
+        ESP_LOGW(TAG, "Pool is over, %s goes to heap", name);
+        xTaskCreatePinnedToCore(function, name, size, param, taskPriority(id), &handle, taskCore(id));
+        heapTasks++;
+        heapTaskBytes += size + sizeof(StaticTask_t);
+        return handle;
+    }
+    handle = xTaskCreateStaticPinnedToCore(function, name, size, param, taskPriority(id),
+                                           &pool[poolUsed / sizeof(StackType_t)], &tcbs[tcbUsed],
+                                           taskCore(id));
+    poolUsed += size;
+    tcbUsed++;
+    return handle;
+}
+
+void taskTick(uint8_t id, uint32_t periodMs) {
+    // вызывается периодической задачей после каждого пробуждения
+    if (id >= TASK_IDS)
+        return;
+    int64_t now = esp_timer_get_time();
+    taskJitter_t *j = &jitter[id];
+    if (j->last > 0) {
+        int64_t diff = (now - j->last) - (int64_t)periodMs * 1000;
+        uint32_t us = diff < 0 ? -diff : diff;
+        j->samples++;
+        j->sumUs += us;
+        if (us > j->maxUs)
+            j->maxUs = us;
+        if (us > portTICK_PERIOD_MS * 1000)
+            j->late++;
+    }
+    j->last = now;
+}
+
+void tasksSetBootHeap() {
+    // конец инициализации
+    heapAfterBoot = esp_get_free_heap_size();
+}
+
+void tasksAddInfo(cJSON *info) {
+    cJSON *jTasks = cJSON_CreateObject();
+    cJSON_AddStringToObject(jTasks, "profile", profileNames[profile]);
+    cJSON_AddStringToObject(jTasks, "placement", placementNames[placement]);
+    cJSON_AddNumberToObject(jTasks, "poolBytes", TASKS_POOL_SIZE);
+    cJSON_AddNumberToObject(jTasks, "stackBytes", poolUsed);
+    // статический резерв в .bss занят всегда, даже если задачи не запущены
+    cJSON_AddNumberToObject(jTasks, "reservedBytes", sizeof(pool) + sizeof(tcbs));
+    cJSON_AddNumberToObject(jTasks, "reservedUsedBytes", poolUsed + tcbUsed * sizeof(StaticTask_t));
+    cJSON_AddNumberToObject(jTasks, "heapTasks", heapTasks);
+    cJSON_AddNumberToObject(jTasks, "heapTaskBytes", heapTaskBytes);
+    // куча + .bss: с чем сравнивать прежнее размещение всех стеков в куче
+    cJSON_AddNumberToObject(jTasks, "footprintBytes", sizeof(pool) + sizeof(tcbs) + heapTaskBytes);
+    cJSON_AddNumberToObject(jTasks, "heapBeforeTasks", heapBeforeTasks);
+    cJSON_AddNumberToObject(jTasks, "heapAfterBoot", heapAfterBoot);
+    cJSON *jStacks = cJSON_CreateObject();
+    for (uint8_t i = 0; i < TASK_IDS; i++) {
+        if (started[i] > 0)
+            cJSON_AddNumberToObject(jStacks, profiles[i].name, profiles[i].stack[profile]);
+    }
+    cJSON_AddItemToObject(jTasks, "stacks", jStacks);
+    // отклонение периода пробуждения, мкс
+    cJSON *jJitter = cJSON_CreateObject();
+    for (uint8_t i = 0; i < TASK_IDS; i++) {
+        if (jitter[i].samples == 0)
+            continue;
+        cJSON *jTask = cJSON_CreateObject();
+        cJSON_AddNumberToObject(jTask, "core", taskCore(i) == tskNO_AFFINITY ? -1 : taskCore(i));
+        cJSON_AddNumberToObject(jTask, "priority", taskPriority(i));
+        cJSON_AddNumberToObject(jTask, "samples", jitter[i].samples);
+        cJSON_AddNumberToObject(jTask, "avgUs", (uint32_t)(jitter[i].sumUs / jitter[i].samples));
+        cJSON_AddNumberToObject(jTask, "maxUs", jitter[i].maxUs);
+        cJSON_AddNumberToObject(jTask, "late", jitter[i].late);
+        cJSON_AddItemToObject(jJitter, profiles[i].name, jTask);
+    }
+    cJSON_AddItemToObject(jTasks, "jitter", jJitter);
+    cJSON_AddItemToObject(info, "tasks", jTasks);
+}
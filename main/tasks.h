@@ -0,0 +1,30 @@
+#pragma once
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "cJSON.h"
+
+// Долгоживущие задачи создаются статически: стеки нарезаются из одного пула,
+// размеры берутся из профиля (config tasks/profile: default, compact, large).
+// Ядро и приоритет по группе IO/сеть (config tasks/placement), приоритет входов
+// и реле - tasks/ioPriority.
+
+enum taskIds {
+    TASK_INPUTS = 0,
+    TASK_SERVICE,
+    TASK_RELAY,
+    TASK_WS_SENDER,
+    TASK_LOG_SHIP,
+    TASK_I2C,
+    TASK_SENSORS,
+    TASK_PULSE,
+    TASK_ACTION,            // пул исполнителей цепочек действий
+    TASK_IDS
+};
+
+#define TASK_ACTION_WORKERS     3
+
+void tasksInit();
+TaskHandle_t taskStart(uint8_t id, TaskFunction_t function, void *param);
+void taskTick(uint8_t id, uint32_t periodMs);
+void tasksSetBootHeap();
+void tasksAddInfo(cJSON *info);
@@ -0,0 +1,300 @@
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include "esp_log.h"
+#include "cJSON.h"
+#include "topics.h"
+
+// Роутер входящих MQTT топиков.
+// Подписки из mqtt/topics компилируются в дерево по уровням топика (разделитель '/'),
+// с поддержкой '+' (один уровень) и '#' (остаток топика). Действия разбираются заранее,
+// поэтому обработка сообщения зависит от длины топика, а не от количества подписок.
+
+#define OWN_PREFIX_SIZE 64
+
+static const char *TAG = "TOPICS";
+
+typedef struct topicNode {
+    char *level;                    // текст уровня
+    uint16_t levelLen;
+    uint32_t hash;                  // хэш уровня, children отсортированы по нему
+    struct topicNode **children;
+    uint16_t childrenCount;
+    struct topicNode *plus;         // подписка '+'
+    struct topicNode *sharp;        // подписка '#'
+    topicAction_t *actions;
+    uint8_t actionsCount;
+} topicNode_t;
+
+static topicNode_t *root = NULL;
+static char **subscriptions = NULL;
+static uint16_t subscriptionsCount = 0;
+static char ownPrefix[OWN_PREFIX_SIZE] = {0};
+static uint16_t ownPrefixLen = 0;
+
+static uint32_t levelHash(const char *s, uint16_t len) {
+    // FNV-1a
+    uint32_t h = 2166136261u;
+    for (uint16_t i = 0; i < len; i++) {
+        h ^= (uint8_t)s[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static char *strndupSafe(const char *s, size_t len) {
+    char *r = malloc(len + 1);
+    if (r == NULL)
+        return NULL;
+    memcpy(r, s, len);
+    r[len] = '\0';
+    return r;
+}
+
+static topicNode_t *nodeCreate(const char *level, uint16_t len) {
+    topicNode_t *node = calloc(1, sizeof(topicNode_t));
+    if (node == NULL)
+        return NULL;
+    if (level != NULL) {
+        node->level = strndupSafe(level, len);
+        node->levelLen = len;
+        node->hash = levelHash(level, len);
+    }
+    return node;
+}
+
+static void nodeFree(topicNode_t *node) {
+    if (node == NULL)
+        return;
+    for (uint16_t i = 0; i < node->childrenCount; i++)
+        nodeFree(node->children[i]);
+    nodeFree(node->plus);
+    nodeFree(node->sharp);
+    for (uint8_t i = 0; i < node->actionsCount; i++) {
+        free(node->actions[i].event);
+        free(node->actions[i].action);
+    }
+    free(node->actions);
+    free(node->children);
+    free(node->level);
+    free(node);
+}
+
+// бинарный поиск по хэшу, при совпадении хэша сравниваем сам уровень
+static int16_t childFind(topicNode_t *node, const char *level, uint16_t len, uint32_t hash, uint16_t *insertPos) {
+    int32_t lo = 0, hi = (int32_t)node->childrenCount - 1;
+    while (lo <= hi) {
+        int32_t mid = (lo + hi) / 2;
+        uint32_t h = node->children[mid]->hash;
+        if (h < hash) {
+            lo = mid + 1;
+        } else if (h > hash) {
+            hi = mid - 1;
+        } else {
+            // коллизии лежат рядом
+            int32_t i = mid;
+            while (i > 0 && node->children[i-1]->hash == hash)
+                i--;
+            for (; i < node->childrenCount && node->children[i]->hash == hash; i++) {
+                if (node->children[i]->levelLen == len &&
+                    !memcmp(node->children[i]->level, level, len))
+                    return i;
+            }
+            lo = i;
+            break;
+        }
+    }
+    if (insertPos != NULL)
+        *insertPos = lo;
+    return -1;
+}
+
+static topicNode_t *childGetOrAdd(topicNode_t *node, const char *level, uint16_t len) {
+    if (len == 1 && level[0] == '+') {
+        if (node->plus == NULL)
+            node->plus = nodeCreate(level, len);
+        return node->plus;
+    }
+    if (len == 1 && level[0] == '#') {
+        if (node->sharp == NULL)
+            node->sharp = nodeCreate(level, len);
+        return node->sharp;
+    }
+    uint32_t hash = levelHash(level, len);
+    uint16_t pos = 0;
+    int16_t idx = childFind(node, level, len, hash, &pos);
+    if (idx >= 0)
+        return node->children[idx];
+    topicNode_t *child = nodeCreate(level, len);
+    if (child == NULL)
+        return NULL;
+    topicNode_t **children = realloc(node->children, (node->childrenCount + 1) * sizeof(topicNode_t*));
+    if (children == NULL) {
+        nodeFree(child);
+        return NULL;
+    }
+    memmove(&children[pos+1], &children[pos], (node->childrenCount - pos) * sizeof(topicNode_t*));
+    children[pos] = child;
+    node->children = children;
+    node->childrenCount++;
+    return child;
+}
+
+static topicNode_t *insertTopic(const char *topic) {
+    topicNode_t *node = root;
+    const char *p = topic;
+    while (node != NULL) {
+        const char *slash = strchr(p, '/');
+        uint16_t len = slash ? slash - p : strlen(p);
+        node = childGetOrAdd(node, p, len);
+        if (slash == NULL)
+            break;
+        p = slash + 1;
+    }
+    return node;
+}
+
+static bool addAction(topicNode_t *node, cJSON *jEvent) {
+    // разбор события в готовое действие
+    cJSON *jType = cJSON_GetObjectItem(jEvent, "type");
+    cJSON *jAction = cJSON_GetObjectItem(jEvent, "action");
+    if (!cJSON_IsString(cJSON_GetObjectItem(jEvent, "event")) ||
+        !cJSON_IsString(jAction) || !cJSON_IsString(jType))
+        return false;
+    topicAction_t action = {0};
+    if (!strcmp(jType->valuestring, "out") && cJSON_IsNumber(cJSON_GetObjectItem(jEvent, "output"))) {
+        action.type = TOPIC_OUT;
+        action.id = cJSON_GetObjectItem(jEvent, "output")->valueint;
+    } else if (!strcmp(jType->valuestring, "in") && cJSON_IsNumber(cJSON_GetObjectItem(jEvent, "input"))) {
+        action.type = TOPIC_IN;
+        action.id = cJSON_GetObjectItem(jEvent, "input")->valueint;
+    } else {
+        return false;
+    }
+    if (cJSON_IsNumber(cJSON_GetObjectItem(jEvent, "slaveId")))
+        action.slaveId = cJSON_GetObjectItem(jEvent, "slaveId")->valueint;
+    action.event = strdup(cJSON_GetObjectItem(jEvent, "event")->valuestring);
+    action.action = strdup(jAction->valuestring);
+    topicAction_t *actions = realloc(node->actions, (node->actionsCount + 1) * sizeof(topicAction_t));
+    if (actions == NULL || action.event == NULL || action.action == NULL) {
+        free(action.event);
+        free(action.action);
+        if (actions != NULL)
+            node->actions = actions;
+        return false;
+    }
+    actions[node->actionsCount++] = action;
+    node->actions = actions;
+    return true;
+}
+
+void topicsFree() {
+    nodeFree(root);
+    root = NULL;
+    for (uint16_t i = 0; i < subscriptionsCount; i++)
+        free(subscriptions[i]);
+    free(subscriptions);
+    subscriptions = NULL;
+    subscriptionsCount = 0;
+}
+
+esp_err_t topicsCompile(cJSON *topics, const char *hostname) {
+    topicsFree();
+    snprintf(ownPrefix, sizeof(ownPrefix), "%s/in/", hostname != NULL ? hostname : "");
+    ownPrefixLen = strlen(ownPrefix);
+    root = nodeCreate(NULL, 0);
+    if (root == NULL)
+        return ESP_ERR_NO_MEM;
+    uint16_t actionsCount = 0;
+    cJSON *childTopic = NULL;
+    cJSON_ArrayForEach(childTopic, topics) {
+        cJSON *jTopic = cJSON_GetObjectItem(childTopic, "topic");
+        if (!cJSON_IsString(jTopic) || strlen(jTopic->valuestring) == 0)
+            continue;
+        topicNode_t *node = insertTopic(jTopic->valuestring);
+        if (node == NULL) {
+            ESP_LOGE(TAG, "Can't add topic %s", jTopic->valuestring);
+            continue;
+        }
+        // подписка нужна один раз даже если топик повторяется в конфиге
+        bool exists = false;
+        for (uint16_t i = 0; i < subscriptionsCount; i++) {
+            if (!strcmp(subscriptions[i], jTopic->valuestring)) {
+                exists = true;
+                break;
+            }
+        }
+        if (!exists) {
+            char **subs = realloc(subscriptions, (subscriptionsCount + 1) * sizeof(char*));
+            if (subs != NULL) {
+                subscriptions = subs;
+                subscriptions[subscriptionsCount] = strdup(jTopic->valuestring);
+                if (subscriptions[subscriptionsCount] != NULL)
+                    subscriptionsCount++;
+            }
+        }
+        cJSON *childEvent = NULL;
+        cJSON_ArrayForEach(childEvent, cJSON_GetObjectItem(childTopic, "events")) {
+            if (addAction(node, childEvent))
+                actionsCount++;
+        }
+    }
+    ESP_LOGI(TAG, "Compiled %d topics, %d actions. Own prefix %s", subscriptionsCount, actionsCount, ownPrefix);
+    return ESP_OK;
+}
+
+static uint16_t fireActions(topicNode_t *node, const char *data, topicActionCb cb) {
+    uint16_t fired = 0;
+    for (uint8_t i = 0; i < node->actionsCount; i++) {
+        if (!strcasecmp(data, node->actions[i].event)) {
+            cb(&node->actions[i]);
+            fired++;
+        }
+    }
+    return fired;
+}
+
+static uint16_t matchLevel(topicNode_t *node, const char *p, const char *data, topicActionCb cb) {
+    uint16_t fired = 0;
+    // '#' покрывает и текущий уровень, и все последующие
+    if (node->sharp != NULL)
+        fired += fireActions(node->sharp, data, cb);
+    if (p == NULL)
+        return fired + fireActions(node, data, cb);
+    const char *slash = strchr(p, '/');
+    uint16_t len = slash ? slash - p : strlen(p);
+    const char *next = slash ? slash + 1 : NULL;
+    int16_t idx = childFind(node, p, len, levelHash(p, len), NULL);
+    if (idx >= 0)
+        fired += matchLevel(node->children[idx], next, data, cb);
+    if (node->plus != NULL)
+        fired += matchLevel(node->plus, next, data, cb);
+    return fired;
+}
+
+uint16_t topicsDispatch(const char *topic, const char *data, topicActionCb cb) {
+    if (root == NULL || topic == NULL || data == NULL || cb == NULL)
+        return 0;
+    // топики, начинающиеся с '$', не попадают под wildcard на первом уровне
+    if (topic[0] == '$') {
+        const char *slash = strchr(topic, '/');
+        uint16_t len = slash ? slash - topic : strlen(topic);
+        int16_t idx = childFind(root, topic, len, levelHash(topic, len), NULL);
+        return idx >= 0 ? matchLevel(root->children[idx], slash ? slash + 1 : NULL, data, cb) : 0;
+    }
+    return matchLevel(root, topic, data, cb);
+}
+
+void topicsSubscribeAll(void (*subscribe)(char *topic)) {
+    for (uint16_t i = 0; i < subscriptionsCount; i++)
+        subscribe(subscriptions[i]);
+}
+
+bool topicsIsOwn(const char *topic, const char **rest) {
+    // топики самого устройства <name>/in/...
+    if (ownPrefixLen == 0 || strncmp(topic, ownPrefix, ownPrefixLen))
+        return false;
+    if (rest != NULL)
+        *rest = topic + ownPrefixLen;
+    return true;
+}
@@ -0,0 +1,24 @@
+#pragma once
+#include "cJSON.h"
+
+// действие, заранее разобранное из mqtt/topics
+typedef struct {
+    char *event;        // значение payload, регистр не важен
+    char *action;       // on/off/toggle/... для выхода или событие для входа
+    uint8_t type;       // TOPIC_OUT / TOPIC_IN
+    uint8_t id;         // output или input
+    uint8_t slaveId;
+} topicAction_t;
+
+enum topicActionTypes {
+    TOPIC_OUT = 0,
+    TOPIC_IN = 1
+};
+
+typedef void (*topicActionCb)(const topicAction_t *action);
+
+esp_err_t topicsCompile(cJSON *topics, const char *hostname);
+void topicsFree();
+uint16_t topicsDispatch(const char *topic, const char *data, topicActionCb cb);
+void topicsSubscribeAll(void (*subscribe)(char *topic));
+bool topicsIsOwn(const char *topic, const char **rest);
@@ -0,0 +1,299 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+#include "esp_log.h"
+#include "xtensa/core-macros.h"
+#include "mbedtls/base64.h"
+#include "cJSON.h"
+#include "wssender.h"
+#include "wire.h"
+
+// Компактный формат сообщений: минимальный CBOR кодировщик (RFC 8949) без внешних
+// зависимостей, обход cJSON дерева и обертка в base64 для текстового транспорта.
+
+#define WIRE_CBOR_PREFIX    'C'
+
+static const char *TAG = "WIRE";
+
+// словарь ключей cbor1, только дописывать в конец
+static const char *wireKeys[] = {
+    "type", "payload", "mac", "output", "input", "state", "slaveId", "timer",
+    "id", "outputs", "inputs", "epoch", "seq", "base", "c", "v",
+    "name", "description", "version", "model", "freeMemory", "uptime", "uptimeRaw", "curdate",
+    "wifiRSSI", "ethIP", "wifiIP", "resetReason", "default", "events", "event", "actions",
+    "action", "order", "acls", "io", "duration", "limit", "on", "off"
+};
+#define WIRE_KEYS_COUNT (sizeof(wireKeys) / sizeof(wireKeys[0]))
+
+static volatile uint8_t wireFormat = WIRE_JSON;
+
+static struct {
+    uint32_t frames;
+    uint32_t bytes;
+} stats;
+
+static void put(cbor_t *c, uint8_t b) {
+    if (c->buf != NULL && c->len < c->cap)
+        c->buf[c->len] = b;
+    c->len++;
+}
+
+static void head(cbor_t *c, uint8_t major, uint64_t arg) {
+    // заголовок: тип в старших 3 битах, аргумент в младших 5 или следующих байтах
+    major <<= 5;
+    if (arg < 24) {
+        put(c, major | arg);
+    } else if (arg <= 0xFF) {
+        put(c, major | 24);
+        put(c, arg);
+    } else if (arg <= 0xFFFF) {
+        put(c, major | 25);
+        put(c, arg >> 8);
+        put(c, arg);
+    } else if (arg <= 0xFFFFFFFF) {
+        put(c, major | 26);
+        for (int8_t s = 24; s >= 0; s -= 8)
+            put(c, arg >> s);
+    } else {
+        put(c, major | 27);
+        for (int8_t s = 56; s >= 0; s -= 8)
+            put(c, arg >> s);
+    }
+}
+
+void cborInit(cbor_t *c, uint8_t *buf, size_t cap) {
+    c->buf = buf;
+    c->cap = cap;
+    c->len = 0;
+}
+
+bool cborOverflow(cbor_t *c) {
+    return c->buf != NULL && c->len > c->cap;
+}
+
+void cborMap(cbor_t *c, uint32_t count) {
+    head(c, 5, count);
+}
+
+void cborArray(cbor_t *c, uint32_t count) {
+    head(c, 4, count);
+}
+
+void cborUint(cbor_t *c, uint64_t value) {
+    head(c, 0, value);
+}
+
+void cborInt(cbor_t *c, int64_t value) {
+    if (value >= 0)
+        head(c, 0, value);
+    else
+        head(c, 1, -1 - value);
+}
+
+void cborNumber(cbor_t *c, double value) {
+    // целые - как целые, остальное float32 если точно, иначе float64
+    if (value == floor(value) && fabs(value) < 9007199254740992.0) {
+        cborInt(c, (int64_t)value);
+        return;
+    }
+    float f = value;
+    if ((double)f == value) {
+        uint32_t bits;
+        memcpy(&bits, &f, sizeof(bits));
+        put(c, 0xFA);
+        for (int8_t s = 24; s >= 0; s -= 8)
+            put(c, bits >> s);
+    } else {
+        uint64_t bits;
+        memcpy(&bits, &value, sizeof(bits));
+        put(c, 0xFB);
+        for (int8_t s = 56; s >= 0; s -= 8)
+            put(c, bits >> s);
+    }
+}
+
+void cborBool(cbor_t *c, bool value) {
+    put(c, value ? 0xF5 : 0xF4);
+}
+
+void cborNull(cbor_t *c) {
+    put(c, 0xF6);
+}
+
+void cborText(cbor_t *c, const char *text) {
+    size_t len = text != NULL ? strlen(text) : 0;
+    head(c, 3, len);
+    for (size_t i = 0; i < len; i++)
+        put(c, text[i]);
+}
+
+void cborBytes(cbor_t *c, const void *data, size_t len) {
+    head(c, 2, len);
+    for (size_t i = 0; i < len; i++)
+        put(c, ((const uint8_t*)data)[i]);
+}
+
+void cborKey(cbor_t *c, const char *key) {
+    for (uint8_t i = 0; i < WIRE_KEYS_COUNT; i++) {
+        if (key[0] == wireKeys[i][0] && !strcmp(key, wireKeys[i])) {
+            cborUint(c, i);
+            return;
+        }
+    }
+    cborText(c, key);
+}
+
+void cborJson(cbor_t *c, cJSON *item) {
+    if (item == NULL) {
+        cborNull(c);
+    } else if (cJSON_IsObject(item)) {
+        cborMap(c, cJSON_GetArraySize(item));
+        cJSON *child = NULL;
+        cJSON_ArrayForEach(child, item) {
+            cborKey(c, child->string != NULL ? child->string : "");
+            cborJson(c, child);
+        }
+    } else if (cJSON_IsArray(item)) {
+        cborArray(c, cJSON_GetArraySize(item));
+        cJSON *child = NULL;
+        cJSON_ArrayForEach(child, item)
+            cborJson(c, child);
+    } else if (cJSON_IsString(item)) {
+        cborText(c, item->valuestring);
+    } else if (cJSON_IsNumber(item)) {
+        cborNumber(c, item->valuedouble);
+    } else if (cJSON_IsBool(item)) {
+        cborBool(c, cJSON_IsTrue(item));
+    } else {
+        cborNull(c);
+    }
+}
+
+char *wireWrap(cbor_t *c) {
+    // 'C' + base64(CBOR), буфер c должен быть заполнен
+    if (c->buf == NULL || cborOverflow(c))
+        return NULL;
+    size_t size = 1 + 4 * ((c->len + 2) / 3) + 1;
+    char *text = malloc(size);
+    if (text == NULL)
+        return NULL;
+    size_t olen = 0;
+    text[0] = WIRE_CBOR_PREFIX;
+    if (mbedtls_base64_encode((unsigned char*)&text[1], size - 1, &olen, c->buf, c->len)) {
+        free(text);
+        return NULL;
+    }
+    text[1 + olen] = '\0';
+    return text;
+}
+
+char *wirePrint(cJSON *json, uint8_t format) {
+    if (format != WIRE_CBOR)
+        return cJSON_PrintUnformatted(json);
+    // первый проход считает длину, второй пишет
+    cbor_t c;
+    cborInit(&c, NULL, 0);
+    cborJson(&c, json);
+    uint8_t *buf = malloc(c.len);
+    if (buf == NULL)
+        return NULL;
+    cborInit(&c, buf, c.len);
+    cborJson(&c, json);
+    char *text = wireWrap(&c);
+    free(buf);
+    return text;
+}
+
+bool wireSend(cJSON *json, uint8_t priority, bool force) {
+    // отправка в вебсокет в согласованном формате, json не удаляется
+    uint8_t format = wireFormat;
+    char *message = wirePrint(json, format);
+    if (message == NULL && format == WIRE_CBOR)
+        message = cJSON_PrintUnformatted(json);
+    if (message == NULL)
+        return false;
+    if (message[0] == WIRE_CBOR_PREFIX) {
+        stats.frames++;
+        stats.bytes += strlen(message);
+    }
+    bool res = wsSend(message, priority, force);
+    free(message);
+    return res;
+}
+
+void wireSetFormat(uint8_t format) {
+    wireFormat = format;
+}
+
+uint8_t wireGetFormat() {
+    return wireFormat;
+}
+
+bool wireSelect(const char *name) {
+    if (name == NULL)
+        return false;
+    if (!strcmp(name, "cbor1")) {
+        wireFormat = WIRE_CBOR;
+    } else if (!strcmp(name, "json")) {
+        wireFormat = WIRE_JSON;
+    } else {
+        ESP_LOGW(TAG, "Unknown wire format %s", name);
+        return false;
+    }
+    ESP_LOGI(TAG, "Wire format %s", name);
+    return true;
+}
+
+void wireAddHello(cJSON *payload) {
+    // поддерживаемые форматы, сервер выбирает в AUTHORIZED
+    cJSON *jWire = cJSON_CreateArray();
+    cJSON_AddItemToArray(jWire, cJSON_CreateString("json"));
+    cJSON_AddItemToArray(jWire, cJSON_CreateString("cbor1"));
+    cJSON_AddItemToObject(payload, "wire", jWire);
+}
+
+void wireBenchItem(cJSON *results, const char *name, cJSON *message) {
+    // размер и время кодирования одного сообщения в обоих форматах
+    if (message == NULL)
+        return;
+    uint32_t start = xthal_get_ccount();
+    char *json = cJSON_PrintUnformatted(message);
+    uint32_t jsonCycles = xthal_get_ccount() - start;
+    cbor_t c;
+    cborInit(&c, NULL, 0);
+    cborJson(&c, message);
+    uint8_t *buf = malloc(c.len);
+    uint32_t cborCycles = 0;
+    uint32_t wrapCycles = 0;
+    char *text = NULL;
+    if (buf != NULL) {
+        start = xthal_get_ccount();
+        cborInit(&c, buf, c.len);
+        cborJson(&c, message);
+        cborCycles = xthal_get_ccount() - start;
+        start = xthal_get_ccount();
+        text = wireWrap(&c);
+        wrapCycles = xthal_get_ccount() - start;
+    }
+    cJSON *jItem = cJSON_CreateObject();
+    cJSON_AddStringToObject(jItem, "name", name);
+    cJSON_AddNumberToObject(jItem, "jsonBytes", json != NULL ? strlen(json) : 0);
+    cJSON_AddNumberToObject(jItem, "cborBytes", c.len);
+    cJSON_AddNumberToObject(jItem, "wireBytes", text != NULL ? strlen(text) : 0);
+    cJSON_AddNumberToObject(jItem, "jsonCycles", jsonCycles);
+    cJSON_AddNumberToObject(jItem, "cborCycles", cborCycles);
+    cJSON_AddNumberToObject(jItem, "base64Cycles", wrapCycles);
+    cJSON_AddItemToArray(results, jItem);
+    free(json);
+    free(buf);
+    free(text);
+}
+
+void wireAddInfo(cJSON *info) {
+    cJSON *jWire = cJSON_CreateObject();
+    cJSON_AddStringToObject(jWire, "format", wireFormat == WIRE_CBOR ? "cbor1" : "json");
+    cJSON_AddNumberToObject(jWire, "cborFrames", stats.frames);
+    cJSON_AddNumberToObject(jWire, "cborBytes", stats.bytes);
+    cJSON_AddItemToObject(info, "wire", jWire);
+}
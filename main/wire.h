@@ -0,0 +1,43 @@
+#pragma once
+#include <stddef.h>
+#include "esp_err.h"
+#include "cJSON.h"
+
+// Формат сообщений в облако. JSON по умолчанию, CBOR включается сервером через
+// "wire":"cbor1" в AUTHORIZED. Транспорт текстовый, поэтому CBOR кадр уходит как
+// 'C' + base64. cbor1 - CBOR, где известные ключи заменены номерами из словаря wire.c.
+
+enum wireFormats {
+    WIRE_JSON = 0,
+    WIRE_CBOR = 1
+};
+
+typedef struct {
+    uint8_t *buf;           // NULL - только подсчет длины
+    size_t cap;
+    size_t len;
+} cbor_t;
+
+void cborInit(cbor_t *c, uint8_t *buf, size_t cap);
+void cborMap(cbor_t *c, uint32_t count);
+void cborArray(cbor_t *c, uint32_t count);
+void cborUint(cbor_t *c, uint64_t value);
+void cborInt(cbor_t *c, int64_t value);
+void cborNumber(cbor_t *c, double value);
+void cborBool(cbor_t *c, bool value);
+void cborNull(cbor_t *c);
+void cborText(cbor_t *c, const char *text);
+void cborBytes(cbor_t *c, const void *data, size_t len);
+void cborKey(cbor_t *c, const char *key);
+void cborJson(cbor_t *c, cJSON *item);
+bool cborOverflow(cbor_t *c);
+
+void wireSetFormat(uint8_t format);
+uint8_t wireGetFormat();
+bool wireSelect(const char *name);
+void wireAddHello(cJSON *payload);
+char *wireWrap(cbor_t *c);
+char *wirePrint(cJSON *json, uint8_t format);
+bool wireSend(cJSON *json, uint8_t priority, bool force);
+void wireBenchItem(cJSON *results, const char *name, cJSON *message);
+void wireAddInfo(cJSON *info);
@@ -0,0 +1,250 @@
+#include <stdio.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "cJSON.h"
+#include "ws.h"
+#include "wssender.h"
+#include "tasks.h"
+
+// Асинхронная отправка в вебсокет.
+// Сообщения копируются в кольцевые очереди (по одной на приоритет) и отправляются
+// отдельным таском, поэтому медленная связь с облаком не блокирует inputsTask.
+// Очереди lock-free: ограниченная MPMC очередь с номером последовательности в каждой
+// ячейке (Vyukov), писателей много, читатель один (таск отправки), но при переполнении
+// LOG писатель сам забирает самый старый элемент.
+// STATE и LOG писатель никогда не ждет: wsSend зовут из inputsTask под sem_busy.
+// Переполненная STATE теряет новое сообщение; пропуск DELTA сервер видит по
+// base/seq и запрашивает SYNC, для старого протокола statesFlush досылает один
+// IOSTATES на все потери (wsSenderTakeStateDrop). Ответы CONTROL ничем не
+// восстанавливаются, поэтому при полной очереди писатель ждет место до
+// WS_CONTROL_WAIT_MS и только потом теряет сообщение.
+
+#define WS_QUEUE_SIZE       32          // степень двойки
+#define WS_HIST_BUCKETS     6
+#define WS_CONTROL_WAIT_MS  500
+
+static const char *TAG = "WSSENDER";
+
+typedef struct {
+    char *data;
+    int64_t queued;
+    bool force;
+} wsFrame_t;
+
+typedef struct {
+    volatile uint32_t seq;
+    wsFrame_t frame;
+} wsCell_t;
+
+typedef struct {
+    wsCell_t cells[WS_QUEUE_SIZE];
+    volatile uint32_t enqueuePos;
+    volatile uint32_t dequeuePos;
+    uint32_t sent;
+    uint32_t dropped;
+    uint32_t waits;             // писатель ждал место (CONTROL)
+    uint32_t hist[WS_HIST_BUCKETS];
+    uint32_t maxLatencyMs;
+} wsQueue_t;
+
+static wsQueue_t queues[WS_PRIO_COUNT];
+static TaskHandle_t senderTask = NULL;
+static volatile bool connected = false;
+static volatile bool stateDropped = false;
+static uint32_t sendMaxMs = 0;
+static const uint16_t histLimits[WS_HIST_BUCKETS-1] = {1, 5, 20, 100, 500}; // мс
+
+static bool queuePush(wsQueue_t *q, const wsFrame_t *frame) {
+    uint32_t pos = __atomic_load_n(&q->enqueuePos, __ATOMIC_RELAXED);
+    while (1) {
+        wsCell_t *cell = &q->cells[pos & (WS_QUEUE_SIZE - 1)];
+        uint32_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        int32_t diff = (int32_t)seq - (int32_t)pos;
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&q->enqueuePos, &pos, pos + 1, true,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                cell->frame = *frame;
+                __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+                return true;
+            }
+        } else if (diff < 0) {
+            return false; // full
+        } else {
+            pos = __atomic_load_n(&q->enqueuePos, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+static bool queuePop(wsQueue_t *q, wsFrame_t *frame) {
+    uint32_t pos = __atomic_load_n(&q->dequeuePos, __ATOMIC_RELAXED);
+    while (1) {
+        wsCell_t *cell = &q->cells[pos & (WS_QUEUE_SIZE - 1)];
+        uint32_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        int32_t diff = (int32_t)seq - (int32_t)(pos + 1);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&q->dequeuePos, &pos, pos + 1, true,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                *frame = cell->frame;
+                __atomic_store_n(&cell->seq, pos + WS_QUEUE_SIZE, __ATOMIC_RELEASE);
+                return true;
+            }
+        } else if (diff < 0) {
+            return false; // empty
+        } else {
+            pos = __atomic_load_n(&q->dequeuePos, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+static uint32_t queueDepth(wsQueue_t *q) {
+    return __atomic_load_n(&q->enqueuePos, __ATOMIC_RELAXED) -
+           __atomic_load_n(&q->dequeuePos, __ATOMIC_RELAXED);
+}
+
+static void dropOldestLog() {
+    wsFrame_t old;
+    if (queuePop(&queues[WS_PRIO_LOG], &old)) {
+        free(old.data);
+        __atomic_add_fetch(&queues[WS_PRIO_LOG].dropped, 1, __ATOMIC_RELAXED);
+    }
+}
+
+bool wsSend(const char *message, uint8_t priority, bool force) {
+    // не логировать здесь: вызывается и из custom_vprintf
+    if (message == NULL || priority >= WS_PRIO_COUNT || senderTask == NULL)
+        return false;
+    if (!connected)
+        return false;
+    wsFrame_t frame;
+    frame.data = strdup(message);
+    if (frame.data == NULL && priority != WS_PRIO_LOG) {
+        // памяти нет - освобождаем ее за счет логов
+        while (queueDepth(&queues[WS_PRIO_LOG]) > 0 && frame.data == NULL) {
+            dropOldestLog();
+            frame.data = strdup(message);
+        }
+    }
+    if (frame.data == NULL) {
+        __atomic_add_fetch(&queues[priority].dropped, 1, __ATOMIC_RELAXED);
+        return false;
+    }
+    frame.queued = esp_timer_get_time();
+    frame.force = force;
+    wsQueue_t *q = &queues[priority];
+    bool ok = queuePush(q, &frame);
+    if (!ok && priority == WS_PRIO_LOG) {
+        // лог: выкидываем самый старый
+        dropOldestLog();
+        ok = queuePush(q, &frame);
+    }
+    if (!ok && priority == WS_PRIO_CONTROL && xTaskGetCurrentTaskHandle() != senderTask) {
+        // ждем, пока таск отправки разгрузит очередь
+        __atomic_add_fetch(&q->waits, 1, __ATOMIC_RELAXED);
+        xTaskNotifyGive(senderTask);
+        int64_t deadline = esp_timer_get_time() + WS_CONTROL_WAIT_MS * 1000;
+        while (!(ok = queuePush(q, &frame)) && connected && esp_timer_get_time() < deadline)
+            vTaskDelay(1);
+    }
+    if (!ok) {
+        free(frame.data);
+        __atomic_add_fetch(&q->dropped, 1, __ATOMIC_RELAXED);
+        if (priority == WS_PRIO_STATE)
+            stateDropped = true;
+        return false;
+    }
+    xTaskNotifyGive(senderTask);
+    return true;
+}
+
+static void account(wsQueue_t *q, int64_t queued) {
+    uint32_t ms = (esp_timer_get_time() - queued) / 1000;
+    uint8_t b = 0;
+    while (b < WS_HIST_BUCKETS - 1 && ms >= histLimits[b])
+        b++;
+    q->hist[b]++;
+    q->sent++;
+    if (ms > q->maxLatencyMs)
+        q->maxLatencyMs = ms;
+}
+
+static void wsSenderTask(void *pvParameter) {
+    wsFrame_t frame;
+    while (1) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        // сначала состояния, затем управляющие, логи в последнюю очередь
+        uint8_t prio = 0;
+        while (prio < WS_PRIO_COUNT) {
+            if (!queuePop(&queues[prio], &frame)) {
+                prio++;
+                continue;
+            }
+            if (connected) {
+                int64_t start = esp_timer_get_time();
+                if (frame.force)
+                    WSSendMessageForce(frame.data);
+                else
+                    WSSendMessage(frame.data);
+                uint32_t ms = (esp_timer_get_time() - start) / 1000;
+                if (ms > sendMaxMs)
+                    sendMaxMs = ms;
+                account(&queues[prio], frame.queued);
+            } else {
+                __atomic_add_fetch(&queues[prio].dropped, 1, __ATOMIC_RELAXED);
+            }
+            free(frame.data);
+            prio = 0;
+        }
+    }
+}
+
+bool wsSenderTakeStateDrop() {
+    // были потери STATE с прошлого вызова, и очередь уже разгрузилась
+    if (!stateDropped || queueDepth(&queues[WS_PRIO_STATE]) >= WS_QUEUE_SIZE / 2)
+        return false;
+    stateDropped = false;
+    return true;
+}
+
+void wsSenderSetConnected(bool value) {
+    connected = value;
+    if (senderTask != NULL)
+        xTaskNotifyGive(senderTask);
+}
+
+void wsSenderInit() {
+    if (senderTask != NULL)
+        return;
+    for (uint8_t p = 0; p < WS_PRIO_COUNT; p++) {
+        memset(&queues[p], 0, sizeof(wsQueue_t));
+        for (uint32_t i = 0; i < WS_QUEUE_SIZE; i++)
+            queues[p].cells[i].seq = i;
+    }
+    senderTask = taskStart(TASK_WS_SENDER, &wsSenderTask, NULL);
+    ESP_LOGI(TAG, "WS sender started");
+}
+
+void wsSenderAddInfo(cJSON *info) {
+    static const char *names[WS_PRIO_COUNT] = {"state", "control", "log"};
+    if (senderTask == NULL)
+        return;
+    cJSON *jSender = cJSON_CreateObject();
+    for (uint8_t p = 0; p < WS_PRIO_COUNT; p++) {
+        cJSON *jQueue = cJSON_CreateObject();
+        cJSON_AddNumberToObject(jQueue, "depth", queueDepth(&queues[p]));
+        cJSON_AddNumberToObject(jQueue, "sent", queues[p].sent);
+        cJSON_AddNumberToObject(jQueue, "dropped", queues[p].dropped);
+        cJSON_AddNumberToObject(jQueue, "waits", queues[p].waits);
+        cJSON_AddNumberToObject(jQueue, "maxLatencyMs", queues[p].maxLatencyMs);
+        // гистограмма задержки от постановки в очередь до отправки: <1, <5, <20, <100, <500, >=500 мс
+        cJSON *jHist = cJSON_CreateArray();
+        for (uint8_t b = 0; b < WS_HIST_BUCKETS; b++)
+            cJSON_AddItemToArray(jHist, cJSON_CreateNumber(queues[p].hist[b]));
+        cJSON_AddItemToObject(jQueue, "latency", jHist);
+        cJSON_AddItemToObject(jSender, names[p], jQueue);
+    }
+    cJSON_AddNumberToObject(jSender, "sendMaxMs", sendMaxMs);
+    cJSON_AddItemToObject(info, "wsSender", jSender);
+}
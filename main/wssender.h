@@ -0,0 +1,16 @@
+#pragma once
+#include "cJSON.h"
+
+// приоритеты очередей отправки в вебсокет
+enum wsPriorities {
+    WS_PRIO_STATE = 0,      // UPDATE, IOSTATES, DELTA - первыми, при переполнении теряются новые
+    WS_PRIO_CONTROL = 1,    // HELLO, INFO, ответы на запросы - при переполнении ждут место
+    WS_PRIO_LOG = 2,        // LOG - при переполнении отбрасываются самые старые
+    WS_PRIO_COUNT
+};
+
+void wsSenderInit();
+void wsSenderSetConnected(bool connected);
+bool wsSend(const char *message, uint8_t priority, bool force);
+bool wsSenderTakeStateDrop();
+void wsSenderAddInfo(cJSON *info);